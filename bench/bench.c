@@ -0,0 +1,349 @@
+/* Keystroke replay benchmark. Generated files are opened in the editor and
+ * key traces are fed through editorProcessKeypress and editorRefreshScreen,
+ * with the screen going to a pseudo-tty whose master side is drained by a
+ * thread. Idle work queued by the open, such as highlighting, is run to
+ * completion and timed separately before a trace starts. Results are
+ * printed as JSON. */
+#include "main.h"
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <time.h>
+
+#define BENCH_DEFAULT_SIZES "1K,64K,1M,16M"
+#define BENCH_DEFAULT_KEYS 2000
+
+typedef struct benchTrace {
+  const char *name;
+  abuf keys;
+} benchTrace;
+
+typedef struct benchSink {
+  int master;
+  long long bytes;
+  int markers;
+} benchSink;
+
+static const char *benchLines[] = {
+    "#include <stdio.h>",
+    "",
+    "/* Compute a running checksum over the input buffer. */",
+    "static unsigned long checksum(const char *buf, size_t len) {",
+    "\tunsigned long sum = 0;",
+    "\tfor (size_t i = 0; i < len; i++)",
+    "\t\tsum = sum * 31 + (unsigned char)buf[i];",
+    "\treturn sum;",
+    "}",
+    "int main(int argc, char **argv) {",
+    "\tconst char *name = argc > 1 ? argv[1] : \"world\";",
+    "\tprintf(\"hello, %s: %lu\\n\", name, checksum(name, 5));",
+    "\t\t\t// deeply\tindented\tline\twith\ttabs",
+    "\treturn 0;",
+    "}",
+};
+
+long long benchNow(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+long long benchParseSize(const char *s) {
+  char *unit;
+  long long n = strtoll(s, &unit, 10);
+  if (*unit == 'k' || *unit == 'K')
+    n *= 1024;
+  else if (*unit == 'm' || *unit == 'M')
+    n *= 1024 * 1024;
+  else if (*unit == 'g' || *unit == 'G')
+    n *= 1024LL * 1024 * 1024;
+  return n;
+}
+
+int benchGenerate(const char *path, long long size) {
+  FILE *fp = fopen(path, "w");
+  if (!fp)
+    return -1;
+  int numLines = sizeof(benchLines) / sizeof(benchLines[0]);
+  long long written = 0;
+  for (int i = 0; written < size; i = (i + 1) % numLines) {
+    fputs(benchLines[i], fp);
+    fputc('\n', fp);
+    written += strlen(benchLines[i]) + 1;
+  }
+  return fclose(fp);
+}
+
+void *benchDrain(void *arg) {
+  benchSink *sink = arg;
+  char buf[65536];
+  ssize_t n;
+  while ((n = read(sink->master, buf, sizeof(buf))) > 0) {
+    /* A NUL marks the end of a run; the editor never writes one. */
+    char *p = buf, *end = buf + n, *nul;
+    while ((nul = memchr(p, '\0', end - p)) != NULL) {
+      __atomic_add_fetch(&sink->bytes, nul - p, __ATOMIC_RELAXED);
+      __atomic_add_fetch(&sink->markers, 1, __ATOMIC_RELEASE);
+      p = nul + 1;
+    }
+    __atomic_add_fetch(&sink->bytes, end - p, __ATOMIC_RELAXED);
+  }
+  return NULL;
+}
+
+/* Waits until everything written so far has reached the sink. */
+void benchFlush(benchSink *sink) {
+  int want = __atomic_load_n(&sink->markers, __ATOMIC_ACQUIRE) + 1;
+  write(STDOUT_FILENO, "", 1);
+  while (__atomic_load_n(&sink->markers, __ATOMIC_ACQUIRE) < want)
+    sched_yield();
+}
+
+void benchKeys(abuf *ab, const char *key, int times) {
+  for (int i = 0; i < times; i++)
+    abAppend(ab, key, strlen(key));
+}
+
+void benchBuildTraces(benchTrace *traces, int keys) {
+  const char *text = "int value = compute(x, y); /* note */";
+  int textLen = strlen(text);
+
+  traces[0].name = "typing";
+  for (int i = 0; i < keys; i++) {
+    int col = i % (textLen + 1);
+    abAppend(&traces[0].keys, col == textLen ? "\r" : &text[col], 1);
+  }
+
+  traces[1].name = "paste";
+  benchKeys(&traces[1].keys, "\x03", 1);
+  for (int i = 1; i < keys; i += 2)
+    benchKeys(&traces[1].keys, "\x16\r", 1);
+
+  traces[2].name = "scroll";
+  benchKeys(&traces[2].keys, "\x1b[6~", keys / 4);
+  benchKeys(&traces[2].keys, "\x1b[B", keys / 4);
+  benchKeys(&traces[2].keys, "\x1b[5~", keys / 4);
+  benchKeys(&traces[2].keys, "\x1b[A", keys - 3 * (keys / 4));
+
+  traces[3].name = "mass_delete";
+  benchKeys(&traces[3].keys, "\x7f", keys);
+
+  traces[4].name = "undo_storm";
+  for (int done = 0; done < keys; done += 150) {
+    for (int i = 0; i < 50; i++)
+      abAppend(&traces[4].keys, &text[i % textLen], 1);
+    benchKeys(&traces[4].keys, "\x1a", 50);
+    benchKeys(&traces[4].keys, "\x19", 50);
+  }
+}
+
+/* Length of the key starting at p: one byte, or a whole escape sequence. */
+int benchKeyLength(const char *p, const char *end) {
+  if (p[0] != '\x1b' || p + 1 >= end || (p[1] != '[' && p[1] != 'O'))
+    return 1;
+  const char *q = p + 2;
+  while (q < end && !(*q >= 0x40 && *q <= 0x7e))
+    q++;
+  return q < end ? q - p + 1 : end - p;
+}
+
+int benchCompare(const void *a, const void *b) {
+  long long x = *(const long long *)a, y = *(const long long *)b;
+  return x < y ? -1 : x > y;
+}
+
+long benchPeakRss(void) {
+  FILE *fp = fopen("/proc/self/status", "r");
+  char line[256];
+  long kb = -1;
+  while (fp && fgets(line, sizeof(line), fp))
+    if (sscanf(line, "VmHWM: %ld", &kb) == 1)
+      break;
+  if (fp)
+    fclose(fp);
+  if (kb < 0) {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    kb = ru.ru_maxrss;
+  }
+  return kb;
+}
+
+void benchResetPeakRss(void) {
+  int fd = open("/proc/self/clear_refs", O_WRONLY);
+  if (fd != -1) {
+    write(fd, "5", 1);
+    close(fd);
+  }
+}
+
+void benchRun(FILE *out, int *first, benchSink *sink, int keyFd,
+              const char *path, long long size, benchTrace *trace) {
+  benchResetPeakRss();
+  long long t0 = benchNow();
+  editorOpen((char *)path);
+  long long openNs = benchNow() - t0;
+  t0 = benchNow();
+  while (editorIdlePending())
+    editorIdleRun();
+  long long idleNs = benchNow() - t0;
+  int lines = E.numrows;
+  E.cy = E.numrows / 2;
+  E.cx = 0;
+  editorRefreshScreen();
+  benchFlush(sink);
+  long long bytesBefore = __atomic_load_n(&sink->bytes, __ATOMIC_RELAXED);
+  long syscallsBefore = E.prof.syscalls;
+
+  const char *p = trace->keys.b, *end = trace->keys.b + trace->keys.len;
+  int numKeys = 0;
+  long long *lat = malloc(sizeof(long long) * (trace->keys.len + 1));
+  long long start = benchNow();
+  while (p < end) {
+    int len = benchKeyLength(p, end);
+    write(keyFd, p, len);
+    p += len;
+    long long k0 = benchNow();
+    editorProcessKeypress();
+    editorRefreshScreen();
+    lat[numKeys++] = benchNow() - k0;
+  }
+  long long elapsed = benchNow() - start;
+  benchFlush(sink);
+
+  qsort(lat, numKeys, sizeof(long long), benchCompare);
+  fprintf(out,
+          "%s\n    {\"file_bytes\": %lld, \"lines\": %d, \"open_ms\": %.3f, "
+          "\"idle_ms\": %.3f, \"trace\": \"%s\", \"keys\": %d, "
+          "\"seconds\": %.6f, \"keys_per_sec\": %.1f, \"p50_us\": %.2f, "
+          "\"p99_us\": %.2f, \"bytes_written\": %lld, \"syscalls\": %ld, "
+          "\"peak_rss_kb\": %ld}",
+          *first ? "" : ",", size, lines, openNs / 1e6, idleNs / 1e6,
+          trace->name, numKeys, elapsed / 1e9,
+          elapsed ? numKeys / (elapsed / 1e9) : 0.0,
+          numKeys ? lat[numKeys / 2] / 1e3 : 0.0,
+          numKeys ? lat[(int)(numKeys * 0.99)] / 1e3 : 0.0,
+          __atomic_load_n(&sink->bytes, __ATOMIC_RELAXED) - bytesBefore,
+          E.prof.syscalls - syscallsBefore, benchPeakRss());
+  fflush(out);
+  *first = 0;
+  free(lat);
+}
+
+int main(int argc, char *argv[]) {
+  const char *sizes = BENCH_DEFAULT_SIZES;
+  const char *only = NULL;
+  const char *replay = NULL;
+  int keys = BENCH_DEFAULT_KEYS, rows = 24, cols = 80;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--sizes") == 0 && i + 1 < argc)
+      sizes = argv[++i];
+    else if (strcmp(argv[i], "--keys") == 0 && i + 1 < argc)
+      keys = atoi(argv[++i]);
+    else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc)
+      only = argv[++i];
+    else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc)
+      replay = argv[++i];
+    else if (strcmp(argv[i], "--screen") == 0 && i + 2 < argc) {
+      rows = atoi(argv[++i]);
+      cols = atoi(argv[++i]);
+    } else {
+      fprintf(stderr,
+              "usage: %s [--sizes 1K,1M,1G] [--keys N] [--trace NAME] "
+              "[--replay FILE] [--screen ROWS COLS]\n",
+              argv[0]);
+      return 2;
+    }
+  }
+
+  benchTrace traces[6];
+  memset(traces, 0, sizeof(traces));
+  benchBuildTraces(traces, keys);
+  int numTraces = 5;
+  if (replay) {
+    /* A raw capture of terminal input, e.g. recorded with `cat > FILE`. */
+    FILE *fp = fopen(replay, "rb");
+    if (!fp) {
+      perror(replay);
+      return 1;
+    }
+    char buf[4096];
+    size_t n;
+    traces[numTraces].name = "replay";
+    while ((n = fread(buf, 1, sizeof(buf), fp)) > 0)
+      abAppend(&traces[numTraces].keys, buf, n);
+    fclose(fp);
+    numTraces++;
+  }
+
+  /* The screen goes to a pty so the editor sees a real terminal size. */
+  int master = posix_openpt(O_RDWR | O_NOCTTY);
+  if (master == -1 || grantpt(master) == -1 || unlockpt(master) == -1) {
+    perror("posix_openpt");
+    return 1;
+  }
+  int slave = open(ptsname(master), O_RDWR | O_NOCTTY);
+  if (slave == -1) {
+    perror("open pty");
+    return 1;
+  }
+  struct termios raw;
+  tcgetattr(slave, &raw);
+  cfmakeraw(&raw);
+  tcsetattr(slave, TCSANOW, &raw);
+  struct winsize ws = {rows, cols, 0, 0};
+  ioctl(slave, TIOCSWINSZ, &ws);
+
+  int keyPipe[2];
+  if (pipe(keyPipe) == -1) {
+    perror("pipe");
+    return 1;
+  }
+  fcntl(keyPipe[0], F_SETFL, O_NONBLOCK);
+
+  FILE *out = fdopen(dup(STDOUT_FILENO), "w");
+  dup2(slave, STDOUT_FILENO);
+  dup2(keyPipe[0], STDIN_FILENO);
+  close(slave);
+  close(keyPipe[0]);
+
+  benchSink sink = {master, 0, 0};
+  pthread_t drain;
+  pthread_create(&drain, NULL, benchDrain, &sink);
+
+  initEditor();
+  /* Every trace reopens the same file with unsaved edits, which would leave
+   * a swap file for the next open to find. */
+  E.swap.disabled = 1;
+
+  char dir[] = "/tmp/ctextedit-bench.XXXXXX";
+  if (!mkdtemp(dir)) {
+    perror("mkdtemp");
+    return 1;
+  }
+
+  fprintf(out, "{\n  \"version\": \"%s\", \"rows\": %d, \"cols\": %d,\n"
+               "  \"results\": [",
+          CTEXTEDIT_VERSION, rows, cols);
+  int first = 1;
+  char *list = strdup(sizes);
+  for (char *tok = strtok(list, ","); tok; tok = strtok(NULL, ",")) {
+    long long size = benchParseSize(tok);
+    char path[512];
+    snprintf(path, sizeof(path), "%s/bench-%s.c", dir, tok);
+    if (benchGenerate(path, size) == -1) {
+      perror(path);
+      continue;
+    }
+    for (int t = 0; t < numTraces; t++)
+      if (!only || strcmp(only, traces[t].name) == 0)
+        benchRun(out, &first, &sink, keyPipe[1], path, size, &traces[t]);
+    unlink(path);
+  }
+  fprintf(out, "\n  ]\n}\n");
+  fclose(out);
+  free(list);
+  rmdir(dir);
+  for (int t = 0; t < numTraces; t++)
+    abFree(&traces[t].keys);
+  return 0;
+}
@@ -0,0 +1,347 @@
+/* Microbenchmarks for the row primitives. Every case reports the median
+ * ns/op over several repeats, and the cost relative to a fixed calibration
+ * loop so that a baseline recorded on one machine is usable on another.
+ *
+ *   micro                      print results
+ *   micro --write FILE         store results as the baseline
+ *   micro --check FILE [--tolerance 0.3]
+ *                              fail if any case is slower than its baseline
+ */
+#include "main.h"
+#include <time.h>
+
+#define MICRO_REPEATS 7
+#define MICRO_RETRIES 3
+#define MICRO_BASELINE_RUNS 3
+#define MICRO_MIN_NS 10000000LL
+#define MICRO_SHORT_OPS 4096
+#define MICRO_MAX_CASES 128
+#define MICRO_LINE_MAX 4096
+
+typedef struct microResult {
+  char name[64];
+  double ns;
+  double relative;
+} microResult;
+
+typedef struct microCase {
+  const char *op;
+  int rows;
+  int len;
+  int tabs;
+} microCase;
+
+char microLine[MICRO_LINE_MAX];
+volatile unsigned long microSink;
+
+long long microNow(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* Fills microLine with C-like text where roughly tabs percent of the bytes
+ * are tabs. */
+void microMakeLine(int len, int tabs) {
+  const char *text = "for (int i = 0; i < n; i++) sum += value[i] * 31; ";
+  int textLen = strlen(text);
+  unsigned seed = 12345;
+  for (int i = 0; i < len; i++) {
+    seed = seed * 1103515245 + 12345;
+    int isTab = (int)((seed >> 16) % 100) < tabs;
+    microLine[i] = isTab ? '\t' : text[i % textLen];
+  }
+  microLine[len] = '\0';
+}
+
+void microFill(int rows, int len, int tabs) {
+  editorClearRows();
+  microMakeLine(len, tabs);
+  for (int i = 0; i < rows; i++)
+    editorInsertRow(E.numrows, microLine, len);
+  /* Rows a pending highlight pass has not reached are not tokenized by
+   * editorUpdateRow, so the pass is finished before anything is timed. */
+  while (E.syntaxPending)
+    editorSyntaxStep();
+}
+
+/* Runs one batch of the case's operation and adds the time spent in the
+ * operation itself to *ns. Work that restores the buffer afterwards is not
+ * timed. Returns the number of operations. */
+long microBatch(const microCase *c, long long *ns) {
+  erow *row = &E.row[0];
+  long long start = microNow();
+  long ops = 0;
+
+  if (strcmp(c->op, "calibration") == 0) {
+    unsigned long h = 14695981039346656037UL;
+    for (int i = 0; i < 65536; i++)
+      h = (h ^ (unsigned char)microLine[i & 63]) * 1099511628211UL;
+    microSink = h;
+    ops = 1;
+  } else if (strcmp(c->op, "insert_row") == 0) {
+    for (int i = 0; i < 256; i++)
+      editorInsertRow(E.numrows / 2, microLine, c->len);
+    *ns += microNow() - start;
+    for (int i = 0; i < 256; i++)
+      editorDelRow(E.numrows / 2);
+    return 256;
+  } else if (strcmp(c->op, "del_row") == 0) {
+    for (int i = 0; i < 256; i++)
+      editorDelRow(E.numrows / 2);
+    *ns += microNow() - start;
+    for (int i = 0; i < 256; i++)
+      editorInsertRow(E.numrows / 2, microLine, c->len);
+    return 256;
+  } else if (strcmp(c->op, "row_insert_char") == 0) {
+    for (int i = 0; i < 64; i++)
+      editorRowInsertChar(row, row->size / 2, 'x');
+    *ns += microNow() - start;
+    for (int i = 0; i < 64; i++)
+      editorRowDelChar(row, row->size / 2);
+    return 64;
+  } else if (strcmp(c->op, "row_append_string") == 0) {
+    for (int i = 0; i < 64; i++)
+      editorRowAppendString(row, "appended text!\t", 15);
+    *ns += microNow() - start;
+    row->size = c->len;
+    row->chars[row->size] = '\0';
+    editorUpdateRow(row);
+    return 64;
+  } else if (strcmp(c->op, "update_row") == 0) {
+    for (int i = 0; i < 64; i++)
+      editorUpdateRow(row);
+    ops = 64;
+  } else if (strcmp(c->op, "cx_to_rx") == 0) {
+    /* A conversion takes a few nanoseconds, so a batch runs enough of them
+     * that the clock reads and loop setup do not show in the result. */
+    unsigned long sum = 0;
+    for (int i = 0; i < MICRO_SHORT_OPS; i++)
+      sum += editorRowCxToRx(row, row->size - (i & 7));
+    microSink = sum;
+    ops = MICRO_SHORT_OPS;
+  } else if (strcmp(c->op, "rows_to_string") == 0) {
+    int len;
+    char *buf = editorRowsToString(&len);
+    microSink = buf[len - 1];
+    free(buf);
+    ops = 1;
+  }
+  *ns += microNow() - start;
+  return ops;
+}
+
+void microCaseName(const microCase *c, char *name, size_t size) {
+  if (strcmp(c->op, "calibration") == 0)
+    snprintf(name, size, "calibration");
+  else if (c->rows > 1)
+    snprintf(name, size, "%s/rows=%d/len=%d/tabs=%d", c->op, c->rows, c->len,
+             c->tabs);
+  else
+    snprintf(name, size, "%s/len=%d/tabs=%d", c->op, c->len, c->tabs);
+}
+
+int microCompare(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return x < y ? -1 : x > y;
+}
+
+double microRun(const microCase *c) {
+  microFill(c->rows, c->len, c->tabs);
+  double ns[MICRO_REPEATS];
+  for (int r = 0; r < MICRO_REPEATS; r++) {
+    long ops = 0;
+    long long elapsed = 0;
+    do
+      ops += microBatch(c, &elapsed);
+    while (elapsed < MICRO_MIN_NS);
+    ns[r] = (double)elapsed / ops;
+  }
+  qsort(ns, MICRO_REPEATS, sizeof(double), microCompare);
+  return ns[MICRO_REPEATS / 2];
+}
+
+/* Measures case i, relative to a calibration taken right before it so that
+ * a slow stretch on the machine affects both sides of the ratio. Case 0 is
+ * the calibration loop itself. */
+void microMeasure(const microCase *cases, int i, microResult *result) {
+  double calibration = microRun(&cases[0]);
+  result->ns = i > 0 ? microRun(&cases[i]) : calibration;
+  result->relative = result->ns / calibration;
+}
+
+int microBuildCases(microCase *cases) {
+  static const char *rowOps[] = {"row_insert_char", "row_append_string",
+                                 "update_row", "cx_to_rx"};
+  static const char *bufferOps[] = {"insert_row", "del_row",
+                                    "rows_to_string"};
+  static const int lens[] = {16, 80, 1000};
+  static const int tabs[] = {0, 10, 50};
+  static const int buffers[][2] = {{1000, 80}, {100000, 80}, {1000, 1000}};
+  int n = 0;
+
+  cases[n++] = (microCase){"calibration", 1, 64, 0};
+  for (int o = 0; o < 4; o++)
+    for (int l = 0; l < 3; l++)
+      for (int t = 0; t < 3; t++)
+        cases[n++] = (microCase){rowOps[o], 1, lens[l], tabs[t]};
+  for (int o = 0; o < 3; o++)
+    for (int b = 0; b < 3; b++)
+      cases[n++] =
+          (microCase){bufferOps[o], buffers[b][0], buffers[b][1], 10};
+  return n;
+}
+
+int microLoad(const char *path, microResult *base, int max) {
+  FILE *fp = fopen(path, "r");
+  if (!fp)
+    return -1;
+  char line[256];
+  int n = 0;
+  while (n < max && fgets(line, sizeof(line), fp)) {
+    if (line[0] == '#')
+      continue;
+    if (sscanf(line, "%63s %lf %lf", base[n].name, &base[n].relative,
+               &base[n].ns) == 3)
+      n++;
+  }
+  fclose(fp);
+  return n;
+}
+
+const microResult *microFind(const microResult *base, int numBase,
+                             const char *name) {
+  for (int i = 0; i < numBase; i++)
+    if (strcmp(base[i].name, name) == 0)
+      return &base[i];
+  return NULL;
+}
+
+/* A case regresses when it is slower than its baseline by more than the
+ * tolerance, relative to the calibration loop. */
+int microRegressed(const microResult *r, const microResult *b,
+                   double tolerance) {
+  return r->relative / b->relative - 1 > tolerance;
+}
+
+int main(int argc, char *argv[]) {
+  const char *writePath = NULL, *checkPath = NULL;
+  double tolerance = 0.3;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--write") == 0 && i + 1 < argc)
+      writePath = argv[++i];
+    else if (strcmp(argv[i], "--check") == 0 && i + 1 < argc)
+      checkPath = argv[++i];
+    else if (strcmp(argv[i], "--tolerance") == 0 && i + 1 < argc)
+      tolerance = atof(argv[++i]);
+    else {
+      fprintf(stderr,
+              "usage: %s [--write FILE | --check FILE [--tolerance F]]\n",
+              argv[0]);
+      return 2;
+    }
+  }
+
+  microResult base[MICRO_MAX_CASES];
+  int numBase = 0;
+  if (checkPath) {
+    numBase = microLoad(checkPath, base, MICRO_MAX_CASES);
+    if (numBase < 0) {
+      perror(checkPath);
+      return 2;
+    }
+  }
+
+  E.headless = 1;
+  initEditor();
+  editorDetectLanguage("micro.c");
+
+  microCase cases[MICRO_MAX_CASES];
+  microResult results[MICRO_MAX_CASES];
+  int numCases = microBuildCases(cases);
+  for (int i = 0; i < numCases; i++) {
+    microCaseName(&cases[i], results[i].name, sizeof(results[i].name));
+    microMeasure(cases, i, &results[i]);
+  }
+
+  /* A baseline stores the median of several complete runs rather than one
+   * lucky run. */
+  if (writePath) {
+    static microResult runs[MICRO_BASELINE_RUNS][MICRO_MAX_CASES];
+    for (int run = 1; run < MICRO_BASELINE_RUNS; run++)
+      for (int i = 0; i < numCases; i++)
+        microMeasure(cases, i, &runs[run][i]);
+    for (int i = 0; i < numCases; i++) {
+      double ns[MICRO_BASELINE_RUNS], relative[MICRO_BASELINE_RUNS];
+      runs[0][i] = results[i];
+      for (int run = 0; run < MICRO_BASELINE_RUNS; run++) {
+        ns[run] = runs[run][i].ns;
+        relative[run] = runs[run][i].relative;
+      }
+      qsort(ns, MICRO_BASELINE_RUNS, sizeof(double), microCompare);
+      qsort(relative, MICRO_BASELINE_RUNS, sizeof(double), microCompare);
+      results[i].ns = ns[MICRO_BASELINE_RUNS / 2];
+      results[i].relative = relative[MICRO_BASELINE_RUNS / 2];
+    }
+  }
+
+  /* Cases over the threshold are measured again at the end of the run, so
+   * a burst of noise on the machine does not fail the check. A case keeps
+   * its best ratio. */
+  for (int pass = 0; checkPath && pass < MICRO_RETRIES; pass++) {
+    int suspects = 0;
+    for (int i = 1; i < numCases; i++) {
+      const microResult *b = microFind(base, numBase, results[i].name);
+      if (!b || !microRegressed(&results[i], b, tolerance))
+        continue;
+      suspects++;
+      microResult retry;
+      microMeasure(cases, i, &retry);
+      if (retry.relative < results[i].relative) {
+        results[i].ns = retry.ns;
+        results[i].relative = retry.relative;
+      }
+    }
+    if (!suspects)
+      break;
+  }
+
+  int regressions = 0;
+  for (int i = 0; i < numCases; i++) {
+    microResult *r = &results[i];
+    const microResult *b = microFind(base, numBase, r->name);
+    if (!checkPath) {
+      printf("%-44s %12.1f ns/op\n", r->name, r->ns);
+    } else if (!b) {
+      printf("%-44s %12.1f ns/op  (not in baseline)\n", r->name, r->ns);
+    } else {
+      double change = r->relative / b->relative - 1;
+      int regressed = i > 0 && microRegressed(r, b, tolerance);
+      regressions += regressed;
+      printf("%-44s %12.1f ns/op  %+6.1f%%%s\n", r->name, r->ns,
+             change * 100, regressed ? "  REGRESSED" : "");
+    }
+  }
+
+  if (writePath) {
+    FILE *fp = fopen(writePath, "w");
+    if (!fp) {
+      perror(writePath);
+      return 2;
+    }
+    fprintf(fp, "# ctextedit row primitive baseline; regenerate with "
+                "`micro --write FILE`\n"
+                "# name relative_to_calibration ns_per_op\n");
+    for (int i = 0; i < numCases; i++)
+      fprintf(fp, "%s %.9f %.1f\n", results[i].name, results[i].relative,
+              results[i].ns);
+    fclose(fp);
+  }
+
+  if (regressions) {
+    printf("%d primitive%s regressed by more than %.0f%%\n", regressions,
+           regressions == 1 ? "" : "s", tolerance * 100);
+    return 1;
+  }
+  return 0;
+}
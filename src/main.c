@@ -1,28 +1,277 @@
 #include "main.h"
 #include <assert.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include <fcntl.h>
+#include <fnmatch.h>
 #include <stdarg.h>
+#include <stddef.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+#include <sys/mman.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
 #include <time.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
 
 editorConfig E;
 
-void *editorMalloc(size_t size) {
-  void *ptr = malloc(size);
+const char *MEM_TAG_NAMES[MEM_TAGS] = {"rows", "render", "tokens", "undo",
+                                       "clip", "term",   "browser", "misc"};
+
+void *editorMalloc(size_t size) { return editorAlloc(MEM_MISC, size); }
+
+void editorFree(void *ptr) { editorRelease(ptr); }
+
+/* Counters are atomic because the directory scanner allocates on its own
+ * thread and snapshots can be released from worker threads. The total is
+ * summed when read so an allocation touches as few of them as possible. */
+void editorMemCount(int tag, int buffer, long long delta) {
+  __atomic_add_fetch(&E.mem.bytes[tag], delta, __ATOMIC_RELAXED);
+  if (buffer >= 0)
+    __atomic_add_fetch(&E.mem.buffers[buffer], delta, __ATOMIC_RELAXED);
+}
+
+/* Sums the subsystem counters and records the peak. */
+long long editorMemTotal(void) {
+  long long total = 0;
+  for (int i = 0; i < MEM_TAGS; i++)
+    total += __atomic_load_n(&E.mem.bytes[i], __ATOMIC_RELAXED);
+  if (total > E.mem.peak)
+    E.mem.peak = total;
+  return total;
+}
+
+/* Every block carries a header with its size, subsystem and owning buffer,
+ * so it can be released without the caller knowing any of them. Row store
+ * memory belongs to the current buffer; everything else is shared. */
+void *editorAlloc(int tag, size_t size) {
+  memHeader *h = malloc(MEM_HEADER_SIZE + size);
+  if (!h)
+    die("Memory allocation failed");
+  h->size = size;
+  h->tag = tag;
+  h->buffer = tag <= MEM_TOKENS ? E.currentTab : -1;
+  editorMemCount(tag, h->buffer, size);
+  return (char *)h + MEM_HEADER_SIZE;
+}
+
+void *editorRealloc(int tag, void *ptr, size_t size) {
   if (!ptr)
+    return editorAlloc(tag, size);
+  memHeader *h = (memHeader *)((char *)ptr - MEM_HEADER_SIZE);
+  long long delta = (long long)size - (long long)h->size;
+  h = realloc(h, MEM_HEADER_SIZE + size);
+  if (!h)
     die("Memory allocation failed");
-  return ptr;
+  h->size = size;
+  editorMemCount(h->tag, h->buffer, delta);
+  return (char *)h + MEM_HEADER_SIZE;
+}
+
+char *editorStrdup(int tag, const char *s) {
+  size_t len = strlen(s) + 1;
+  return memcpy(editorAlloc(tag, len), s, len);
+}
+
+void editorRelease(void *ptr) {
+  if (!ptr)
+    return;
+  memHeader *h = (memHeader *)((char *)ptr - MEM_HEADER_SIZE);
+  editorMemCount(h->tag, h->buffer, -(long long)h->size);
+  free(h);
+}
+
+/* Parses a byte count with an optional k or M suffix. */
+unsigned long long editorParseSize(const char *s) {
+  char *unit;
+  unsigned long long size = strtoull(s, &unit, 10);
+  if (*unit == 'k' || *unit == 'K')
+    size *= 1024;
+  else if (*unit == 'm' || *unit == 'M')
+    size *= 1024 * 1024;
+  else if (*unit == 'g' || *unit == 'G')
+    size *= 1024 * 1024 * 1024ULL;
+  return size;
+}
+
+/* Undo history and the clipboard are fixed arrays in the editor state, so
+ * they are charged once here rather than per allocation. */
+void editorMemInit(void) {
+  memStats *m = &E.mem;
+  editorMemCount(MEM_UNDO, -1, sizeof(E.undoStack) - m->bytes[MEM_UNDO]);
+  editorMemCount(MEM_CLIPBOARD, -1,
+                 sizeof(E.clipboard) - m->bytes[MEM_CLIPBOARD]);
+  char *budget = getenv("CTEXTEDIT_MEM_BUDGET");
+  m->budget = budget ? editorParseSize(budget) : 0;
+  m->floor = 0;
+}
+
+/* Over budget, drops whatever can be rebuilt: cached listings of
+ * directories not on screen, then the render text and tokens of rows away
+ * from the viewport, which are rebuilt when next drawn or highlighted.
+ * Another pass only runs once usage grows past what the last one left. */
+void editorMemEnforceBudget(void) {
+  memStats *m = &E.mem;
+  long long total = editorMemTotal();
+  if (!m->budget || total <= m->budget || total <= m->floor)
+    return;
+
+  for (int i = E.fb.numCached - 1; i >= 0; i--) {
+    dirListing *dl = E.fb.cache[i];
+    if (dl == E.fb.listing || __atomic_load_n(&dl->scanning, __ATOMIC_ACQUIRE))
+      continue;
+    editorDirCacheRemove(dl);
+    m->evictions++;
+  }
+
+  int keepStart = E.rowoff - E.screenrows;
+  int keepEnd = E.rowoff + 2 * E.screenrows;
+  for (int i = E.numrows - 1; i >= 0; i--) {
+    if (editorMemTotal() <= m->budget)
+      break;
+    if (i >= keepStart && i < keepEnd) {
+      i = keepStart;
+      continue;
+    }
+    if (E.row[i].render) {
+      editorRowEvict(&E.row[i]);
+      m->evictions++;
+    }
+  }
+  m->floor = editorMemTotal();
 }
 
-void editorFree(void *ptr) {
-  if (ptr)
-    free(ptr);
+int editorFormatBytes(char *buf, size_t size, long long bytes) {
+  if (bytes >= 1024 * 1024)
+    return snprintf(buf, size, "%.1fM", bytes / (1024.0 * 1024.0));
+  if (bytes >= 1024)
+    return snprintf(buf, size, "%.1fK", bytes / 1024.0);
+  return snprintf(buf, size, "%lld", bytes);
 }
 
+/* One line summary: total, budget and peak, then bytes per subsystem. */
+void editorMemFormat(char *buf, size_t size) {
+  memStats *m = &E.mem;
+  char n[32];
+  int len;
+  editorFormatBytes(n, sizeof(n), editorMemTotal());
+  len = snprintf(buf, size, "mem %s", n);
+  if (m->budget) {
+    editorFormatBytes(n, sizeof(n), m->budget);
+    len += snprintf(buf + len, size - len, "/%s", n);
+  }
+  editorFormatBytes(n, sizeof(n), m->peak);
+  len += snprintf(buf + len, size - len, " peak %s:", n);
+  for (int i = 0; i < MEM_TAGS && (size_t)len < size; i++) {
+    editorFormatBytes(n, sizeof(n),
+                      __atomic_load_n(&m->bytes[i], __ATOMIC_RELAXED));
+    len += snprintf(buf + len, size - len, " %s %s", MEM_TAG_NAMES[i], n);
+  }
+  if (m->evictions && (size_t)len < size)
+    snprintf(buf + len, size - len, " | evicted %ld", m->evictions);
+}
+
+const idleTaskDef IDLE_TASK_DEFS[IDLE_TASKS] = {
+    {"idle finder", editorFinderStep},
+    {"idle highlight", editorSyntaxStep},
+    {"idle swap", editorSwapStep},
+};
+
+/* Queues a task, or changes the class of one already queued. */
+void editorIdleSchedule(int task, int priority) {
+  idleScheduler *s = &E.idle;
+  if (!s->queued[task])
+    s->depth++;
+  s->queued[task] = 1;
+  s->priority[task] = priority;
+}
+
+void editorIdleCancel(int task) {
+  idleScheduler *s = &E.idle;
+  if (s->queued[task])
+    s->depth--;
+  s->queued[task] = 0;
+}
+
+int editorIdlePending(void) { return E.idle.depth > 0; }
+
+/* Tasks call this between units of work and stop when it returns 1: the
+ * slice's budget is spent or a key is waiting. Input is polled at most every
+ * IDLE_INPUT_CHECK_NS so the check stays cheap. */
+int editorIdleYield(void) {
+  idleScheduler *s = &E.idle;
+  long long now = editorProfNow();
+  if (now >= s->deadline)
+    return 1;
+  if (now - s->inputCheck < IDLE_INPUT_CHECK_NS)
+    return 0;
+  s->inputCheck = now;
+  struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+  E.prof.syscalls++;
+  if (poll(&pfd, 1, 0) > 0) {
+    s->preemptions++;
+    s->deadline = now;
+    return 1;
+  }
+  return 0;
+}
+
+/* Runs queued tasks, most urgent class first, until the budget is spent or
+ * a key arrives. Returns whether anything on screen changed. */
+int editorIdleRun(void) {
+  idleScheduler *s = &E.idle;
+  long long now = editorProfNow();
+  s->deadline = now + s->budget;
+  s->inputCheck = now;
+  s->redraw = 0;
+
+  for (;;) {
+    int task = -1;
+    for (int i = 0; i < IDLE_TASKS; i++)
+      if (s->queued[i] && (task == -1 || s->priority[i] < s->priority[task]))
+        task = i;
+    if (task == -1)
+      break;
+    long long start = editorProfNow();
+    if (!IDLE_TASK_DEFS[task].step())
+      editorIdleCancel(task);
+    s->slices++;
+    editorProfTraceSpan(IDLE_TASK_DEFS[task].name, start, editorProfNow());
+    if (editorIdleYield())
+      break;
+  }
+  return s->redraw;
+}
+
+void abAppend(abuf *ab, const char *s, int len) {
+  if (ab->len + len > ab->cap) {
+    int cap = ab->cap ? ab->cap * 2 : 1024;
+    while (cap < ab->len + len)
+      cap *= 2;
+    char *b = realloc(ab->b, cap);
+    if (b == NULL)
+      return;
+    ab->b = b;
+    ab->cap = cap;
+  }
+  memcpy(&ab->b[ab->len], s, len);
+  ab->len += len;
+}
+
+void abFree(abuf *ab) { free(ab->b); }
+
 void die(const char *s) {
-  write(STDOUT_FILENO, "\x1b[2J", 4);
-  write(STDOUT_FILENO, "\x1b[H", 3);
+  if (!E.headless) {
+    editorWrite("\x1b[2J", 4);
+    editorWrite("\x1b[H", 3);
+  }
 
   perror(s);
   exit(1);
@@ -51,12 +300,21 @@ void enableRawMode(void) {
 }
 
 int editorReadKey(void) {
+  editorProfEnter(PROF_INPUT);
+  int c = editorReadKeyRaw();
+  editorProfLeave();
+  return c;
+}
+
+int editorReadKeyRaw(void) {
   int nread;
   char c;
   while ((nread = read(STDIN_FILENO, &c, 1)) != 1) {
+    E.prof.syscalls++;
     if (nread == -1 && errno != EAGAIN)
       die("read");
   }
+  E.prof.syscalls++;
 
   if (c == '\x1b') {
     char seq[3];
@@ -123,7 +381,7 @@ int getCursorPosition(int *rows, int *cols) {
   char buf[32];
   unsigned int i = 0;
 
-  if (write(STDOUT_FILENO, "\x1b[6n", 4) != 4)
+  if (editorWrite("\x1b[6n", 4) != 4)
     return -1;
 
   while (i < sizeof(buf) - 1) {
@@ -147,7 +405,7 @@ int getWindowSize(int *rows, int *cols) {
   struct winsize ws;
 
   if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0) {
-    if (write(STDOUT_FILENO, "\x1b[999C\x1b[999B", 12) != 12)
+    if (editorWrite("\x1b[999C\x1b[999B", 12) != 12)
       return -1;
     return getCursorPosition(rows, cols);
   } else {
@@ -165,139 +423,837 @@ void initColors(void) {
   E.colors[COLOR_KEYWORD] = 175;
   E.colors[COLOR_NUMBER] = 175;
   E.colors[COLOR_STRING] = 108;
+  E.colors[COLOR_TYPE] = 110;
+  E.colors[COLOR_FUNCTION] = 180;
+  E.colors[COLOR_OPERATOR] = 246;
+  E.colors[COLOR_VARIABLE] = 146;
+  E.colors[COLOR_PREPROCESSOR] = 139;
   E.colors[COLOR_STATUS_BG] = 238;
   E.colors[COLOR_STATUS_FG] = 250;
   E.colors[COLOR_LINENUMBER] = 242;
   E.colors[COLOR_CURSOR] = 250;
 }
 
+const char *PROF_PHASE_NAMES[PROF_PHASES] = {"input", "edit", "scroll",
+                                             "highlight", "draw"};
+const char *PROF_PHASE_SHORT[PROF_PHASES] = {"in", "ed", "sc", "hl", "dr"};
+
+/* All terminal output goes through here so the profiler can count it. */
+ssize_t editorWrite(const void *buf, size_t len) {
+  E.prof.syscalls++;
+  E.prof.bytes += len;
+  return write(STDOUT_FILENO, buf, len);
+}
+
+long long editorProfNow(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* Phases nest; time is charged to the innermost open phase only, so a
+ * highlight pass inside an edit is not counted twice. */
+void editorProfEnter(int phase) {
+  frameProfiler *p = &E.prof;
+  if (!p->enabled)
+    return;
+  long long now = editorProfNow();
+  if (p->depth > 0 && p->depth <= PROF_MAX_DEPTH)
+    p->phaseNs[p->stack[p->depth - 1]] += now - p->mark;
+  p->mark = now;
+  if (p->depth < PROF_MAX_DEPTH) {
+    p->stack[p->depth] = phase;
+    p->starts[p->depth] = now;
+  }
+  p->depth++;
+}
+
+void editorProfLeave(void) {
+  frameProfiler *p = &E.prof;
+  if (!p->enabled || p->depth == 0)
+    return;
+  long long now = editorProfNow();
+  p->depth--;
+  if (p->depth >= PROF_MAX_DEPTH)
+    return;
+  int phase = p->stack[p->depth];
+  p->phaseNs[phase] += now - p->mark;
+  p->mark = now;
+  editorProfTraceSpan(PROF_PHASE_NAMES[phase], p->starts[p->depth], now);
+}
+
+void editorProfFrameBegin(void) {
+  frameProfiler *p = &E.prof;
+  if (!p->enabled)
+    return;
+  p->frameStart = editorProfNow();
+  p->frameSyscalls = p->syscalls;
+  p->frameBytes = p->bytes;
+  memset(p->phaseNs, 0, sizeof(p->phaseNs));
+}
+
+void editorProfFrameEnd(void) {
+  frameProfiler *p = &E.prof;
+  if (!p->enabled || p->frameStart == 0)
+    return;
+  long long now = editorProfNow();
+  memcpy(p->lastNs, p->phaseNs, sizeof(p->lastNs));
+  p->lastFrameNs = now - p->frameStart;
+  p->lastSyscalls = p->syscalls - p->frameSyscalls;
+  p->lastBytes = p->bytes - p->frameBytes;
+  p->heap = editorHeapUsage();
+  editorProfTraceSpan("frame", p->frameStart, now);
+  if (p->trace)
+    fprintf(p->trace,
+            ",\n{\"name\":\"frame\",\"ph\":\"C\",\"ts\":%.3f,\"pid\":1,"
+            "\"args\":{\"syscalls\":%ld,\"bytes\":%lld,\"heap\":%lld,"
+            "\"idleQueue\":%d}}",
+            (now - p->origin) / 1e3, p->lastSyscalls, p->lastBytes, p->heap,
+            E.idle.depth);
+  p->frameStart = 0;
+}
+
+long long editorHeapUsage(void) {
+#if defined(__GLIBC__) &&                                                      \
+    (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+  struct mallinfo2 mi = mallinfo2();
+  return mi.uordblks + mi.hblkhd;
+#else
+  return -1;
+#endif
+}
+
+void editorProfTraceSpan(const char *name, long long start, long long end) {
+  FILE *trace = E.prof.trace;
+  if (!trace)
+    return;
+  fprintf(trace,
+          ",\n{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+          "\"pid\":1,\"tid\":1}",
+          name, (start - E.prof.origin) / 1e3, (end - start) / 1e3);
+}
+
+/* Writes spans as Chrome trace-event JSON, loadable in chrome://tracing or
+ * Perfetto. */
+int editorProfTraceOpen(const char *path) {
+  E.prof.trace = fopen(path, "w");
+  if (!E.prof.trace)
+    return -1;
+  E.prof.origin = editorProfNow();
+  E.prof.enabled = 1;
+  E.prof.depth = 0;
+  fprintf(E.prof.trace, "[\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+                        "\"tid\":1,\"args\":{\"name\":\"ctextedit\"}}");
+  atexit(editorProfTraceClose);
+  return 0;
+}
+
+void editorProfTraceClose(void) {
+  if (!E.prof.trace)
+    return;
+  fprintf(E.prof.trace, "\n]\n");
+  fclose(E.prof.trace);
+  E.prof.trace = NULL;
+}
+
+void editorProfToggle(void) {
+  frameProfiler *p = &E.prof;
+  p->visible = !p->visible;
+  p->enabled = p->visible || p->trace;
+  p->depth = 0;
+  p->frameStart = 0;
+}
+
 void setColor(int color) {
   char buf[16];
   int len;
   len = snprintf(buf, sizeof(buf), "\x1b[38;5;%dm", E.colors[color]);
-  write(STDOUT_FILENO, buf, len);
+  editorWrite(buf, len);
 }
 
-void resetColor(void) { write(STDOUT_FILENO, "\x1b[39m", 5); }
+void resetColor(void) { editorWrite("\x1b[39m", 5); }
 
-void editorUpdateRow(erow *row) {
+rowText *editorRowTextAlloc(size_t len) {
+  rowText *text = editorAlloc(MEM_ROWS, sizeof(rowText) + len + 1);
+  text->refcount = 1;
+  return text;
+}
+
+void editorRowTextRetain(rowText *text) {
+  __atomic_add_fetch(&text->refcount, 1, __ATOMIC_RELAXED);
+}
+
+void editorRowTextRelease(rowText *text) {
+  if (text && __atomic_sub_fetch(&text->refcount, 1, __ATOMIC_ACQ_REL) == 0)
+    editorRelease(text);
+}
+
+/* The shared block a row's chars live in. Rows keep only the chars pointer,
+ * since every row is moved whenever one is inserted or deleted above it. */
+rowText *editorRowText(erow *row) {
+  return (rowText *)(row->chars - offsetof(rowText, chars));
+}
+
+/* Makes row->chars private to the row and large enough for len bytes plus
+ * the terminator. Text still referenced by a snapshot is copied, never
+ * written in place, so readers on other threads need no locking. The
+ * change is reported first, since a swap flush it triggers takes a
+ * reference to the text. */
+void editorRowReserve(erow *row, size_t len) {
+  if (row >= E.row && row < E.row + E.numrows)
+    editorRowsChanged(row - E.row, 1, 1);
+  rowText *text = editorRowText(row);
+  if (__atomic_load_n(&text->refcount, __ATOMIC_ACQUIRE) == 1) {
+    text = editorRealloc(MEM_ROWS, text, sizeof(rowText) + len + 1);
+  } else {
+    rowText *copy = editorRowTextAlloc(len);
+    size_t keep = (size_t)row->size < len ? (size_t)row->size : len;
+    memcpy(copy->chars, text->chars, keep);
+    copy->chars[keep] = '\0';
+    editorRowTextRelease(text);
+    text = copy;
+  }
+  row->chars = text->chars;
+}
+
+editorSnapshot *editorSnapshotCreate(void) {
+  editorSnapshot *snap = editorMalloc(sizeof(editorSnapshot));
+  snap->refcount = 1;
+  snap->version = E.version;
+  snap->filename = E.filename ? strdup(E.filename) : NULL;
+  snap->numrows = E.numrows;
+  snap->rows = editorMalloc(sizeof(snapshotRow) * (E.numrows ? E.numrows : 1));
+
+  for (int i = 0; i < E.numrows; i++) {
+    snap->rows[i].text = editorRowText(&E.row[i]);
+    editorRowTextRetain(snap->rows[i].text);
+    snap->rows[i].size = E.row[i].size;
+  }
+  return snap;
+}
+
+editorSnapshot *editorSnapshotRetain(editorSnapshot *snap) {
+  __atomic_add_fetch(&snap->refcount, 1, __ATOMIC_RELAXED);
+  return snap;
+}
+
+void editorSnapshotRelease(editorSnapshot *snap) {
+  if (!snap || __atomic_sub_fetch(&snap->refcount, 1, __ATOMIC_ACQ_REL) != 0)
+    return;
+  for (int i = 0; i < snap->numrows; i++)
+    editorRowTextRelease(snap->rows[i].text);
+  editorFree(snap->rows);
+  free(snap->filename);
+  editorFree(snap);
+}
+
+/* Display widths of the characters that do not take one column: combining
+ * marks and other zero width characters, then East Asian wide characters
+ * and emoji. Sorted by first code point. */
+const charWidthRange CHAR_WIDTHS[] = {
+    {0x0300, 0x036F, 0},   {0x0483, 0x0489, 0},   {0x0591, 0x05BD, 0},
+    {0x0610, 0x061A, 0},   {0x064B, 0x065F, 0},   {0x0E31, 0x0E31, 0},
+    {0x0E34, 0x0E3A, 0},   {0x0E47, 0x0E4E, 0},   {0x1100, 0x115F, 2},
+    {0x1AB0, 0x1AFF, 0},   {0x1DC0, 0x1DFF, 0},   {0x200B, 0x200F, 0},
+    {0x202A, 0x202E, 0},   {0x2060, 0x2064, 0},   {0x20D0, 0x20FF, 0},
+    {0x231A, 0x231B, 2},   {0x2329, 0x232A, 2},   {0x23E9, 0x23EC, 2},
+    {0x23F0, 0x23F0, 2},   {0x23F3, 0x23F3, 2},   {0x25FD, 0x25FE, 2},
+    {0x2614, 0x2615, 2},   {0x2648, 0x2653, 2},   {0x267F, 0x267F, 2},
+    {0x2693, 0x2693, 2},   {0x26A1, 0x26A1, 2},   {0x26AA, 0x26AB, 2},
+    {0x26BD, 0x26BE, 2},   {0x26C4, 0x26C5, 2},   {0x26CE, 0x26CE, 2},
+    {0x26D4, 0x26D4, 2},   {0x26EA, 0x26EA, 2},   {0x26F2, 0x26F5, 2},
+    {0x26FA, 0x26FA, 2},   {0x26FD, 0x26FD, 2},   {0x2705, 0x2705, 2},
+    {0x270A, 0x270B, 2},   {0x2728, 0x2728, 2},   {0x274C, 0x274C, 2},
+    {0x274E, 0x274E, 2},   {0x2753, 0x2755, 2},   {0x2757, 0x2757, 2},
+    {0x2795, 0x2797, 2},   {0x27B0, 0x27B0, 2},   {0x27BF, 0x27BF, 2},
+    {0x2B1B, 0x2B1C, 2},   {0x2B50, 0x2B50, 2},   {0x2B55, 0x2B55, 2},
+    {0x2E80, 0x303E, 2},   {0x3041, 0x3098, 2},   {0x3099, 0x309A, 0},
+    {0x309B, 0x33FF, 2},   {0x3400, 0x4DBF, 2},   {0x4E00, 0x9FFF, 2},
+    {0xA000, 0xA4CF, 2},   {0xA960, 0xA97F, 2},   {0xAC00, 0xD7A3, 2},
+    {0xF900, 0xFAFF, 2},   {0xFE00, 0xFE0F, 0},   {0xFE10, 0xFE19, 2},
+    {0xFE20, 0xFE2F, 0},   {0xFE30, 0xFE6F, 2},   {0xFEFF, 0xFEFF, 0},
+    {0xFF00, 0xFF60, 2},   {0xFFE0, 0xFFE6, 2},   {0x16FE0, 0x16FE4, 2},
+    {0x17000, 0x18CFF, 2}, {0x1B000, 0x1B2FF, 2}, {0x1F004, 0x1F004, 2},
+    {0x1F0CF, 0x1F0CF, 2}, {0x1F18E, 0x1F18E, 2}, {0x1F191, 0x1F19A, 2},
+    {0x1F200, 0x1F251, 2}, {0x1F300, 0x1F320, 2}, {0x1F32D, 0x1F335, 2},
+    {0x1F337, 0x1F37C, 2}, {0x1F37E, 0x1F393, 2}, {0x1F3A0, 0x1F3CA, 2},
+    {0x1F3CF, 0x1F3D3, 2}, {0x1F3E0, 0x1F3F0, 2}, {0x1F3F4, 0x1F3F4, 2},
+    {0x1F3F8, 0x1F43E, 2}, {0x1F440, 0x1F440, 2}, {0x1F442, 0x1F4FC, 2},
+    {0x1F4FF, 0x1F53D, 2}, {0x1F54B, 0x1F54E, 2}, {0x1F550, 0x1F567, 2},
+    {0x1F57A, 0x1F57A, 2}, {0x1F595, 0x1F596, 2}, {0x1F5A4, 0x1F5A4, 2},
+    {0x1F5FB, 0x1F64F, 2}, {0x1F680, 0x1F6C5, 2}, {0x1F6CC, 0x1F6CC, 2},
+    {0x1F6D0, 0x1F6D2, 2}, {0x1F6D5, 0x1F6D7, 2}, {0x1F6EB, 0x1F6EC, 2},
+    {0x1F6F4, 0x1F6FC, 2}, {0x1F7E0, 0x1F7EB, 2}, {0x1F90C, 0x1F93A, 2},
+    {0x1F93C, 0x1F945, 2}, {0x1F947, 0x1F9FF, 2}, {0x1FA70, 0x1FAFF, 2},
+    {0x20000, 0x2FFFD, 2}, {0x30000, 0x3FFFD, 2}, {0xE0001, 0xE007F, 0},
+    {0xE0100, 0xE01EF, 0},
+};
+
+/* Rows without a byte above 0x7F take the cheap path of one column per
+ * render byte. With SSE2 sixteen bytes are checked at once. */
+int editorIsAscii(const char *s, int len) {
+  int i = 0;
+#ifdef __SSE2__
+  for (; i + 16 <= len; i += 16)
+    if (_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)(s + i))))
+      return 0;
+#endif
+  for (; i < len; i++)
+    if (s[i] & 0x80)
+      return 0;
+  return 1;
+}
+
+int editorUtf8IsCont(char c) { return (c & 0xC0) == 0x80; }
+
+/* Decodes the character at s, returning its length in bytes, or 0 if s
+ * does not start a valid UTF-8 sequence. */
+int editorUtf8Decode(const char *s, int len, unsigned *cp) {
+  const unsigned char *u = (const unsigned char *)s;
+  int n = u[0] < 0x80   ? 1
+          : u[0] < 0xC2 ? 0
+          : u[0] < 0xE0 ? 2
+          : u[0] < 0xF0 ? 3
+          : u[0] < 0xF5 ? 4
+                        : 0;
+  if (n == 0 || n > len)
+    return 0;
+  unsigned c = n == 1 ? u[0] : u[0] & (0x7F >> n);
+  for (int i = 1; i < n; i++) {
+    if ((u[i] & 0xC0) != 0x80)
+      return 0;
+    c = (c << 6) | (u[i] & 0x3F);
+  }
+  if ((n == 3 && (c < 0x800 || (c >= 0xD800 && c <= 0xDFFF))) ||
+      (n == 4 && (c < 0x10000 || c > 0x10FFFF)))
+    return 0;
+  *cp = c;
+  return n;
+}
+
+int editorCharWidth(unsigned cp) {
+  if (cp < CHAR_WIDTHS[0].first)
+    return 1;
+  int lo = 0, hi = sizeof(CHAR_WIDTHS) / sizeof(CHAR_WIDTHS[0]);
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (cp < CHAR_WIDTHS[mid].first)
+      hi = mid;
+    else if (cp > CHAR_WIDTHS[mid].last)
+      lo = mid + 1;
+    else
+      return CHAR_WIDTHS[mid].width;
+  }
+  return 1;
+}
+
+/* Expands tabs into render. A row with other than ASCII is decoded once
+ * here and row->cols keeps the display column of every render byte, so
+ * cursor movement and drawing never decode it again. Bytes that are not
+ * valid UTF-8 are shown as '?'. */
+void editorRowRender(erow *row) {
   int tabs = 0;
   int j;
   for (j = 0; j < row->size; j++)
     if (row->chars[j] == '\t')
       tabs++;
 
-  free(row->render);
-  row->render = malloc(row->size + tabs * (TAB_SIZE - 1) + 1);
+  int cap = row->size + tabs * (TAB_SIZE - 1) + 1;
+  editorRelease(row->render);
+  editorRelease(row->cols);
+  row->render = editorAlloc(MEM_RENDER, cap);
+  row->cols = NULL;
 
   int idx = 0;
-  for (j = 0; j < row->size; j++) {
+  if (editorIsAscii(row->chars, row->size)) {
+    for (j = 0; j < row->size; j++) {
+      if (row->chars[j] == '\t') {
+        row->render[idx++] = ' ';
+        while (idx % TAB_SIZE != 0)
+          row->render[idx++] = ' ';
+      } else {
+        row->render[idx++] = row->chars[j];
+      }
+    }
+    row->render[idx] = '\0';
+    row->rsize = idx;
+    return;
+  }
+
+  row->cols = editorAlloc(MEM_RENDER, cap * sizeof(int));
+  int col = 0;
+  for (j = 0; j < row->size;) {
+    unsigned cp;
+    int n;
     if (row->chars[j] == '\t') {
-      row->render[idx++] = ' ';
-      while (idx % TAB_SIZE != 0)
+      do {
+        row->cols[idx] = col++;
         row->render[idx++] = ' ';
+      } while (col % TAB_SIZE != 0);
+      j++;
+    } else if ((n = editorUtf8Decode(&row->chars[j], row->size - j, &cp))) {
+      for (int k = 0; k < n; k++) {
+        row->cols[idx] = col;
+        row->render[idx++] = row->chars[j++];
+      }
+      col += editorCharWidth(cp);
     } else {
-      row->render[idx++] = row->chars[j];
+      row->cols[idx] = col++;
+      row->render[idx++] = '?';
+      j++;
     }
   }
+  row->cols[idx] = col;
   row->render[idx] = '\0';
   row->rsize = idx;
 }
 
+/* Byte index of the character after the one at cx. Zero width marks move
+ * with the character they follow. */
+int editorRowNextChar(erow *row, int cx) {
+  unsigned cp;
+  do {
+    int n = editorUtf8Decode(&row->chars[cx], row->size - cx, &cp);
+    cx += n ? n : 1;
+  } while (cx < row->size &&
+           editorUtf8Decode(&row->chars[cx], row->size - cx, &cp) &&
+           editorCharWidth(cp) == 0);
+  return cx;
+}
+
+int editorRowPrevChar(erow *row, int cx) {
+  unsigned cp;
+  do {
+    cx--;
+    while (cx > 0 && editorUtf8IsCont(row->chars[cx]))
+      cx--;
+  } while (cx > 0 &&
+           editorUtf8Decode(&row->chars[cx], row->size - cx, &cp) &&
+           editorCharWidth(cp) == 0);
+  return cx;
+}
+
+/* Display columns of a rendered row, and of the render bytes before at. */
+int editorRowWidth(erow *row) {
+  return row->cols ? row->cols[row->rsize] : row->rsize;
+}
+
+int editorRowCol(erow *row, int at) { return row->cols ? row->cols[at] : at; }
+
+/* First render byte at or after display column col. */
+int editorRowColStart(erow *row, int col) {
+  if (!row->cols)
+    return col < 0 ? 0 : col < row->rsize ? col : row->rsize;
+  int lo = 0, hi = row->rsize;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (row->cols[mid] < col)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+/* End of the render bytes that fit before display column col, never
+ * splitting a character. */
+int editorRowColEnd(erow *row, int col) {
+  if (!row->cols)
+    return col < 0 ? 0 : col < row->rsize ? col : row->rsize;
+  int lo = 0, hi = row->rsize + 1;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (row->cols[mid] <= col)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  int end = lo - 1;
+  while (end > 0 && end < row->rsize && editorUtf8IsCont(row->render[end]))
+    end--;
+  return end < 0 ? 0 : end;
+}
+
+void editorUpdateRow(erow *row) {
+  editorRowRender(row);
+  editorUpdateSyntax(row);
+}
+
+void editorRowInit(erow *row, const char *s, size_t len) {
+  row->size = len;
+  row->chars = editorRowTextAlloc(len)->chars;
+  memcpy(row->chars, s, len);
+  row->chars[len] = '\0';
+
+  row->rsize = 0;
+  row->render = NULL;
+  row->cols = NULL;
+  row->tokens = NULL;
+  row->numTokens = 0;
+  row->hasMultilineComment = 0;
+  row->bracketDepth = 0;
+  row->bracketMin = 0;
+  row->hidden = 0;
+}
+
+int editorRowEquals(erow *row, const char *s, size_t len) {
+  return (size_t)row->size == len && memcmp(row->chars, s, len) == 0;
+}
+
+/* Replaces oldCount rows at `at` with the given lines. The rest of the
+ * buffer is shifted first, with at most one memmove, and every new row is
+ * in place before any is tokenized. */
+void editorReplaceRows(int at, int oldCount, const char *data,
+                       const lineSpan *lines, int newCount) {
+  editorRowsChanged(at, oldCount, newCount);
+  for (int i = 0; i < oldCount; i++)
+    editorFreeRow(&E.row[at + i]);
+  if (newCount > oldCount)
+    E.row = editorRealloc(MEM_ROWS, E.row,
+                          sizeof(erow) * (E.numrows + newCount - oldCount));
+  if (newCount != oldCount)
+    memmove(&E.row[at + newCount], &E.row[at + oldCount],
+            sizeof(erow) * (E.numrows - at - oldCount));
+  E.numrows += newCount - oldCount;
+
+  for (int i = 0; i < newCount; i++)
+    editorRowInit(&E.row[at + i], data + lines[i].start, lines[i].len);
+  for (int i = 0; i < newCount; i++)
+    editorUpdateRow(&E.row[at + i]);
+  if (at + newCount < E.numrows)
+    editorUpdateSyntax(&E.row[at + newCount]);
+  E.version++;
+}
+
+/* Replaces oldCount rows at `at` with rows built from existing text blocks,
+ * which the buffer takes ownership of. */
+void editorSpliceRows(int at, int oldCount, snapshotRow *rows, int newCount) {
+  editorRowsChanged(at, oldCount, newCount);
+  for (int i = 0; i < oldCount; i++)
+    editorFreeRow(&E.row[at + i]);
+  if (newCount > oldCount)
+    E.row = editorRealloc(MEM_ROWS, E.row,
+                          sizeof(erow) * (E.numrows + newCount - oldCount));
+  memmove(&E.row[at + newCount], &E.row[at + oldCount],
+          sizeof(erow) * (E.numrows - at - oldCount));
+  E.numrows += newCount - oldCount;
+
+  memset(&E.row[at], 0, sizeof(erow) * newCount);
+  for (int i = 0; i < newCount; i++) {
+    E.row[at + i].size = rows[i].size;
+    E.row[at + i].chars = rows[i].text->chars;
+    editorUpdateRow(&E.row[at + i]);
+  }
+  if (at + newCount < E.numrows)
+    editorUpdateSyntax(&E.row[at + newCount]);
+  E.version++;
+}
+
 void editorInsertRow(int at, char *s, size_t len) {
   if (at < 0 || at > E.numrows)
     return;
 
-  E.row = realloc(E.row, sizeof(erow) * (E.numrows + 1));
+  editorRowsChanged(at, 0, 1);
+  E.row = editorRealloc(MEM_ROWS, E.row, sizeof(erow) * (E.numrows + 1));
   memmove(&E.row[at + 1], &E.row[at], sizeof(erow) * (E.numrows - at));
+  E.numrows++;
 
-  E.row[at].size = len;
-  E.row[at].chars = malloc(len + 1);
-  memcpy(E.row[at].chars, s, len);
-  E.row[at].chars[len] = '\0';
-
-  E.row[at].rsize = 0;
-  E.row[at].render = NULL;
+  editorRowInit(&E.row[at], s, len);
   editorUpdateRow(&E.row[at]);
-
-  E.numrows++;
   E.dirty++;
+  E.version++;
+}
+
+/* Called before `removed` rows at `at` are replaced by `added` new ones.
+ * The dirty range keeps the first changed row and the number of rows after
+ * the last one, which later changes above it do not move. */
+void editorRowsChanged(int at, int removed, int added) {
+  int after = E.numrows - at - removed;
+  if (E.dirtyFirst == -1 || at < E.dirtyFirst)
+    E.dirtyFirst = at;
+  if (after < E.dirtyTail)
+    E.dirtyTail = after;
+  /* Lines added or removed at the edge of a closed fold open it. */
+  if (removed != 1 || added != 1)
+    for (int i = at; i <= at + removed && i < E.numrows; i++)
+      if (E.row[i].hidden)
+        editorFoldOpen(i);
+  editorRowIndexChanged(&E.bytes, at, removed, added);
+  editorRowIndexChanged(&E.wrapLines, at, removed, added);
+  editorBracketChanged(at, removed, added);
+  editorWordsChanged(at, removed, added);
+  editorSyntaxShift(at, removed, added);
+  editorSwapTrack(at, removed, added);
+}
+
+/* Marks the buffer as matching the file on disk. In-place saves also need
+ * the file to hold exactly the bytes the buffer would write for it, as found
+ * when it was read. */
+void editorDirtyReset(void) {
+  E.dirtyFirst = -1;
+  E.dirtyTail = E.numrows;
+  E.diskCanonical = E.disk.st_ino != 0 && E.format.canonical &&
+                    E.disk.st_size == editorRowOffset(E.numrows);
 }
 
 void editorFreeRow(erow *row) {
-  free(row->render);
-  free(row->chars);
+  editorRelease(row->render);
+  editorRelease(row->cols);
+  editorRelease(row->tokens);
+  editorRowTextRelease(editorRowText(row));
+}
+
+void editorRowEvict(erow *row) {
+  editorRelease(row->render);
+  editorRelease(row->cols);
+  editorRelease(row->tokens);
+  row->render = NULL;
+  row->cols = NULL;
+  row->tokens = NULL;
+  row->rsize = 0;
+  row->numTokens = 0;
 }
 
 void editorDelRow(int at) {
   if (at < 0 || at >= E.numrows)
     return;
+  editorRowsChanged(at, 1, 0);
   editorFreeRow(&E.row[at]);
   memmove(&E.row[at], &E.row[at + 1], sizeof(erow) * (E.numrows - at - 1));
   E.numrows--;
+  if (at < E.numrows)
+    editorUpdateSyntax(&E.row[at]);
   E.dirty++;
+  E.version++;
 }
 
-char *editorRowsToString(int *buflen) {
-  int totlen = 0;
-  int j;
-  for (j = 0; j < E.numrows; j++)
-    totlen += E.row[j].size + 1;
-  *buflen = totlen;
+void editorClearRows(void) {
+  editorRowsChanged(0, E.numrows, 0);
+  for (int i = 0; i < E.numrows; i++)
+    editorFreeRow(&E.row[i]);
+  editorRelease(E.row);
+  E.row = NULL;
+  E.numrows = 0;
+  E.cx = E.cy = E.rx = E.rowoff = E.coloff = 0;
+  E.version++;
+}
+
+/* Rows changed in place only note their index; their new value is read
+ * when the index is next used. Anything that moves rows invalidates the
+ * tree from the first moved row. */
+void editorRowIndexChanged(rowIndex *ri, int at, int removed, int added) {
+  if (at >= ri->stale)
+    return;
+  if (removed != 1 || added != 1) {
+    ri->stale = at;
+    return;
+  }
+  if (ri->numPending > 0 && ri->pending[ri->numPending - 1] == at)
+    return;
+  if (ri->numPending == ROW_INDEX_PENDING) {
+    for (int i = 0; i < ri->numPending; i++)
+      if (ri->pending[i] < at)
+        at = ri->pending[i];
+    ri->stale = at;
+    ri->numPending = 0;
+    return;
+  }
+  ri->pending[ri->numPending++] = at;
+}
+
+/* Brings the Fenwick tree up to date. Nodes up to `stale` still hold their
+ * sums; the rest are rebuilt in one linear pass that starts from the nodes
+ * making up the prefix sum of `stale`. */
+void editorRowIndexSync(rowIndex *ri, long long (*measure)(int at)) {
+  for (int i = 0; i < ri->numPending; i++) {
+    int at = ri->pending[i];
+    if (at >= ri->stale)
+      continue;
+    long long old =
+        editorRowIndexPrefix(ri, at + 1) - editorRowIndexPrefix(ri, at);
+    long long delta = measure(at) - old;
+    for (int j = at + 1; j <= ri->size; j += j & -j)
+      ri->tree[j] += delta;
+  }
+  ri->numPending = 0;
+
+  int n = E.numrows;
+  if (ri->stale >= n && ri->size == n)
+    return;
+  if (n + 1 > ri->cap) {
+    ri->cap = n + 1 > ri->cap * 2 ? n + 1 : ri->cap * 2;
+    ri->tree = editorRealloc(MEM_ROWS, ri->tree, sizeof(long long) * ri->cap);
+  }
+  int stale = ri->stale < n ? ri->stale : n;
+  for (int i = stale + 1; i <= n; i++)
+    ri->tree[i] = measure(i - 1);
+  for (int i = stale; i > 0; i -= i & -i)
+    if (i + (i & -i) <= n)
+      ri->tree[i + (i & -i)] += ri->tree[i];
+  for (int i = stale + 1; i <= n; i++)
+    if (i + (i & -i) <= n)
+      ri->tree[i + (i & -i)] += ri->tree[i];
+  ri->size = n;
+  ri->stale = n;
+}
+
+/* Sum over the first `rows` rows. The caller must have synced the index. */
+long long editorRowIndexPrefix(rowIndex *ri, int rows) {
+  long long sum = 0;
+  for (int i = rows; i > 0; i -= i & -i)
+    sum += ri->tree[i];
+  return sum;
+}
 
-  char *buf = malloc(totlen);
+/* Descends the synced tree to the row whose range holds `value`, leaving
+ * the distance into that row in *rest. Returns the row count for values
+ * past the end. */
+int editorRowIndexFind(rowIndex *ri, long long value, long long *rest) {
+  int pos = 0, step = 1;
+  while (step * 2 <= ri->size)
+    step *= 2;
+  for (; step > 0; step /= 2) {
+    if (pos + step <= ri->size && ri->tree[pos + step] <= value) {
+      pos += step;
+      value -= ri->tree[pos];
+    }
+  }
+  *rest = value;
+  return pos;
+}
+
+long long editorRowBytes(int at) { return E.row[at].size + 1 + E.format.crlf; }
+
+/* Byte offset of the start of row `at` in the file as it would be saved. */
+long long editorRowOffset(int at) {
+  editorRowIndexSync(&E.bytes, editorRowBytes);
+  return editorRowIndexPrefix(&E.bytes, at) + (E.format.bom ? 3 : 0);
+}
+
+/* Finds the row holding byte `offset`. Offsets inside a line ending land
+ * on the end of its row, and offsets past the end on the end of the last
+ * row. */
+int editorOffsetToRow(long long offset, int *col) {
+  editorRowIndexSync(&E.bytes, editorRowBytes);
+  offset -= E.format.bom ? 3 : 0;
+  if (offset < 0)
+    offset = 0;
+  long long rest;
+  int row = editorRowIndexFind(&E.bytes, offset, &rest);
+  if (row == E.numrows) {
+    *col = row > 0 ? E.row[row - 1].size : 0;
+    return row > 0 ? row - 1 : 0;
+  }
+  *col = rest < E.row[row].size ? rest : E.row[row].size;
+  return row;
+}
+
+size_t editorRowsBytes(int from, int to) {
+  editorRowIndexSync(&E.bytes, editorRowBytes);
+  return editorRowIndexPrefix(&E.bytes, to) -
+         editorRowIndexPrefix(&E.bytes, from);
+}
+
+char *editorRowsRangeToString(int from, int to, size_t *buflen) {
+  *buflen = editorRowsBytes(from, to);
+  char *buf = malloc(*buflen + 1);
   char *p = buf;
-  for (j = 0; j < E.numrows; j++) {
+  for (int j = from; j < to; j++) {
     memcpy(p, E.row[j].chars, E.row[j].size);
     p += E.row[j].size;
+    if (E.format.crlf)
+      *p++ = '\r';
     *p = '\n';
     p++;
   }
+  return buf;
+}
 
+char *editorRowsToString(int *buflen) {
+  size_t len;
+  char *buf = editorRowsRangeToString(0, E.numrows, &len);
+  *buflen = len;
   return buf;
 }
 
 void editorRowInsertChar(erow *row, int at, int c) {
   if (at < 0 || at > row->size)
     at = row->size;
-  row->chars = realloc(row->chars, row->size + 2);
+  editorRowReserve(row, row->size + 1);
   memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
   row->size++;
   row->chars[at] = c;
   editorUpdateRow(row);
   E.dirty++;
+  E.version++;
 }
 
 void editorRowDelChar(erow *row, int at) {
   if (at < 0 || at >= row->size)
     return;
+  editorRowReserve(row, row->size);
   memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
   row->size--;
   editorUpdateRow(row);
   E.dirty++;
+  E.version++;
 }
 
 void editorRowAppendString(erow *row, char *s, size_t len) {
-  row->chars = realloc(row->chars, row->size + len + 1);
+  editorRowReserve(row, row->size + len);
   memcpy(&row->chars[row->size], s, len);
   row->size += len;
   row->chars[row->size] = '\0';
   editorUpdateRow(row);
   E.dirty++;
+  E.version++;
 }
 
+/* Rows holding more than ASCII read their columns from row->cols. One
+ * evicted by the memory budget is rendered for the call and dropped
+ * again. An ASCII row that renders to its own length has no column to
+ * count. */
 int editorRowCxToRx(erow *row, int cx) {
-  int rx = 0;
-  int j;
-  for (j = 0; j < cx; j++) {
-    if (row->chars[j] == '\t')
-      rx += (TAB_SIZE - 1) - (rx % TAB_SIZE);
-    rx++;
+  if (!row->render && !editorIsAscii(row->chars, row->size)) {
+    editorRowRender(row);
+    int rx = editorRowCxToRx(row, cx);
+    editorRowEvict(row);
+    return rx;
   }
+  if (row->render && !row->cols && row->rsize == row->size)
+    return cx;
+  if (row->cols) {
+    int at = 0;
+    for (int j = 0; j < cx; j++)
+      at += row->chars[j] == '\t' ? TAB_SIZE - row->cols[at] % TAB_SIZE : 1;
+    return row->cols[at];
+  }
+
+  int rx = 0;
+  for (int j = 0; j < cx; j++)
+    rx += row->chars[j] == '\t' ? TAB_SIZE - rx % TAB_SIZE : 1;
   return rx;
 }
 
 int editorRowRxToCx(erow *row, int rx) {
+  if (!row->render && !editorIsAscii(row->chars, row->size)) {
+    editorRowRender(row);
+    int cx = editorRowRxToCx(row, rx);
+    editorRowEvict(row);
+    return cx;
+  }
+  if (row->cols) {
+    int at = 0, cx;
+    for (cx = 0; cx < row->size; cx++) {
+      at += row->chars[cx] == '\t' ? TAB_SIZE - row->cols[at] % TAB_SIZE : 1;
+      if (row->cols[at] > rx)
+        break;
+    }
+    while (cx > 0 && cx < row->size && editorUtf8IsCont(row->chars[cx]))
+      cx--;
+    return cx;
+  }
+
   int cur_rx = 0;
   int cx;
   for (cx = 0; cx < row->size; cx++) {
@@ -326,6 +1282,7 @@ void editorInsertNewline(void) {
     erow *row = &E.row[E.cy];
     editorInsertRow(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
     row = &E.row[E.cy];
+    editorRowReserve(row, E.cx);
     row->size = E.cx;
     row->chars[row->size] = '\0';
     editorUpdateRow(row);
@@ -539,244 +1496,3087 @@ void editorRedo(void) {
   editorSetStatusMessage("Redo successful");
 }
 
-void editorOpen(char *filename) {
-  free(E.filename);
-  E.filename = strdup(filename);
+const char *editorMapFile(const char *filename, size_t *size) {
+  int fd = open(filename, O_RDONLY);
+  if (fd == -1)
+    return NULL;
 
-  FILE *fp = fopen(filename, "r");
-  if (!fp)
-    die("fopen");
+  struct stat st;
+  if (fstat(fd, &st) == -1) {
+    close(fd);
+    return NULL;
+  }
 
-  char *line = NULL;
-  size_t linecap = 0;
-  ssize_t linelen;
-  while ((linelen = getline(&line, &linecap, fp)) != -1) {
-    while (linelen > 0 &&
-           (line[linelen - 1] == '\n' || line[linelen - 1] == '\r'))
-      linelen--;
-    editorInsertRow(E.numrows, line, linelen);
+  *size = st.st_size;
+  const char *data = "";
+  if (*size > 0) {
+    void *map = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+      close(fd);
+      return NULL;
+    }
+    madvise(map, *size, MADV_SEQUENTIAL);
+    data = map;
   }
-  free(line);
-  fclose(fp);
-  E.dirty = 0;
+  close(fd);
+  return data;
 }
 
-void editorSave(void) {
-  if (E.filename == NULL) {
-    E.filename = malloc(128);
-    E.filename[0] = '\0';
-    editorSetStatusMessage("Save as: %s (ESC to cancel)", E.filename);
-    return;
+void editorUnmapFile(const char *data, size_t size) {
+  if (size > 0)
+    munmap((void *)data, size);
+}
+
+/* Returns the length of the line starting at *pos without its line ending
+ * and advances *pos past it, or -1 at the end of the data. */
+ssize_t editorNextLine(const char *data, size_t size, size_t *pos) {
+  size_t start = *pos;
+  if (start >= size)
+    return -1;
+
+  const char *nl = memchr(data + start, '\n', size - start);
+  size_t end = nl ? (size_t)(nl - data) : size;
+  *pos = nl ? end + 1 : size;
+
+  while (end > start && data[end - 1] == '\r')
+    end--;
+  return end - start;
+}
+
+/* Counts line feeds, and those that follow one or two carriage returns,
+ * sixteen bytes at a time with SSE2. The file takes the ending most of its
+ * lines use; mixed notes that some differ. The file is canonical when saving
+ * its rows would write it back unchanged: every line ends with that one
+ * ending, and no extra carriage return is stripped before it. */
+void editorDetectFormat(const char *data, size_t size, fileFormat *fmt) {
+  size_t lf = 0, crlf = 0, crcrlf = 0, i = 0;
+  unsigned prevCr = 0, prevCrCr = 0;
+#ifdef __SSE2__
+  const __m128i nl = _mm_set1_epi8('\n');
+  const __m128i cr = _mm_set1_epi8('\r');
+  for (; i + 16 <= size; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(data + i));
+    unsigned lfMask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, nl));
+    unsigned crMask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, cr));
+    unsigned crcrMask = crMask & ((crMask << 1) | prevCr);
+    lf += __builtin_popcount(lfMask);
+    crlf += __builtin_popcount(lfMask & ((crMask << 1) | prevCr));
+    crcrlf += __builtin_popcount(lfMask & ((crcrMask << 1) | prevCrCr));
+    prevCr = crMask >> 15;
+    prevCrCr = crcrMask >> 15;
+  }
+#endif
+  for (; i < size; i++) {
+    if (data[i] == '\n') {
+      lf++;
+      crlf += prevCr;
+      crcrlf += prevCrCr;
+    }
+    prevCrCr = prevCr && data[i] == '\r';
+    prevCr = data[i] == '\r';
   }
+  fmt->bom = size >= 3 && memcmp(data, UTF8_BOM, 3) == 0;
+  fmt->crlf = crlf * 2 > lf;
+  fmt->mixed = crlf != 0 && crlf != lf;
+  fmt->canonical = !fmt->mixed && crcrlf == 0 &&
+                   (size == (fmt->bom ? 3u : 0u) || data[size - 1] == '\n');
+}
 
-  int len;
-  char *buf = editorRowsToString(&len);
+/* Row byte counts include the line ending, so they are re-measured when it
+ * changes. */
+void editorSetFormat(const fileFormat *fmt) {
+  if (fmt->crlf != E.format.crlf)
+    E.bytes.stale = 0;
+  E.format = *fmt;
+}
 
-  int fd = open(E.filename, O_RDWR | O_CREAT, 0644);
-  if (fd != -1) {
-    if (ftruncate(fd, len) != -1) {
-      if (write(fd, buf, len) == len) {
-        close(fd);
-        free(buf);
-        E.dirty = 0;
-        editorSetStatusMessage("%d bytes written to disk", len);
-        return;
+/* Aligns rows [oldStart, oldEnd) with the new lines using a windowed greedy
+ * match and returns the differing hunks. Unchanged rows are left alone. */
+int editorDiffRows(int oldStart, int oldEnd, const char *data,
+                   const lineSpan *lines, int numLines, reloadHunk **out) {
+  reloadHunk *hunks = NULL;
+  int numHunks = 0, capHunks = 0;
+  int i = oldStart, j = 0;
+
+  while (i < oldEnd || j < numLines) {
+    if (i < oldEnd && j < numLines &&
+        editorRowEquals(&E.row[i], data + lines[j].start, lines[j].len)) {
+      i++;
+      j++;
+      continue;
+    }
+
+    int ni = oldEnd, nj = numLines;
+    for (int d = 1; d <= 2 * RELOAD_DIFF_WINDOW && ni == oldEnd; d++) {
+      for (int x = 0; x <= d; x++) {
+        int oi = i + x, oj = j + d - x;
+        if (oi >= oldEnd || oj >= numLines)
+          continue;
+        if (x > RELOAD_DIFF_WINDOW || d - x > RELOAD_DIFF_WINDOW)
+          continue;
+        if (editorRowEquals(&E.row[oi], data + lines[oj].start,
+                            lines[oj].len)) {
+          ni = oi;
+          nj = oj;
+          break;
+        }
       }
     }
-    close(fd);
+
+    if (numHunks == capHunks) {
+      capHunks = capHunks ? capHunks * 2 : 8;
+      hunks = realloc(hunks, sizeof(reloadHunk) * capHunks);
+    }
+    hunks[numHunks].oldStart = i;
+    hunks[numHunks].oldCount = ni - i;
+    hunks[numHunks].newStart = j;
+    hunks[numHunks].newCount = nj - j;
+    numHunks++;
+    i = ni;
+    j = nj;
   }
 
-  free(buf);
-  editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
+  *out = hunks;
+  return numHunks;
 }
 
+void editorOpen(char *filename) {
+  if (editorOpenFile(filename) == -1)
+    die("open");
+}
+
+int editorOpenFile(char *filename) {
+  editorSwapClose(1);
+  editorJournalReplay(filename);
+  editorClearRows();
+  E.undoStackSize = 0;
+  E.undoIndex = 0;
+  E.follow = 0;
+  free(E.filename);
+  E.filename = strdup(filename);
+  editorDetectLanguage(filename);
+  editorSyntaxDefer(0);
+
+  size_t size;
+  const char *data = editorMapFile(filename, &size);
+  fileFormat fmt = {0, 0, 0, 1};
+  if (data)
+    editorDetectFormat(data, size, &fmt);
+  editorSetFormat(&fmt);
+  if (!data)
+    return -1;
+  if (fmt.mixed)
+    editorSetStatusMessage("Mixed line endings, saving as %s",
+                           fmt.crlf ? "CRLF" : "LF");
+
+  size_t pos = fmt.bom ? 3 : 0, start = pos;
+  ssize_t linelen;
+  while ((linelen = editorNextLine(data, size, &pos)) != -1) {
+    editorInsertRow(E.numrows, (char *)data + start, linelen);
+    start = pos;
+  }
+  editorUnmapFile(data, size);
+  E.dirty = 0;
+  editorRecordDiskState();
+  editorDirtyReset();
+  editorWatchFile();
+  editorSwapOpen();
+  return 0;
+}
+
+int editorPwriteAll(int fd, const char *buf, size_t len, off_t offset) {
+  while (len > 0) {
+    ssize_t w = pwrite(fd, buf, len, offset);
+    if (w == -1) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    buf += w;
+    len -= w;
+    offset += w;
+  }
+  return 0;
+}
+
+/* Writes only the rows changed since the file was last loaded or saved.
+ * The bytes around them are still on disk as long as the file length is
+ * unchanged or nothing follows the change. The new bytes are synced to a
+ * journal first, so an interrupted write is finished on the next open. */
+int editorSaveInPlace(const char *journal, size_t *written,
+                      long long *offset) {
+  if (!E.diskCanonical || editorDiskStateChanged())
+    return -1;
+  int first = E.dirtyFirst == -1 ? E.numrows : E.dirtyFirst;
+  int last = E.numrows - E.dirtyTail;
+  if (last < first)
+    last = first;
+  size_t prefix = editorRowOffset(first);
+  size_t tail = editorRowsBytes(last, E.numrows);
+  size_t len = editorRowsBytes(first, last);
+  long long total = prefix + len + tail;
+  if (total != (long long)E.disk.st_size && tail != 0)
+    return -1;
+
+  char *buf = editorRowsRangeToString(first, last, &len);
+  saveJournal head;
+  memcpy(head.magic, JOURNAL_MAGIC, sizeof(head.magic));
+  head.ino = E.disk.st_ino;
+  head.offset = prefix;
+  head.length = len;
+  head.size = total;
+
+  int fd = open(journal, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  int ok = fd != -1 &&
+           editorPwriteAll(fd, (char *)&head, sizeof(head), 0) == 0 &&
+           editorPwriteAll(fd, buf, len, sizeof(head)) == 0 &&
+           fdatasync(fd) == 0;
+  if (fd != -1)
+    close(fd);
+  if (!ok) {
+    unlink(journal);
+  } else {
+    fd = open(E.filename, O_WRONLY | O_CLOEXEC);
+    ok = fd != -1 && editorPwriteAll(fd, buf, len, prefix) == 0 &&
+         ftruncate(fd, total) == 0 && fdatasync(fd) == 0;
+    if (fd != -1)
+      close(fd);
+    if (ok)
+      unlink(journal);
+  }
+  free(buf);
+  *written = len;
+  *offset = prefix;
+  return ok ? 0 : -1;
+}
+
+/* Writes rows [from, to) at offset, each followed by the file's line
+ * ending. The rows go to pwritev straight from the buffer rather than being
+ * copied into one string first. */
+int editorWriteRows(int fd, int from, int to, off_t offset) {
+  char *eol = E.format.crlf ? "\r\n" : "\n";
+  size_t eolLen = strlen(eol);
+  struct iovec iov[SAVE_IOV_MAX];
+  int n = 0;
+  while (from < to || n > 0) {
+    for (; from < to && n + 2 <= SAVE_IOV_MAX; from++) {
+      iov[n++] = (struct iovec){E.row[from].chars, E.row[from].size};
+      iov[n++] = (struct iovec){eol, eolLen};
+    }
+    ssize_t w = pwritev(fd, iov, n, offset);
+    if (w == -1) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    offset += w;
+
+    /* A short write leaves the rest of its vectors for the next call. */
+    int done = 0;
+    while (done < n && (size_t)w >= iov[done].iov_len)
+      w -= iov[done++].iov_len;
+    if (done < n) {
+      iov[done].iov_base = (char *)iov[done].iov_base + w;
+      iov[done].iov_len -= w;
+    }
+    memmove(iov, iov + done, sizeof(struct iovec) * (n - done));
+    n -= done;
+  }
+  return 0;
+}
+
+int editorWriteFile(int fd) {
+  int bom = E.format.bom ? 3 : 0;
+  if (editorPwriteAll(fd, UTF8_BOM, bom, 0) == -1)
+    return -1;
+  return editorWriteRows(fd, 0, E.numrows, bom);
+}
+
+/* Replaces the file through a synced temporary and a rename, so a crash
+ * leaves either the old contents or the new ones. Links, and files in
+ * directories that cannot take the temporary, are rewritten in place. */
+int editorSaveAtomic(void) {
+  struct stat st;
+  int exists = lstat(E.filename, &st) == 0;
+  char tmp[1024];
+  editorHiddenPath(E.filename, "save", tmp, sizeof(tmp));
+
+  int fd = -1;
+  if (!exists || (S_ISREG(st.st_mode) && st.st_nlink == 1))
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd != -1) {
+    int ok = (!exists || fchmod(fd, st.st_mode & 07777) == 0) &&
+             editorWriteFile(fd) == 0 && fdatasync(fd) == 0;
+    close(fd);
+    if (ok && rename(tmp, E.filename) == 0)
+      return 0;
+    int saved = errno;
+    unlink(tmp);
+    errno = saved;
+    return -1;
+  }
+
+  fd = open(E.filename, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (fd == -1)
+    return -1;
+  int ok = ftruncate(fd, editorRowOffset(E.numrows)) == 0 &&
+           editorWriteFile(fd) == 0;
+  close(fd);
+  return ok ? 0 : -1;
+}
+
+/* Finishes an in-place save whose journal was synced before the editor
+ * stopped. A journal cut short, or one for a file that has since been
+ * replaced, is dropped. */
+void editorJournalReplay(const char *filename) {
+  char path[1024];
+  editorHiddenPath(filename, "journal", path, sizeof(path));
+  size_t size;
+  const char *data = editorMapFile(path, &size);
+  if (!data)
+    return;
+
+  saveJournal head;
+  struct stat st;
+  if (size >= sizeof(head))
+    memcpy(&head, data, sizeof(head));
+  if (size >= sizeof(head) &&
+      memcmp(head.magic, JOURNAL_MAGIC, sizeof(head.magic)) == 0 &&
+      head.length == (long long)(size - sizeof(head)) &&
+      stat(filename, &st) == 0 && (long long)st.st_ino == head.ino) {
+    int fd = open(filename, O_WRONLY | O_CLOEXEC);
+    if (fd != -1 &&
+        editorPwriteAll(fd, data + sizeof(head), head.length, head.offset) ==
+            0 &&
+        ftruncate(fd, head.size) == 0 && fdatasync(fd) == 0)
+      editorSetStatusMessage("Finished an interrupted save of %.40s",
+                             filename);
+    if (fd != -1)
+      close(fd);
+  }
+  editorUnmapFile(data, size);
+  unlink(path);
+}
+
+void editorSave(void) {
+  if (E.filename == NULL) {
+    E.filename = malloc(128);
+    E.filename[0] = '\0';
+    editorSetStatusMessage("Save as: %s (ESC to cancel)", E.filename);
+    return;
+  }
+
+  char journal[1024];
+  editorHiddenPath(E.filename, "journal", journal, sizeof(journal));
+  size_t len;
+  long long offset = -1;
+  if (editorSaveInPlace(journal, &len, &offset) == -1) {
+    len = editorRowOffset(E.numrows);
+    if (editorSaveAtomic() == -1) {
+      editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
+      return;
+    }
+    unlink(journal);
+    offset = -1;
+  }
+
+  E.format.mixed = 0;
+  E.format.canonical = 1;
+  E.dirty = 0;
+  editorRecordDiskState();
+  editorDirtyReset();
+  editorSwapReset();
+  editorWatchFile();
+  editorDetectLanguage(E.filename);
+  if (offset == -1)
+    editorSetStatusMessage("%zu bytes written to disk", len);
+  else
+    editorSetStatusMessage("%zu bytes written to disk at offset %lld", len,
+                           offset);
+}
+
+/* Re-reads the file and applies only the lines that differ. The common
+ * prefix and suffix are matched against the existing rows first, so their
+ * render and syntax state survive and a small external change only touches
+ * the rows around it. */
 void editorReload(void) {
   if (E.filename == NULL) {
     editorSetStatusMessage("No file to reload");
     return;
   }
 
-  for (int i = 0; i < E.numrows; i++) {
-    editorFreeRow(&E.row[i]);
+  size_t size;
+  const char *data = editorMapFile(E.filename, &size);
+  if (!data) {
+    editorSetStatusMessage("Can't reload! I/O error: %s", strerror(errno));
+    return;
   }
-  free(E.row);
-  E.row = NULL;
-  E.numrows = 0;
 
-  FILE *fp = fopen(E.filename, "r");
-  if (!fp) {
-    die("fopen");
+  fileFormat fmt;
+  editorDetectFormat(data, size, &fmt);
+  editorSetFormat(&fmt);
+
+  int prefix = 0;
+  size_t pos = fmt.bom ? 3 : 0, middle = pos;
+  ssize_t len;
+  while (prefix < E.numrows && (len = editorNextLine(data, size, &pos)) != -1) {
+    if (!editorRowEquals(&E.row[prefix], data + middle, len))
+      break;
+    prefix++;
+    middle = pos;
   }
 
-  char *line = NULL;
-  size_t linecap = 0;
-  ssize_t linelen;
-  while ((linelen = getline(&line, &linecap, fp)) != -1) {
-    while (linelen > 0 &&
-           (line[linelen - 1] == '\n' || line[linelen - 1] == '\r'))
-      linelen--;
-    editorInsertRow(E.numrows, line, linelen);
+  int oldEnd = E.numrows;
+  int haveLine = middle < size;
+  size_t lineEnd = size, tail = size;
+  if (haveLine && data[lineEnd - 1] == '\n')
+    lineEnd--;
+  while (haveLine && oldEnd > prefix) {
+    const char *nl = memrchr(data + middle, '\n', lineEnd - middle);
+    size_t lineStart = nl ? (size_t)(nl - data) + 1 : middle;
+    size_t end = lineEnd;
+    while (end > lineStart && data[end - 1] == '\r')
+      end--;
+    if (!editorRowEquals(&E.row[oldEnd - 1], data + lineStart,
+                         end - lineStart))
+      break;
+    oldEnd--;
+    tail = lineStart;
+    if (lineStart == middle)
+      haveLine = 0;
+    else
+      lineEnd = lineStart - 1;
   }
 
-  free(line);
-  fclose(fp);
+  lineSpan *lines = NULL;
+  int numLines = 0, capLines = 0;
+  pos = middle;
+  size_t lineStart = middle;
+  while ((len = editorNextLine(data, tail, &pos)) != -1) {
+    if (numLines == capLines) {
+      capLines = capLines ? capLines * 2 : 64;
+      lines = realloc(lines, sizeof(lineSpan) * capLines);
+    }
+    lines[numLines].start = lineStart;
+    lines[numLines].len = len;
+    numLines++;
+    lineStart = pos;
+  }
+
+  reloadHunk *hunks;
+  int numHunks =
+      editorDiffRows(prefix, oldEnd, data, lines, numLines, &hunks);
+
+  int added = 0, removed = 0;
+  for (int h = numHunks - 1; h >= 0; h--) {
+    reloadHunk *hk = &hunks[h];
+    editorReplaceRows(hk->oldStart, hk->oldCount, data, &lines[hk->newStart],
+                      hk->newCount);
+    added += hk->newCount;
+    removed += hk->oldCount;
+  }
+
+  int delta = 0, cy = E.cy, rowoff = E.rowoff;
+  for (int h = 0; h < numHunks; h++) {
+    reloadHunk *hk = &hunks[h];
+    int newStart = hk->oldStart + delta;
+    if (E.cy >= hk->oldStart + hk->oldCount)
+      cy += hk->newCount - hk->oldCount;
+    else if (E.cy >= hk->oldStart)
+      cy = newStart + (E.cy - hk->oldStart < hk->newCount
+                           ? E.cy - hk->oldStart
+                           : hk->newCount);
+    if (E.rowoff >= hk->oldStart + hk->oldCount)
+      rowoff += hk->newCount - hk->oldCount;
+    else if (E.rowoff >= hk->oldStart)
+      rowoff = newStart;
+    delta += hk->newCount - hk->oldCount;
+  }
+  E.cy = cy > E.numrows ? E.numrows : cy;
+  E.rowoff = rowoff > E.cy ? E.cy : rowoff;
+  if (E.cy < E.numrows && E.cx > E.row[E.cy].size)
+    E.cx = E.row[E.cy].size;
+  else if (E.cy == E.numrows)
+    E.cx = 0;
+
+  /* Follow mode reads on from the bytes actually loaded, which the file
+   * may have outgrown by the time its state is recorded. */
+  E.followOffset = size;
+  E.followPartial = size > 0 && data[size - 1] != '\n';
+
+  free(hunks);
+  free(lines);
+  editorUnmapFile(data, size);
   E.dirty = 0;
-  editorSetStatusMessage("File reloaded successfully");
+  editorRecordDiskState();
+  editorDirtyReset();
+  editorSwapReset();
+  if (numHunks == 0)
+    editorSetStatusMessage("File reloaded: no changes");
+  else
+    editorSetStatusMessage("File reloaded: %d hunk%s, +%d -%d lines", numHunks,
+                           numHunks == 1 ? "" : "s", added, removed);
 }
 
-void editorFind(void) {
-  editorSetStatusMessage("Search functionality not implemented");
+/* Appends raw file bytes to the buffer. A line without its newline yet is
+ * kept as a partial last row and extended by the next call. */
+void editorFollowAppend(const char *buf, size_t len) {
+  size_t pos = 0;
+  while (pos < len) {
+    const char *nl = memchr(buf + pos, '\n', len - pos);
+    size_t end = nl ? (size_t)(nl - buf) : len;
+
+    if (E.followPartial && E.numrows > 0)
+      editorRowAppendString(&E.row[E.numrows - 1], (char *)buf + pos,
+                            end - pos);
+    else
+      editorInsertRow(E.numrows, (char *)buf + pos, end - pos);
+
+    E.followPartial = nl == NULL;
+    if (nl) {
+      erow *row = &E.row[E.numrows - 1];
+      while (row->size > 0 && row->chars[row->size - 1] == '\r')
+        editorRowDelChar(row, row->size - 1);
+    }
+    pos = nl ? end + 1 : len;
+  }
 }
 
-void editorFileBrowserUpdate(void) {
-  for (int i = 0; i < E.fb.numEntries; i++) {
-    free(E.fb.entries[i].name);
+/* Reads everything past the followed offset. Work is proportional to the
+ * bytes appended since the last read. */
+int editorFollowRead(void) {
+  int fd = open(E.filename, O_RDONLY);
+  if (fd == -1)
+    return -1;
+
+  char buf[65536];
+  ssize_t n;
+  while ((n = pread(fd, buf, sizeof(buf), E.followOffset)) > 0) {
+    editorFollowAppend(buf, n);
+    E.followOffset += n;
   }
-  free(E.fb.entries);
-  E.fb.entries = NULL;
-  E.fb.numEntries = 0;
+  close(fd);
+  return n == -1 ? -1 : 0;
+}
 
-  DIR *dir = opendir(E.fb.currentDir);
-  if (!dir) {
-    editorSetStatusMessage("Cannot open directory: %s", E.fb.currentDir);
+void editorFollowRestart(void) {
+  editorClearRows();
+  E.followOffset = 0;
+  E.followPartial = 0;
+  E.version++;
+}
+
+void editorFollowUpdate(void) {
+  if (!E.follow)
+    return;
+  if (E.dirty) {
+    E.follow = 0;
+    editorSetStatusMessage("Follow mode stopped: buffer was modified");
     return;
   }
 
-  struct dirent *entry;
-  int count = 0;
-  while ((entry = readdir(dir)) != NULL) {
-    count++;
+  struct stat st;
+  if (stat(E.filename, &st) == -1) {
+    editorSetStatusMessage("Following: waiting for %.40s", E.filename);
+    return;
+  }
+
+  int pinned = E.cy >= E.numrows - 1;
+  if (st.st_ino != E.disk.st_ino || st.st_size < E.followOffset) {
+    editorSetStatusMessage(st.st_ino != E.disk.st_ino
+                               ? "Following: file was rotated"
+                               : "Following: file was truncated");
+    editorFollowRestart();
+    pinned = 1;
+  } else if (st.st_size == E.followOffset) {
+    return;
   }
-  rewinddir(dir);
 
-  E.fb.entries = malloc(count * sizeof(dirEntry));
+  if (editorFollowRead() == -1)
+    editorSetStatusMessage("Following: read error: %s", strerror(errno));
+  /* Appended lines are not checked for their endings. */
+  E.format.canonical = 0;
+  E.dirty = 0;
+  editorRecordDiskState();
+  editorDirtyReset();
+  editorSwapReset();
+
+  if (pinned) {
+    E.cy = E.numrows > 0 ? E.numrows - 1 : 0;
+    E.cx = 0;
+  }
+}
 
-  while ((entry = readdir(dir)) != NULL) {
-    dirEntry *de = &E.fb.entries[E.fb.numEntries++];
-    de->name = strdup(entry->d_name);
-    de->isDir = entry->d_type == DT_DIR;
+void editorFollowToggle(void) {
+  if (E.follow) {
+    E.follow = 0;
+    editorSetStatusMessage("Follow mode off");
+    return;
+  }
+  if (!E.filename) {
+    editorSetStatusMessage("No file to follow");
+    return;
   }
+  if (E.dirty) {
+    editorSetStatusMessage("Save changes before following");
+    return;
+  }
+
+  E.followOffset = -1;
+  editorReload();
+  if (E.followOffset == -1)
+    return;
+  E.follow = 1;
 
-  closedir(dir);
-  editorSetStatusMessage("File browser updated: %s", E.fb.currentDir);
+  E.cy = E.numrows > 0 ? E.numrows - 1 : 0;
+  E.cx = 0;
+  editorSetStatusMessage("Following %.40s (Ctrl-D to stop)", E.filename);
 }
 
-void editorFileBrowserToggle(void) {
-  E.fb.visible = !E.fb.visible;
+/* Names a file kept next to another one as .NAME.EXT. */
+void editorHiddenPath(const char *filename, const char *ext, char *out,
+                      size_t size) {
+  const char *slash = strrchr(filename, '/');
+  if (slash)
+    snprintf(out, size, "%.*s.%s.%s", (int)(slash - filename + 1), filename,
+             slash + 1, ext);
+  else
+    snprintf(out, size, ".%s.%s", filename, ext);
+}
 
-  if (E.fb.visible) {
-    if (E.fb.currentDir[0] == '\0') {
-      getcwd(E.fb.currentDir, sizeof(E.fb.currentDir));
-    }
-    editorFileBrowserUpdate();
-  }
+void editorSwapBase(swapHeader *base) {
+  memset(base, 0, sizeof(*base));
+  memcpy(base->magic, SWAP_MAGIC, sizeof(base->magic));
+  base->size = E.disk.st_size;
+  base->mtime = E.disk.st_mtime;
+  base->ino = E.disk.st_ino;
 }
 
-void editorFileBrowserDraw(void) {
-  if (!E.fb.visible)
+/* Folds a change of `removed` rows at `at` into the hunk list, merging
+ * every hunk it touches, so the list stays sorted and disjoint. */
+void editorSwapTrack(int at, int removed, int added) {
+  swapState *sw = &E.swap;
+  if (!sw->active)
     return;
+  if (sw->numHunks == SWAP_MAX_HUNKS)
+    editorSwapFlush();
 
-  int width = E.screencols / 4;
-  if (width < 20)
-    width = 20;
-  if (width > 40)
-    width = 40;
+  int i = 0, shift = 0;
+  while (i < sw->numHunks &&
+         sw->hunks[i].newStart + sw->hunks[i].newCount < at) {
+    shift += sw->hunks[i].newCount - sw->hunks[i].oldCount;
+    i++;
+  }
 
-  char buf[32];
-  int rows = E.screenrows - 2;
+  int first = i, start = at, end = at + removed, merged = 0;
+  while (i < sw->numHunks && sw->hunks[i].newStart <= at + removed) {
+    swapHunk *h = &sw->hunks[i];
+    if (h->newStart < start)
+      start = h->newStart;
+    if (h->newStart + h->newCount > end)
+      end = h->newStart + h->newCount;
+    merged += h->newCount - h->oldCount;
+    i++;
+  }
 
-  for (int y = 0; y < rows; y++) {
-    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", y + 1, 1);
-    write(STDOUT_FILENO, buf, strlen(buf));
+  swapHunk hunk = {start - shift, end - start - merged, start,
+                   end - start - removed + added};
+  memmove(&sw->hunks[first + 1], &sw->hunks[i],
+          sizeof(swapHunk) * (sw->numHunks - i));
+  sw->numHunks -= i - first - 1;
+  sw->hunks[first] = hunk;
+  for (i = first + 1; i < sw->numHunks; i++)
+    sw->hunks[i].newStart += added - removed;
+
+  if (sw->dirtySince == 0)
+    sw->dirtySince = editorProfNow();
+}
 
-    setColor(COLOR_BACKGROUND);
+swapRecord *editorSwapRecordNew(int type) {
+  swapRecord *rec = editorMalloc(sizeof(swapRecord));
+  memset(rec, 0, sizeof(*rec));
+  rec->type = type;
+  snprintf(rec->path, sizeof(rec->path), "%s", E.swap.path);
+  rec->base = E.swap.base;
+  return rec;
+}
 
-    for (int i = 0; i < width; i++) {
-      write(STDOUT_FILENO, " ", 1);
+void editorSwapRecordFree(swapRecord *rec) {
+  for (int i = 0; i < rec->numRows; i++)
+    editorRowTextRelease(rec->rows[i].text);
+  editorFree(rec->rows);
+  editorFree(rec->hunks);
+  editorSnapshotRelease(rec->snap);
+  editorFree(rec);
+}
+
+void editorSwapEnqueue(swapRecord *rec) {
+  swapState *sw = &E.swap;
+  if (!sw->started) {
+    pthread_mutex_init(&sw->lock, NULL);
+    pthread_cond_init(&sw->cond, NULL);
+    sw->fd = -1;
+    sw->stop = 0;
+    if (pthread_create(&sw->thread, NULL, editorSwapThread, sw) != 0) {
+      editorSwapWrite(sw, rec);
+      editorSwapRecordFree(rec);
+      return;
     }
+    sw->started = 1;
   }
+  pthread_mutex_lock(&sw->lock);
+  if (sw->tail)
+    sw->tail->next = rec;
+  else
+    sw->queue = rec;
+  sw->tail = rec;
+  pthread_cond_signal(&sw->cond);
+  pthread_mutex_unlock(&sw->lock);
+}
 
-  snprintf(buf, sizeof(buf), "\x1b[%d;%dH", 1, 1);
-  write(STDOUT_FILENO, buf, strlen(buf));
-  setColor(COLOR_STATUS_BG);
+/* Hands the rows changed since the last write to the writer thread. Only
+ * their text blocks are retained, so this costs the size of the change,
+ * not of the buffer. Once the log outgrows the file, a checkpoint of the
+ * whole buffer replaces it. */
+void editorSwapFlush(void) {
+  swapState *sw = &E.swap;
+  sw->dirtySince = 0;
+  if (!sw->active || sw->numHunks == 0)
+    return;
 
-  char title[41] = " File Browser ";
-  int titleLen = strlen(title);
-  write(STDOUT_FILENO, title, titleLen);
-  for (int i = titleLen; i < width; i++) {
-    write(STDOUT_FILENO, " ", 1);
+  swapRecord *rec;
+  long long limit =
+      sw->base.size > SWAP_COMPACT_BYTES ? sw->base.size : SWAP_COMPACT_BYTES;
+  if (sw->logBytes > limit) {
+    rec = editorSwapRecordNew(SWAP_CHECKPOINT);
+    rec->snap = editorSnapshotCreate();
+    sw->logBytes = 0;
+  } else {
+    rec = editorSwapRecordNew(SWAP_DELTA);
+    rec->numHunks = sw->numHunks;
+    rec->hunks = editorMalloc(sizeof(swapHunk) * sw->numHunks);
+    memcpy(rec->hunks, sw->hunks, sizeof(swapHunk) * sw->numHunks);
+    for (int i = 0; i < sw->numHunks; i++)
+      rec->numRows += sw->hunks[i].newCount;
+    rec->rows = editorMalloc(sizeof(snapshotRow) * (rec->numRows + 1));
+    int n = 0;
+    for (int i = 0; i < sw->numHunks; i++) {
+      for (int j = 0; j < sw->hunks[i].newCount; j++) {
+        erow *row = &E.row[sw->hunks[i].newStart + j];
+        rec->rows[n].text = editorRowText(row);
+        editorRowTextRetain(rec->rows[n].text);
+        rec->rows[n++].size = row->size;
+        sw->logBytes += row->size + sizeof(int);
+      }
+      sw->logBytes += sizeof(swapHunk);
+    }
   }
+  sw->numHunks = 0;
+  sw->written = 1;
+  editorSwapEnqueue(rec);
+}
 
-  int visible_rows = rows - 2;
-  int start = E.fb.scroll;
-  int end = start + visible_rows;
-  if (end > E.fb.numEntries)
-    end = E.fb.numEntries;
+int editorSwapStep(void) {
+  editorSwapFlush();
+  return 0;
+}
 
-  for (int i = start, y = 2; i < end; i++, y++) {
-    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", y, 1);
-    write(STDOUT_FILENO, buf, strlen(buf));
+int editorSwapPollTimeout(void) {
+  swapState *sw = &E.swap;
+  if (!sw->active || sw->dirtySince == 0)
+    return -1;
+  long long left =
+      (sw->dirtySince - editorProfNow()) / 1000000 + SWAP_INTERVAL_MS;
+  return left > 0 ? (int)left : 0;
+}
 
-    if (i == E.fb.selected) {
-      setColor(COLOR_SELECTION);
-    } else {
-      setColor(COLOR_FOREGROUND);
-    }
+void editorSwapTick(void) {
+  swapState *sw = &E.swap;
+  int error = __atomic_exchange_n(&sw->error, 0, __ATOMIC_RELAXED);
+  if (error)
+    editorSetStatusMessage("Swap file error: %s", strerror(error));
+  if (editorSwapPollTimeout() == 0)
+    editorIdleSchedule(IDLE_SWAP, IDLE_BACKGROUND);
+}
 
-    dirEntry *entry = &E.fb.entries[i];
-    char line[41];
-    if (entry->isDir) {
-      snprintf(line, sizeof(line), " [%s]", entry->name);
-    } else {
-      snprintf(line, sizeof(line), " %s", entry->name);
+int editorSwapWriteAll(int fd, struct iovec *iov, int n) {
+  while (n > 0) {
+    ssize_t w = writev(fd, iov, n);
+    if (w == -1) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    while (n > 0 && (size_t)w >= iov->iov_len) {
+      w -= iov->iov_len;
+      iov++;
+      n--;
     }
+    if (n > 0) {
+      iov->iov_base = (char *)iov->iov_base + w;
+      iov->iov_len -= w;
+    }
+  }
+  return 0;
+}
 
-    int len = strlen(line);
-    if (len > width - 1) {
-      line[width - 4] = '.';
-      line[width - 3] = '.';
-      line[width - 2] = '.';
-      line[width - 1] = '\0';
-      len = width - 1;
+/* Record layout: a swapRecordHeader, the hunks as oldStart, oldCount and
+ * newCount, then every new row as its length and bytes. Row text is
+ * written straight from the retained blocks. */
+int editorSwapWriteRecord(int fd, swapRecord *rec) {
+  snapshotRow *rows = rec->snap ? rec->snap->rows : rec->rows;
+  int numRows = rec->snap ? rec->snap->numrows : rec->numRows;
+  swapHunk all = {0, -1, 0, numRows};
+  swapHunk *hunks = rec->snap ? &all : rec->hunks;
+  int numHunks = rec->snap ? 1 : rec->numHunks;
+
+  swapRecordHeader head = {rec->type, numHunks, 0};
+  head.payload = (long long)numHunks * 3 * sizeof(int);
+  for (int i = 0; i < numRows; i++)
+    head.payload += sizeof(int) + rows[i].size;
+
+  int *fields = editorMalloc(sizeof(int) * (numHunks * 3 + numRows + 1));
+  for (int i = 0; i < numHunks; i++) {
+    fields[i * 3] = hunks[i].oldStart;
+    fields[i * 3 + 1] = hunks[i].oldCount;
+    fields[i * 3 + 2] = hunks[i].newCount;
+  }
+  int *lens = fields + numHunks * 3;
+
+  struct iovec iov[SWAP_IOV];
+  iov[0].iov_base = &head;
+  iov[0].iov_len = sizeof(head);
+  iov[1].iov_base = fields;
+  iov[1].iov_len = sizeof(int) * numHunks * 3;
+  int n = 2, result = 0;
+  for (int i = 0; i < numRows && result == 0; i++) {
+    lens[i] = rows[i].size;
+    iov[n].iov_base = &lens[i];
+    iov[n++].iov_len = sizeof(int);
+    iov[n].iov_base = rows[i].text->chars;
+    iov[n++].iov_len = rows[i].size;
+    if (n + 2 > SWAP_IOV) {
+      result = editorSwapWriteAll(fd, iov, n);
+      n = 0;
     }
+  }
+  if (result == 0)
+    result = editorSwapWriteAll(fd, iov, n);
+  editorFree(fields);
+  return result;
+}
 
-    write(STDOUT_FILENO, line, len);
+/* Runs on the writer thread. Deltas are appended and synced; a checkpoint
+ * is written to a new file that is renamed over the old one, so a crash
+ * mid-write leaves the previous log intact. */
+void editorSwapWrite(swapState *sw, swapRecord *rec) {
+  if (sw->fd != -1 && (rec->type != SWAP_DELTA ||
+                       strcmp(sw->openPath, rec->path) != 0)) {
+    close(sw->fd);
+    sw->fd = -1;
+  }
 
-    for (int j = len; j < width; j++) {
-      write(STDOUT_FILENO, " ", 1);
+  int error = 0;
+  if (rec->type == SWAP_REMOVE) {
+    if (unlink(rec->path) == -1 && errno != ENOENT)
+      error = errno;
+  } else if (rec->type == SWAP_CHECKPOINT) {
+    char tmp[1040];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", rec->path);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd == -1 || write(fd, &rec->base, sizeof(rec->base)) == -1 ||
+        editorSwapWriteRecord(fd, rec) == -1 || fdatasync(fd) == -1 ||
+        rename(tmp, rec->path) == -1)
+      error = errno;
+    if (fd != -1)
+      close(fd);
+  } else {
+    if (sw->fd == -1) {
+      sw->fd = open(rec->path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+      snprintf(sw->openPath, sizeof(sw->openPath), "%s", rec->path);
+      struct stat st;
+      if (sw->fd != -1 && fstat(sw->fd, &st) == 0 && st.st_size == 0 &&
+          write(sw->fd, &rec->base, sizeof(rec->base)) == -1)
+        error = errno;
     }
+    if (sw->fd == -1 || editorSwapWriteRecord(sw->fd, rec) == -1 ||
+        fdatasync(sw->fd) == -1)
+      error = errno;
   }
+  if (error)
+    __atomic_store_n(&sw->error, error, __ATOMIC_RELAXED);
+}
 
-  resetColor();
+void *editorSwapThread(void *arg) {
+  swapState *sw = arg;
+  pthread_mutex_lock(&sw->lock);
+  for (;;) {
+    while (!sw->queue && !sw->stop)
+      pthread_cond_wait(&sw->cond, &sw->lock);
+    swapRecord *rec = sw->queue;
+    if (!rec)
+      break;
+    sw->queue = rec->next;
+    if (!sw->queue)
+      sw->tail = NULL;
+    pthread_mutex_unlock(&sw->lock);
+    editorSwapWrite(sw, rec);
+    editorSwapRecordFree(rec);
+    pthread_mutex_lock(&sw->lock);
+  }
+  pthread_mutex_unlock(&sw->lock);
+  if (sw->fd != -1)
+    close(sw->fd);
+  sw->fd = -1;
+  return NULL;
 }
 
-void editorFileBrowserProcessKey(int key) {
-  switch (key) {
-  case ARROW_UP:
-    if (E.fb.selected > 0) {
-      E.fb.selected--;
-      if (E.fb.selected < E.fb.scroll) {
-        E.fb.scroll = E.fb.selected;
+/* The buffer matches the file on disk again, so the swap file has nothing
+ * to keep. Changes from here on are logged against the new disk state. */
+void editorSwapReset(void) {
+  swapState *sw = &E.swap;
+  if (E.headless || sw->disabled || !E.filename)
+    return;
+  if (sw->written)
+    editorSwapEnqueue(editorSwapRecordNew(SWAP_REMOVE));
+  editorHiddenPath(E.filename, "swp", sw->path, sizeof(sw->path));
+  editorSwapBase(&sw->base);
+  sw->numHunks = 0;
+  sw->dirtySince = 0;
+  sw->logBytes = 0;
+  sw->written = 0;
+  sw->active = 1;
+}
+
+/* Detaches the swap file from the buffer, writing out pending changes when
+ * keep is set and deleting the file otherwise. */
+void editorSwapClose(int keep) {
+  swapState *sw = &E.swap;
+  if (!sw->active)
+    return;
+  if (keep && E.dirty)
+    editorSwapFlush();
+  else if (sw->written)
+    editorSwapEnqueue(editorSwapRecordNew(SWAP_REMOVE));
+  editorIdleCancel(IDLE_SWAP);
+  sw->active = 0;
+  sw->written = 0;
+  sw->numHunks = 0;
+  sw->dirtySince = 0;
+}
+
+void editorSwapShutdown(void) {
+  swapState *sw = &E.swap;
+  if (!sw->started)
+    return;
+  pthread_mutex_lock(&sw->lock);
+  sw->stop = 1;
+  pthread_cond_signal(&sw->cond);
+  pthread_mutex_unlock(&sw->lock);
+  pthread_join(sw->thread, NULL);
+  sw->started = 0;
+}
+
+/* Replays a swap file over the freshly loaded buffer. Hunks of a record are
+ * applied last to first so their old positions stay valid. A record is
+ * checked completely before it is applied, and replay stops at the first
+ * torn or inconsistent one, which is cut off so new records can follow.
+ * Returns the number of records applied; a log kept against a different
+ * version of the file is only usable from a checkpoint. */
+int editorSwapRecover(const char *path) {
+  size_t size;
+  const char *data = editorMapFile(path, &size);
+  if (!data)
+    return 0;
+
+  swapHeader base, disk;
+  swapRecordHeader head = {0, 0, 0};
+  size_t pos = sizeof(base);
+  editorSwapBase(&disk);
+  if (size >= pos + sizeof(head))
+    memcpy(&head, data + pos, sizeof(head));
+  if (size >= pos)
+    memcpy(&base, data, sizeof(base));
+  if (size < pos || (memcmp(&base, &disk, sizeof(base)) != 0 &&
+                     head.type != SWAP_CHECKPOINT)) {
+    editorUnmapFile(data, size);
+    return 0;
+  }
+
+  int records = 0;
+  while (pos + sizeof(head) <= size) {
+    memcpy(&head, data + pos, sizeof(head));
+    size_t start = pos + sizeof(head);
+    if (head.numHunks <= 0 || head.payload < 0 ||
+        (size_t)head.payload > size - start)
+      break;
+
+    int *fields = editorMalloc(sizeof(int) * head.numHunks * 3);
+    size_t hunkBytes = sizeof(int) * head.numHunks * 3;
+    if (hunkBytes > (size_t)head.payload) {
+      editorFree(fields);
+      break;
+    }
+    memcpy(fields, data + start, hunkBytes);
+
+    int total = 0, numrows = E.numrows, ok = 1;
+    for (int h = 0; h < head.numHunks && ok; h++) {
+      int *f = &fields[h * 3];
+      if (f[1] < 0)
+        f[1] = numrows;
+      ok = f[0] >= 0 && f[2] >= 0 && f[0] + f[1] <= numrows;
+      total += f[2];
+    }
+    lineSpan *lines = editorMalloc(sizeof(lineSpan) * (total + 1));
+    size_t p = start + hunkBytes, end = start + head.payload;
+    for (int i = 0; i < total && ok; i++) {
+      int len;
+      ok = p + sizeof(int) <= end;
+      if (ok) {
+        memcpy(&len, data + p, sizeof(int));
+        p += sizeof(int);
+        ok = len >= 0 && (size_t)len <= end - p;
+      }
+      if (ok) {
+        lines[i].start = p;
+        lines[i].len = len;
+        p += len;
       }
     }
-    break;
 
-  case ARROW_DOWN:
-    if (E.fb.selected < E.fb.numEntries - 1) {
-      E.fb.selected++;
-      if (E.fb.selected >= E.fb.scroll + E.screenrows - 4) {
-        E.fb.scroll++;
+    if (ok) {
+      int row = total;
+      for (int h = head.numHunks - 1; h >= 0; h--) {
+        int *f = &fields[h * 3];
+        row -= f[2];
+        editorReplaceRows(f[0], f[1], data, &lines[row], f[2]);
       }
+      records++;
+      pos = end;
     }
-    break;
+    editorFree(lines);
+    editorFree(fields);
+    if (!ok)
+      break;
+  }
+  editorUnmapFile(data, size);
+  if (pos < size && truncate(path, pos) == -1)
+    E.swap.error = errno;
+  E.swap.base = base;
+  return records;
+}
 
-  case '\r':
-    if (E.fb.selected >= 0 && E.fb.selected < E.fb.numEntries) {
-      dirEntry *entry = &E.fb.entries[E.fb.selected];
+/* Called once a file is loaded. A swap file left behind by a session that
+ * did not exit cleanly is offered for recovery before logging starts.
+ * Without a terminal to answer on, it is left alone for a later session
+ * and this one does not log. */
+void editorSwapOpen(void) {
+  swapState *sw = &E.swap;
+  if (E.headless || sw->disabled || !E.filename)
+    return;
+  char path[1024];
+  editorHiddenPath(E.filename, "swp", path, sizeof(path));
+
+  struct stat st;
+  int records = 0;
+  if (stat(path, &st) == 0) {
+    if (!isatty(STDIN_FILENO)) {
+      editorSetStatusMessage("Swap file %.40s exists, not recovering", path);
+      return;
+    }
+    if (editorConfirm("Unsaved changes were found in a swap file. Recover?"))
+      records = editorSwapRecover(path);
+    if (records > 0) {
+      snprintf(sw->path, sizeof(sw->path), "%s", path);
+      sw->numHunks = 0;
+      sw->dirtySince = 0;
+      sw->logBytes = st.st_size;
+      sw->written = 1;
+      sw->active = 1;
+      E.dirty = records;
+      editorSetStatusMessage("Recovered %d change%s from %.40s", records,
+                             records == 1 ? "" : "s", path);
+      return;
+    }
+    unlink(path);
+  }
+  editorSwapReset();
+}
 
-      if (entry->isDir) {
-        char newPath[1024];
-        if (strcmp(entry->name, "..") == 0) {
+/* Substring search shared by in-buffer find and project grep. With SSE2,
+ * sixteen candidate positions are filtered at once by comparing both the
+ * first and the last byte of the needle, and only survivors are checked in
+ * full. */
+const char *editorMemSearch(const char *hay, size_t n, const char *needle,
+                            size_t m) {
+  if (m == 0)
+    return hay;
+  if (m > n)
+    return NULL;
+  if (m == 1)
+    return memchr(hay, needle[0], n);
+
+  size_t i = 0;
+#ifdef __SSE2__
+  const __m128i first = _mm_set1_epi8(needle[0]);
+  const __m128i last = _mm_set1_epi8(needle[m - 1]);
+  for (; i + m - 1 + 16 <= n; i += 16) {
+    __m128i a = _mm_loadu_si128((const __m128i *)(hay + i));
+    __m128i b = _mm_loadu_si128((const __m128i *)(hay + i + m - 1));
+    unsigned mask = _mm_movemask_epi8(
+        _mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+    while (mask) {
+      int bit = __builtin_ctz(mask);
+      if (memcmp(hay + i + bit + 1, needle + 1, m - 2) == 0)
+        return hay + i + bit;
+      mask &= mask - 1;
+    }
+  }
+#endif
+  for (; i + m <= n; i++)
+    if (hay[i] == needle[0] && memcmp(hay + i, needle, m) == 0)
+      return hay + i;
+  return NULL;
+}
+
+void editorFindCallback(char *query, int key) {
+  static int lastMatch = -1;
+  static int direction = 1;
+
+  if (key == '\r' || key == '\x1b') {
+    lastMatch = -1;
+    direction = 1;
+    return;
+  } else if (key == ARROW_RIGHT || key == ARROW_DOWN) {
+    direction = 1;
+  } else if (key == ARROW_LEFT || key == ARROW_UP) {
+    direction = -1;
+  } else {
+    lastMatch = -1;
+    direction = 1;
+  }
+
+  size_t len = strlen(query);
+  if (lastMatch == -1)
+    direction = 1;
+  if (len == 0)
+    return;
+
+  int current = lastMatch;
+  for (int i = 0; i < E.numrows; i++) {
+    current += direction;
+    if (current == -1)
+      current = E.numrows - 1;
+    else if (current == E.numrows)
+      current = 0;
+
+    erow *row = &E.row[current];
+    const char *match = editorMemSearch(row->chars, row->size, query, len);
+    if (match) {
+      lastMatch = current;
+      E.cy = current;
+      E.cx = match - row->chars;
+      E.rowoff = E.numrows;
+      break;
+    }
+  }
+}
+
+void editorFind(void) {
+  int savedCx = E.cx;
+  int savedCy = E.cy;
+  int savedColoff = E.coloff;
+  int savedRowoff = E.rowoff;
+
+  char *query =
+      editorPrompt("Search: %s (Use ESC/Arrows/Enter)", editorFindCallback);
+  if (query) {
+    free(query);
+  } else {
+    E.cx = savedCx;
+    E.cy = savedCy;
+    E.coloff = savedColoff;
+    E.rowoff = savedRowoff;
+  }
+}
+
+/* Moves to a byte offset, given with an optional k/M/G suffix or as a
+ * percentage of the file, so "file:offset" locations can be followed. */
+void editorGotoByte(void) {
+  char *query = editorPrompt("Go to byte or N%%: %s (ESC to cancel)", NULL);
+  if (!query || E.numrows == 0) {
+    free(query);
+    return;
+  }
+  long long offset = editorParseSize(query);
+  if (query[strlen(query) - 1] == '%')
+    offset = editorRowOffset(E.numrows) * atof(query) / 100;
+  free(query);
+
+  int col;
+  E.cy = editorOffsetToRow(offset, &col);
+  E.cx = col;
+  E.rowoff = E.cy > E.screenrows / 2 ? E.cy - E.screenrows / 2 : 0;
+}
+
+/* Writes as many of rows [*row, end) to fd as the pipe will take. *rowOff
+ * tracks how much of the current row (including its newline) is already
+ * out. Returns -1 once the reader has gone away. */
+int editorFilterWrite(int fd, int *row, size_t *rowOff, int end) {
+  static char newline[] = "\n";
+  struct iovec iov[FILTER_IOV];
+  int n = 0;
+
+  for (int r = *row; r < end && n + 2 <= FILTER_IOV; r++) {
+    size_t off = r == *row ? *rowOff : 0;
+    if (off < (size_t)E.row[r].size) {
+      iov[n].iov_base = E.row[r].chars + off;
+      iov[n++].iov_len = E.row[r].size - off;
+    }
+    iov[n].iov_base = newline;
+    iov[n++].iov_len = 1;
+  }
+
+  ssize_t written = writev(fd, iov, n);
+  if (written == -1)
+    return errno == EAGAIN || errno == EINTR ? 0 : -1;
+
+  while (written > 0) {
+    size_t left = E.row[*row].size + 1 - *rowOff;
+    if ((size_t)written < left) {
+      *rowOff += written;
+      break;
+    }
+    written -= left;
+    (*row)++;
+    *rowOff = 0;
+  }
+  return 0;
+}
+
+void editorFilterAddLine(filterOutput *fo, const char *s, size_t len) {
+  if (fo->numRows == fo->capRows) {
+    fo->capRows = fo->capRows ? fo->capRows * 2 : 1024;
+    fo->rows = realloc(fo->rows, sizeof(snapshotRow) * fo->capRows);
+  }
+  rowText *text = editorRowTextAlloc(len);
+  memcpy(text->chars, s, len);
+  text->chars[len] = '\0';
+  fo->rows[fo->numRows].text = text;
+  fo->rows[fo->numRows++].size = len;
+}
+
+/* Splits a chunk of command output into lines. A line cut off at the end of
+ * the chunk is carried over in fo->partial. */
+void editorFilterCollect(filterOutput *fo, const char *buf, size_t len) {
+  const char *p = buf, *end = buf + len, *nl;
+  while ((nl = memchr(p, '\n', end - p)) != NULL) {
+    if (fo->partialLen == 0) {
+      editorFilterAddLine(fo, p, nl - p);
+    } else {
+      editorFilterAppendPartial(fo, p, nl - p);
+      editorFilterAddLine(fo, fo->partial, fo->partialLen);
+      fo->partialLen = 0;
+    }
+    p = nl + 1;
+  }
+  if (p < end)
+    editorFilterAppendPartial(fo, p, end - p);
+}
+
+void editorFilterAppendPartial(filterOutput *fo, const char *s, size_t len) {
+  if (fo->partialLen + len > fo->partialCap) {
+    fo->partialCap = (fo->partialLen + len) * 2;
+    fo->partial = realloc(fo->partial, fo->partialCap);
+  }
+  memcpy(fo->partial + fo->partialLen, s, len);
+  fo->partialLen += len;
+}
+
+void editorFilterFree(filterOutput *fo) {
+  for (int i = 0; i < fo->numRows; i++)
+    editorRowTextRelease(fo->rows[i].text);
+  free(fo->rows);
+  free(fo->partial);
+}
+
+/* Runs rows [start, end) through `sh -c cmd` and replaces them with its
+ * output. Input is written straight from the rows and output lines become
+ * row text as they arrive, so the region is never copied into one string.
+ * The buffer is only touched if the command exits successfully. */
+void editorFilterRows(int start, int end, const char *cmd) {
+  int in[2], out[2], err[2];
+  if (pipe2(in, O_CLOEXEC) == -1) {
+    editorSetStatusMessage("Filter: pipe failed: %s", strerror(errno));
+    return;
+  }
+  if (pipe2(out, O_CLOEXEC) == -1) {
+    editorSetStatusMessage("Filter: pipe failed: %s", strerror(errno));
+    close(in[0]);
+    close(in[1]);
+    return;
+  }
+  if (pipe2(err, O_CLOEXEC) == -1) {
+    editorSetStatusMessage("Filter: pipe failed: %s", strerror(errno));
+    close(in[0]);
+    close(in[1]);
+    close(out[0]);
+    close(out[1]);
+    return;
+  }
+
+  void (*oldPipe)(int) = signal(SIGPIPE, SIG_IGN);
+  pid_t pid = fork();
+  if (pid == 0) {
+    setpgid(0, 0);
+    signal(SIGPIPE, SIG_DFL);
+    dup2(in[0], STDIN_FILENO);
+    dup2(out[1], STDOUT_FILENO);
+    dup2(err[1], STDERR_FILENO);
+    execl("/bin/sh", "sh", "-c", cmd, (char *)NULL);
+    _exit(127);
+  }
+  close(in[0]);
+  close(out[1]);
+  close(err[1]);
+  if (pid < 0) {
+    editorSetStatusMessage("Fork failed");
+    close(in[1]);
+    close(out[0]);
+    close(err[0]);
+    signal(SIGPIPE, oldPipe);
+    return;
+  }
+  setpgid(pid, pid);
+
+  int inFd = in[1], outFd = out[0], errFd = err[0];
+  fcntl(inFd, F_SETFL, fcntl(inFd, F_GETFL) | O_NONBLOCK);
+  fcntl(outFd, F_SETFL, fcntl(outFd, F_GETFL) | O_NONBLOCK);
+  fcntl(errFd, F_SETFL, fcntl(errFd, F_GETFL) | O_NONBLOCK);
+  if (start == end) {
+    close(inFd);
+    inFd = -1;
+  }
+
+  filterOutput fo = {NULL, 0, 0, NULL, 0, 0};
+  char buf[FILTER_BUF];
+  char errMsg[128];
+  size_t errLen = 0;
+  int row = start, cancelled = 0;
+  size_t rowOff = 0;
+  struct timespec last, now;
+  clock_gettime(CLOCK_MONOTONIC, &last);
+
+  while (outFd != -1 || errFd != -1) {
+    struct pollfd fds[4] = {{inFd, POLLOUT, 0},
+                            {outFd, POLLIN, 0},
+                            {errFd, POLLIN, 0},
+                            {STDIN_FILENO, POLLIN, 0}};
+    if (poll(fds, 4, 100) == -1 && errno != EINTR)
+      break;
+
+    if (fds[0].revents) {
+      if (editorFilterWrite(inFd, &row, &rowOff, end) == -1 || row == end) {
+        close(inFd);
+        inFd = -1;
+      }
+    }
+
+    if (fds[1].revents) {
+      ssize_t n = read(outFd, buf, sizeof(buf));
+      if (n > 0) {
+        editorFilterCollect(&fo, buf, n);
+      } else if (n == 0 || (errno != EAGAIN && errno != EINTR)) {
+        close(outFd);
+        outFd = -1;
+      }
+    }
+
+    if (fds[2].revents) {
+      ssize_t n = read(errFd, buf, sizeof(buf));
+      if (n > 0) {
+        size_t take = sizeof(errMsg) - 1 - errLen;
+        if (take > (size_t)n)
+          take = n;
+        memcpy(errMsg + errLen, buf, take);
+        errLen += take;
+      } else if (n == 0 || (errno != EAGAIN && errno != EINTR)) {
+        close(errFd);
+        errFd = -1;
+      }
+    }
+
+    if (fds[3].revents & POLLIN) {
+      int c = editorReadKey();
+      if (c == '\x1b' || c == CTRL_KEY('c')) {
+        cancelled = 1;
+        break;
+      }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if ((now.tv_sec - last.tv_sec) * 1000000000L +
+            (now.tv_nsec - last.tv_nsec) >=
+        100000000L) {
+      last = now;
+      editorSetStatusMessage("Filtering: %d/%d lines sent, %d received "
+                             "(ESC to cancel)",
+                             row - start, end - start, fo.numRows);
+      editorRefreshScreen();
+    }
+  }
+
+  if (inFd != -1)
+    close(inFd);
+  if (outFd != -1)
+    close(outFd);
+  if (errFd != -1)
+    close(errFd);
+  int status = 0;
+  if (cancelled)
+    editorFilterStop(pid);
+  else
+    waitpid(pid, &status, 0);
+  signal(SIGPIPE, oldPipe);
+
+  if (cancelled) {
+    editorSetStatusMessage("Filter cancelled");
+  } else if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    errMsg[errLen] = '\0';
+    char *nl = strchr(errMsg, '\n');
+    if (nl)
+      *nl = '\0';
+    editorSetStatusMessage("Filter failed (status %d): %s",
+                           WIFEXITED(status) ? WEXITSTATUS(status) : -1,
+                           errMsg);
+  } else {
+    if (fo.partialLen > 0)
+      editorFilterAddLine(&fo, fo.partial, fo.partialLen);
+    editorSpliceRows(start, end - start, fo.rows, fo.numRows);
+    E.dirty++;
+    E.undoStackSize = 0;
+    E.undoIndex = 0;
+    E.cy = start;
+    E.cx = 0;
+    editorSetStatusMessage("Filtered %d lines into %d", end - start,
+                           fo.numRows);
+    fo.numRows = 0;
+  }
+  editorFilterFree(&fo);
+}
+
+/* Stops a cancelled filter and everything it started, which share its
+ * process group. Whatever ignores SIGTERM for FILTER_GRACE_MS is killed.
+ * The shell is reaped last so its pid still names the group. */
+void editorFilterStop(pid_t pid) {
+  kill(-pid, SIGTERM);
+  siginfo_t info;
+  for (int waited = 0; waited < FILTER_GRACE_MS; waited += 10) {
+    info.si_pid = 0;
+    if (waitid(P_PID, pid, &info, WEXITED | WNOHANG | WNOWAIT) == -1 ||
+        info.si_pid != 0)
+      break;
+    struct timespec ts = {0, 10000000};
+    nanosleep(&ts, NULL);
+  }
+  kill(-pid, SIGKILL);
+  waitpid(pid, NULL, 0);
+}
+
+/* Prompts for "cmd" to filter the whole buffer or "N,M!cmd" to filter lines
+ * N through M. */
+void editorFilter(void) {
+  char *input = editorPrompt("Filter (cmd or N,M!cmd): %s", NULL);
+  if (!input)
+    return;
+
+  int start = 0, end = E.numrows, first, last, n = 0;
+  const char *cmd = input;
+  if (sscanf(input, "%d,%d!%n", &first, &last, &n) == 2 && n > 0) {
+    if (first < 1 || last < first || last > E.numrows) {
+      editorSetStatusMessage("Invalid line range %d,%d", first, last);
+      free(input);
+      return;
+    }
+    start = first - 1;
+    end = last;
+    cmd = input + n;
+  } else if (input[0] == '!') {
+    cmd = input + 1;
+  }
+
+  while (*cmd == ' ')
+    cmd++;
+  if (*cmd)
+    editorFilterRows(start, end, cmd);
+  free(input);
+}
+
+#ifdef __linux__
+struct linuxDirent64 {
+  unsigned long long d_ino;
+  long long d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+#endif
+
+char *C_EXTENSIONS[] = {".c", ".h", ".cpp", ".hpp", ".cc"};
+char *C_KEYWORDS[] = {"if",     "else",    "for",      "while",  "do",
+                      "switch", "case",    "default",  "break",  "continue",
+                      "return", "goto",    "sizeof",   "typedef", "struct",
+                      "union",  "enum",    "static",   "extern", "const",
+                      "volatile", "inline", "register", "restrict"};
+char *C_TYPES[] = {"int",     "char",    "short",   "long",     "float",
+                   "double",  "void",    "unsigned", "signed",  "size_t",
+                   "ssize_t", "off_t",   "bool",    "uint8_t",  "uint16_t",
+                   "uint32_t", "uint64_t", "int8_t", "int16_t", "int32_t",
+                   "int64_t", "FILE"};
+
+char *GO_EXTENSIONS[] = {".go"};
+char *GO_KEYWORDS[] = {"break",  "case",   "chan",    "const",  "continue",
+                       "default", "defer", "else",    "fallthrough", "for",
+                       "func",   "go",     "goto",    "if",     "import",
+                       "interface", "map", "package", "range",  "return",
+                       "select", "struct", "switch",  "type",   "var"};
+char *GO_TYPES[] = {"bool",   "byte",   "error",  "float32", "float64",
+                    "int",    "int8",   "int16",  "int32",   "int64",
+                    "rune",   "string", "uint",   "uint8",   "uint16",
+                    "uint32", "uint64", "uintptr"};
+
+char *RUST_EXTENSIONS[] = {".rs"};
+char *RUST_KEYWORDS[] = {"as",     "break",  "const", "continue", "crate",
+                         "else",   "enum",   "extern", "fn",      "for",
+                         "if",     "impl",   "in",    "let",      "loop",
+                         "match",  "mod",    "move",  "mut",      "pub",
+                         "ref",    "return", "self",  "static",   "struct",
+                         "trait",  "type",   "unsafe", "use",     "where",
+                         "while"};
+char *RUST_TYPES[] = {"i8",  "i16", "i32",  "i64",   "i128",   "isize",
+                      "u8",  "u16", "u32",  "u64",   "u128",   "usize",
+                      "f32", "f64", "bool", "char",  "str",    "String",
+                      "Vec", "Option", "Result", "Self"};
+
+char *ZIG_EXTENSIONS[] = {".zig"};
+char *ZIG_KEYWORDS[] = {"const",  "var",    "fn",    "pub",    "return",
+                        "if",     "else",   "while", "for",    "switch",
+                        "break",  "continue", "defer", "errdefer", "try",
+                        "catch",  "struct", "enum",  "union",  "error",
+                        "comptime", "inline", "test"};
+char *ZIG_TYPES[] = {"u8",  "u16", "u32",  "u64",  "usize", "i8",   "i16",
+                     "i32", "i64", "isize", "f32", "f64",   "bool", "void",
+                     "type", "anyerror"};
+
+char *JS_EXTENSIONS[] = {".js", ".mjs", ".cjs", ".jsx"};
+char *TS_EXTENSIONS[] = {".ts", ".tsx"};
+char *JS_KEYWORDS[] = {"async",  "await",  "break",    "case",   "catch",
+                       "class",  "const",  "continue", "default", "delete",
+                       "do",     "else",   "export",   "extends", "finally",
+                       "for",    "function", "if",     "import", "in",
+                       "instanceof", "let", "new",     "return", "switch",
+                       "this",   "throw",  "try",      "typeof", "var",
+                       "while",  "yield"};
+char *JS_TYPES[] = {"true", "false", "null", "undefined", "NaN", "Infinity"};
+char *TS_TYPES[] = {"true",   "false",  "null",    "undefined", "string",
+                    "number", "boolean", "any",    "unknown",   "never",
+                    "void",   "interface", "type", "enum"};
+
+char *LUA_EXTENSIONS[] = {".lua"};
+char *LUA_KEYWORDS[] = {"and",   "break", "do",     "else", "elseif",
+                        "end",   "for",   "function", "goto", "if",
+                        "in",    "local", "not",    "or",   "repeat",
+                        "return", "then", "until",  "while"};
+char *LUA_TYPES[] = {"nil", "true", "false"};
+
+char *PYTHON_EXTENSIONS[] = {".py", ".pyw"};
+char *PYTHON_KEYWORDS[] = {"and",    "as",     "assert", "async",  "await",
+                           "break",  "class",  "continue", "def",  "del",
+                           "elif",   "else",   "except", "finally", "for",
+                           "from",   "global", "if",     "import", "in",
+                           "is",     "lambda", "nonlocal", "not",  "or",
+                           "pass",   "raise",  "return", "try",    "while",
+                           "with",   "yield"};
+char *PYTHON_TYPES[] = {"None", "True",  "False", "int",  "float",
+                        "str",  "bytes", "list",  "dict", "set",
+                        "tuple", "bool", "self"};
+
+char *JSON_EXTENSIONS[] = {".json"};
+char *JSON_TYPES[] = {"true", "false", "null"};
+
+char *YAML_EXTENSIONS[] = {".yml", ".yaml"};
+
+char *CSHARP_EXTENSIONS[] = {".cs"};
+char *CSHARP_KEYWORDS[] = {"abstract", "as",     "base",    "break",  "case",
+                           "catch",   "class",   "const",   "continue",
+                           "default", "do",      "else",    "enum",   "event",
+                           "finally", "for",     "foreach", "if",     "in",
+                           "interface", "internal", "is",   "namespace",
+                           "new",     "override", "private", "protected",
+                           "public",  "readonly", "return", "sealed", "static",
+                           "struct",  "switch",  "this",    "throw",  "try",
+                           "using",   "var",     "virtual", "while"};
+char *CSHARP_TYPES[] = {"bool",   "byte",   "char",  "decimal", "double",
+                        "float",  "int",    "long",  "object",  "sbyte",
+                        "short",  "string", "uint",  "ulong",   "ushort",
+                        "void",   "true",   "false", "null"};
+
+char *JAVA_EXTENSIONS[] = {".java"};
+char *JAVA_KEYWORDS[] = {"abstract", "break",   "case",     "catch",  "class",
+                         "continue", "default", "do",       "else",   "enum",
+                         "extends",  "final",   "finally",  "for",    "if",
+                         "implements", "import", "instanceof", "interface",
+                         "new",      "package", "private",  "protected",
+                         "public",   "return",  "static",   "super",  "switch",
+                         "synchronized", "this", "throw",   "throws", "try",
+                         "while"};
+char *JAVA_TYPES[] = {"boolean", "byte",  "char", "double", "float", "int",
+                      "long",    "short", "void", "String", "true",  "false",
+                      "null"};
+
+char *BASH_EXTENSIONS[] = {".sh", ".bash", ".zsh"};
+char *BASH_KEYWORDS[] = {"if",    "then",   "else",  "elif",   "fi",
+                         "for",   "while",  "until", "do",     "done",
+                         "case",  "esac",   "in",    "function", "return",
+                         "local", "export", "readonly", "exit", "break",
+                         "continue"};
+
+char *CSS_EXTENSIONS[] = {".css", ".scss", ".sass"};
+
+#define LANG_ENTRY(list) list, sizeof(list) / sizeof(list[0])
+
+languageDef LANGUAGE_DEFS[] = {
+    {"C", LANG_ENTRY(C_EXTENSIONS), LANG_ENTRY(C_KEYWORDS),
+     LANG_ENTRY(C_TYPES), "//", "/*", "*/", "\"'", "#"},
+    {"Go", LANG_ENTRY(GO_EXTENSIONS), LANG_ENTRY(GO_KEYWORDS),
+     LANG_ENTRY(GO_TYPES), "//", "/*", "*/", "\"'`", NULL},
+    {"Rust", LANG_ENTRY(RUST_EXTENSIONS), LANG_ENTRY(RUST_KEYWORDS),
+     LANG_ENTRY(RUST_TYPES), "//", "/*", "*/", "\"", "#"},
+    {"Zig", LANG_ENTRY(ZIG_EXTENSIONS), LANG_ENTRY(ZIG_KEYWORDS),
+     LANG_ENTRY(ZIG_TYPES), "//", NULL, NULL, "\"'", "@"},
+    {"CSS", LANG_ENTRY(CSS_EXTENSIONS), NULL, 0, NULL, 0, "//", "/*", "*/",
+     "\"'", "@"},
+    {"JavaScript", LANG_ENTRY(JS_EXTENSIONS), LANG_ENTRY(JS_KEYWORDS),
+     LANG_ENTRY(JS_TYPES), "//", "/*", "*/", "\"'`", NULL},
+    {"TypeScript", LANG_ENTRY(TS_EXTENSIONS), LANG_ENTRY(JS_KEYWORDS),
+     LANG_ENTRY(TS_TYPES), "//", "/*", "*/", "\"'`", NULL},
+    {"Lua", LANG_ENTRY(LUA_EXTENSIONS), LANG_ENTRY(LUA_KEYWORDS),
+     LANG_ENTRY(LUA_TYPES), "--", "--[[", "]]", "\"'", NULL},
+    {"Python", LANG_ENTRY(PYTHON_EXTENSIONS), LANG_ENTRY(PYTHON_KEYWORDS),
+     LANG_ENTRY(PYTHON_TYPES), "#", NULL, NULL, "\"'", "@"},
+    {"JSON", LANG_ENTRY(JSON_EXTENSIONS), NULL, 0, LANG_ENTRY(JSON_TYPES),
+     NULL, NULL, NULL, "\"", NULL},
+    {"YAML", LANG_ENTRY(YAML_EXTENSIONS), NULL, 0, NULL, 0, "#", NULL, NULL,
+     "\"'", NULL},
+    {"C#", LANG_ENTRY(CSHARP_EXTENSIONS), LANG_ENTRY(CSHARP_KEYWORDS),
+     LANG_ENTRY(CSHARP_TYPES), "//", "/*", "*/", "\"'", "#"},
+    {"Java", LANG_ENTRY(JAVA_EXTENSIONS), LANG_ENTRY(JAVA_KEYWORDS),
+     LANG_ENTRY(JAVA_TYPES), "//", "/*", "*/", "\"'", "@"},
+    {"Bash", LANG_ENTRY(BASH_EXTENSIONS), LANG_ENTRY(BASH_KEYWORDS), NULL, 0,
+     "#", NULL, NULL, "\"'", NULL},
+};
+
+enum languageType LANGUAGE_TYPES[] = {
+    LANG_C,      LANG_GO,         LANG_RUST,   LANG_ZIG,  LANG_CSS,
+    LANG_JAVASCRIPT, LANG_TYPESCRIPT, LANG_LUA, LANG_PYTHON, LANG_JSON,
+    LANG_YAML,   LANG_CSHARP,     LANG_JAVA,   LANG_BASH};
+
+void editorInitSyntax(void) {
+  E.currentLanguage = LANG_PLAINTEXT;
+  for (int i = 0; i < MAX_FILETYPES; i++)
+    E.languages[i] = NULL;
+  for (size_t i = 0; i < sizeof(LANGUAGE_TYPES) / sizeof(LANGUAGE_TYPES[0]);
+       i++)
+    E.languages[LANGUAGE_TYPES[i]] = &LANGUAGE_DEFS[i];
+}
+
+void editorDetectLanguage(char *filename) {
+  enum languageType lang = LANG_PLAINTEXT;
+  const char *ext = filename ? strrchr(filename, '.') : NULL;
+
+  for (int i = 0; ext && i < MAX_FILETYPES && lang == LANG_PLAINTEXT; i++) {
+    languageDef *def = E.languages[i];
+    if (!def)
+      continue;
+    for (int j = 0; j < def->numExtensions; j++)
+      if (strcmp(ext, def->extensions[j]) == 0)
+        lang = i;
+  }
+
+  if (lang != E.currentLanguage) {
+    E.currentLanguage = lang;
+    editorApplySyntaxToRows();
+  }
+}
+
+void editorSyntaxAddToken(erow *row, enum tokenType type, int start,
+                          int length) {
+  if (row->numTokens > 0) {
+    token *last = &row->tokens[row->numTokens - 1];
+    if (last->type == type && last->start + last->length == start) {
+      last->length += length;
+      return;
+    }
+  }
+  /* Grow at powers of two so no separate capacity field is needed. */
+  if ((row->numTokens & (row->numTokens - 1)) == 0)
+    row->tokens = editorRealloc(MEM_TOKENS, row->tokens,
+                                sizeof(token) * (row->numTokens * 2 + 1));
+  row->tokens[row->numTokens].type = type;
+  row->tokens[row->numTokens].start = start;
+  row->tokens[row->numTokens].length = length;
+  row->numTokens++;
+}
+
+int editorSyntaxMatchWord(char **words, int numWords, const char *s, int len) {
+  for (int i = 0; i < numWords; i++)
+    if ((int)strlen(words[i]) == len && strncmp(words[i], s, len) == 0)
+      return 1;
+  return 0;
+}
+
+/* Tokenizes the render text of one row, starting inside a block comment when
+ * inComment is set, and records whether the row ends inside one. Render text
+ * dropped by the memory budget is rebuilt first. Brackets outside comments,
+ * strings and preprocessor lines are summed up on the way. */
+void editorSyntaxScan(erow *row, int inComment) {
+  languageDef *def = E.languages[E.currentLanguage];
+  if (!row->render)
+    editorRowRender(row);
+  editorRelease(row->tokens);
+  row->tokens = NULL;
+  row->numTokens = 0;
+  row->hasMultilineComment = 0;
+  row->bracketDepth = 0;
+  row->bracketMin = 0;
+  if (!def) {
+    for (int i = 0; i < row->rsize; i++)
+      editorBracketCount(row, row->render[i]);
+    return;
+  }
+
+  char *r = row->render;
+  int n = row->rsize;
+  const char *sl = def->singleLineComment;
+  const char *ms = def->multiLineCommentStart;
+  const char *me = def->multiLineCommentEnd;
+  int slLen = sl ? strlen(sl) : 0, msLen = ms ? strlen(ms) : 0;
+  int meLen = me ? strlen(me) : 0;
+  int i = 0;
+
+  if (def->preprocessorStart && !inComment) {
+    while (i < n && isspace((unsigned char)r[i]))
+      i++;
+    size_t ppLen = strlen(def->preprocessorStart);
+    if (i + ppLen <= (size_t)n &&
+        strncmp(&r[i], def->preprocessorStart, ppLen) == 0 &&
+        *def->preprocessorStart == '#') {
+      editorSyntaxAddToken(row, TOKEN_PREPROCESSOR, i, n - i);
+      return;
+    }
+    i = 0;
+  }
+
+  while (i < n) {
+    char c = r[i];
+
+    if (inComment) {
+      int start = i;
+      while (i < n && !(i + meLen <= n && strncmp(&r[i], me, meLen) == 0))
+        i++;
+      if (i < n) {
+        i += meLen;
+        inComment = 0;
+      }
+      editorSyntaxAddToken(row, TOKEN_COMMENT, start, i - start);
+      continue;
+    }
+
+    if (ms && i + msLen <= n && strncmp(&r[i], ms, msLen) == 0) {
+      inComment = 1;
+      editorSyntaxAddToken(row, TOKEN_COMMENT, i, msLen);
+      i += msLen;
+      continue;
+    }
+
+    if (sl && i + slLen <= n && strncmp(&r[i], sl, slLen) == 0) {
+      editorSyntaxAddToken(row, TOKEN_COMMENT, i, n - i);
+      break;
+    }
+
+    if (c && def->stringDelimiters && strchr(def->stringDelimiters, c)) {
+      int start = i++;
+      while (i < n && r[i] != c) {
+        if (r[i] == '\\' && i + 1 < n)
+          i++;
+        i++;
+      }
+      if (i < n)
+        i++;
+      editorSyntaxAddToken(row, TOKEN_STRING, start, i - start);
+      continue;
+    }
+
+    if (isdigit((unsigned char)c) &&
+        (i == 0 || !(isalnum((unsigned char)r[i - 1]) || r[i - 1] == '_'))) {
+      int start = i;
+      while (i < n && (isalnum((unsigned char)r[i]) || r[i] == '.'))
+        i++;
+      editorSyntaxAddToken(row, TOKEN_NUMBER, start, i - start);
+      continue;
+    }
+
+    if (c == '$' && i + 1 < n &&
+        (isalpha((unsigned char)r[i + 1]) || r[i + 1] == '_' ||
+         r[i + 1] == '{')) {
+      int start = i++;
+      while (i < n && (isalnum((unsigned char)r[i]) || r[i] == '_' ||
+                       r[i] == '{' || r[i] == '}'))
+        editorBracketCount(row, r[i++]);
+      editorSyntaxAddToken(row, TOKEN_VARIABLE, start, i - start);
+      continue;
+    }
+
+    if (c == '@' && def->preprocessorStart &&
+        *def->preprocessorStart == '@') {
+      int start = i++;
+      while (i < n && (isalnum((unsigned char)r[i]) || r[i] == '_' ||
+                       r[i] == '.'))
+        i++;
+      editorSyntaxAddToken(row, TOKEN_PREPROCESSOR, start, i - start);
+      continue;
+    }
+
+    if (isalpha((unsigned char)c) || c == '_') {
+      int start = i++;
+      while (i < n && (isalnum((unsigned char)r[i]) || r[i] == '_'))
+        i++;
+      int len = i - start;
+      if (editorSyntaxMatchWord(def->keywords, def->numKeywords,
+                                     &r[start], len))
+        editorSyntaxAddToken(row, TOKEN_KEYWORD, start, len);
+      else if (editorSyntaxMatchWord(def->types, def->numTypes, &r[start],
+                                     len))
+        editorSyntaxAddToken(row, TOKEN_TYPE, start, len);
+      else {
+        int j = i;
+        while (j < n && r[j] == ' ')
+          j++;
+        if (j < n && r[j] == '(')
+          editorSyntaxAddToken(row, TOKEN_FUNCTION, start, len);
+      }
+      continue;
+    }
+
+    if (c && strchr("+-*/%=<>!&|^~?:", c)) {
+      editorSyntaxAddToken(row, TOKEN_OPERATOR, i, 1);
+      i++;
+      continue;
+    }
+
+    editorBracketCount(row, c);
+    i++;
+  }
+
+  row->hasMultilineComment = inComment;
+}
+
+void editorSyntaxTokenize(erow *row, int inComment) {
+  editorSyntaxScan(row, inComment);
+  editorBracketUpdate(row);
+  editorWordsIndexRow(row);
+}
+
+/* Rebuilds the render text and tokens of a row evicted by the memory
+ * budget, for code that is about to read them. */
+erow *editorRowPrepare(int at) {
+  erow *row = &E.row[at];
+  if (!row->render)
+    editorSyntaxTokenize(row, at > 0 ? row[-1].hasMultilineComment : 0);
+  return row;
+}
+
+/* Re-tokenizes a row in place. When its block comment state changes, the
+ * following rows are redone until the state settles again. Rows a deferred
+ * pass has not reached yet are left to it. */
+void editorUpdateSyntax(erow *row) {
+  erow *end = E.row + (E.syntaxPending ? E.syntaxNext : E.numrows);
+  if (row >= end)
+    return;
+  editorProfEnter(PROF_HIGHLIGHT);
+  for (;;) {
+    int wasOpen = row->hasMultilineComment;
+    editorSyntaxTokenize(row, row > E.row ? row[-1].hasMultilineComment : 0);
+    if (row->hasMultilineComment == wasOpen || ++row >= end)
+      break;
+  }
+  editorProfLeave();
+}
+
+void editorApplySyntaxToRows(void) { editorSyntaxDefer(0); }
+
+/* Highlights rows from `from` on in idle time instead of now. Until the
+ * pass gets there, visible rows are tokenized as they are drawn. */
+void editorSyntaxDefer(int from) {
+  if (!E.syntaxPending || from < E.syntaxNext)
+    E.syntaxNext = from;
+  E.syntaxPending = 1;
+  editorIdleSchedule(IDLE_HIGHLIGHT, E.syntaxNext < editorScreenEndRow()
+                                         ? IDLE_VISIBLE
+                                         : IDLE_BACKGROUND);
+}
+
+/* Keeps a pending pass on the same row when rows above it are inserted or
+ * removed. A change that straddles it sends the pass back to `at`. */
+void editorSyntaxShift(int at, int removed, int added) {
+  if (!E.syntaxPending || at >= E.syntaxNext)
+    return;
+  if (at + removed <= E.syntaxNext)
+    E.syntaxNext += added - removed;
+  else
+    E.syntaxNext = at;
+}
+
+/* One slice of the deferred pass. It runs top to bottom so every row starts
+ * from the right block comment state, and is urgent while rows on screen
+ * are still ahead of it. Rows evicted by the memory budget stay evicted,
+ * and rows in closed folds only keep their comment and bracket state. */
+int editorSyntaxStep(void) {
+  int screenEnd = editorScreenEndRow();
+  while (E.syntaxNext < E.numrows) {
+    int at = E.syntaxNext++;
+    erow *row = &E.row[at];
+    int evicted = !row->render;
+    editorSyntaxTokenize(row, at > 0 ? row[-1].hasMultilineComment : 0);
+    if (evicted || row->hidden)
+      editorRowEvict(row);
+    if (at >= E.rowoff && at < screenEnd)
+      E.idle.redraw = 1;
+    if ((at & 255) == 255 && editorIdleYield())
+      break;
+  }
+  if (E.syntaxNext >= E.numrows) {
+    E.syntaxPending = 0;
+    return 0;
+  }
+  editorIdleSchedule(IDLE_HIGHLIGHT,
+                     E.syntaxNext < screenEnd ? IDLE_VISIBLE : IDLE_BACKGROUND);
+  return 1;
+}
+
+int editorSyntaxToColor(int token) {
+  switch (token) {
+  case TOKEN_COMMENT:
+    return COLOR_COMMENT;
+  case TOKEN_KEYWORD:
+    return COLOR_KEYWORD;
+  case TOKEN_TYPE:
+    return COLOR_TYPE;
+  case TOKEN_STRING:
+    return COLOR_STRING;
+  case TOKEN_NUMBER:
+    return COLOR_NUMBER;
+  case TOKEN_FUNCTION:
+    return COLOR_FUNCTION;
+  case TOKEN_OPERATOR:
+    return COLOR_OPERATOR;
+  case TOKEN_VARIABLE:
+    return COLOR_VARIABLE;
+  case TOKEN_PREPROCESSOR:
+    return COLOR_PREPROCESSOR;
+  default:
+    return COLOR_FOREGROUND;
+  }
+}
+
+/* Direction of the bracket at render byte `at`: 1 opens, -1 closes and 0
+ * is anything else, including brackets in comments, strings and
+ * preprocessor lines. *t walks the row's tokens, so calls on one row go
+ * left to right with *t starting at 0. */
+int editorBracketDir(erow *row, int at, int *t) {
+  char c = row->render[at];
+  int dir = c == '(' || c == '[' || c == '{'   ? 1
+            : c == ')' || c == ']' || c == '}' ? -1
+                                               : 0;
+  if (!dir)
+    return 0;
+  while (*t < row->numTokens &&
+         row->tokens[*t].start + row->tokens[*t].length <= at)
+    (*t)++;
+  if (*t < row->numTokens && row->tokens[*t].start <= at) {
+    enum tokenType type = row->tokens[*t].type;
+    if (type == TOKEN_COMMENT || type == TOKEN_STRING ||
+        type == TOKEN_PREPROCESSOR)
+      return 0;
+  }
+  return dir;
+}
+
+void editorBracketPull(int node) {
+  bracketIndex *bi = &E.brackets;
+  int left = 2 * node, low = bi->sum[left] + bi->min[left + 1];
+  bi->sum[node] = bi->sum[left] + bi->sum[left + 1];
+  bi->min[node] = bi->min[left] < low ? bi->min[left] : low;
+}
+
+/* Adds one plain-code byte to the row's bracket summary. */
+void editorBracketCount(erow *row, char c) {
+  if (c == '(' || c == '[' || c == '{') {
+    row->bracketDepth++;
+  } else if (c == ')' || c == ']' || c == '}') {
+    if (--row->bracketDepth < row->bracketMin)
+      row->bracketMin = row->bracketDepth;
+  }
+}
+
+/* Takes the summary of a freshly tokenized row into the index right away,
+ * unless it is rebuilding from above the row anyway. */
+void editorBracketUpdate(erow *row) {
+  bracketIndex *bi = &E.brackets;
+  if (row < E.row || row >= E.row + E.numrows)
+    return;
+  int at = row - E.row;
+  if (at >= bi->stale || at >= bi->size)
+    return;
+  bi->sum[bi->leaves + at] = row->bracketDepth;
+  bi->min[bi->leaves + at] = row->bracketMin;
+  for (int node = (bi->leaves + at) / 2; node > 0; node /= 2)
+    editorBracketPull(node);
+}
+
+/* Rows changed in place are re-measured as they are tokenized. Rows moving
+ * invalidate the tree from the first moved one. */
+void editorBracketChanged(int at, int removed, int added) {
+  if ((removed != 1 || added != 1) && at < E.brackets.stale)
+    E.brackets.stale = at;
+}
+
+/* Refills the leaves from the first stale row and rebuilds only the nodes
+ * above them. */
+void editorBracketSync(void) {
+  bracketIndex *bi = &E.brackets;
+  int n = E.numrows;
+  if (bi->stale >= n && bi->size == n)
+    return;
+  int from = bi->stale < n ? bi->stale : n;
+  if (n > bi->leaves) {
+    int leaves = bi->leaves ? bi->leaves : 64;
+    while (leaves < n)
+      leaves *= 2;
+    bi->sum = editorRealloc(MEM_ROWS, bi->sum, sizeof(int) * 2 * leaves);
+    bi->min = editorRealloc(MEM_ROWS, bi->min, sizeof(int) * 2 * leaves);
+    bi->leaves = leaves;
+    from = 0;
+  }
+  for (int i = from; i < bi->leaves; i++) {
+    bi->sum[bi->leaves + i] = i < n ? E.row[i].bracketDepth : 0;
+    bi->min[bi->leaves + i] = i < n ? E.row[i].bracketMin : 0;
+  }
+  for (int lo = (bi->leaves + from) / 2, hi = bi->leaves - 1; hi > 0;
+       lo /= 2, hi /= 2)
+    for (int node = lo; node <= hi; node++)
+      editorBracketPull(node);
+  bi->size = n;
+  bi->stale = n;
+}
+
+/* Bracket depth at the start of row `rows`. The index must be synced. */
+int editorBracketPrefix(int rows) {
+  bracketIndex *bi = &E.brackets;
+  int sum = 0;
+  for (int l = bi->leaves, r = bi->leaves + rows; l < r; l /= 2, r /= 2) {
+    if (l & 1)
+      sum += bi->sum[l++];
+    if (r & 1)
+      sum += bi->sum[--r];
+  }
+  return sum;
+}
+
+/* Searches the subtree at node, which covers rows [lo, hi) and starts at
+ * depth, for the first row in [from, to) whose depth falls to target or
+ * below, or the last such row when `last` is set. Subtrees that never get
+ * that low are skipped whole. Returns -1 if there is none. */
+int editorBracketSearch(int node, int lo, int hi, int depth, int from, int to,
+                        int target, int last) {
+  bracketIndex *bi = &E.brackets;
+  if (hi <= from || lo >= to || depth + bi->min[node] > target)
+    return -1;
+  if (hi - lo == 1)
+    return lo;
+  int mid = (lo + hi) / 2, left = 2 * node;
+  int rightDepth = depth + bi->sum[left], found;
+  if (last) {
+    found = editorBracketSearch(left + 1, mid, hi, rightDepth, from, to,
+                                target, last);
+    if (found == -1)
+      found = editorBracketSearch(left, lo, mid, depth, from, to, target,
+                                  last);
+  } else {
+    found = editorBracketSearch(left, lo, mid, depth, from, to, target, last);
+    if (found == -1)
+      found = editorBracketSearch(left + 1, mid, hi, rightDepth, from, to,
+                                  target, last);
+  }
+  return found;
+}
+
+/* Last bracket before `end` of a row starting at `depth` that is reached
+ * at target depth or lower. In the row holding a block's opener, that is
+ * the opener. Returns -1 if there is none. */
+int editorBracketLastBelow(erow *row, int end, int depth, int target) {
+  int found = -1, t = 0;
+  for (int i = 0; i < end; i++) {
+    int dir = editorBracketDir(row, i, &t);
+    if (dir && depth <= target)
+      found = i;
+    depth += dir;
+  }
+  return found;
+}
+
+/* First bracket from `from` on that leaves the depth at target or lower. */
+int editorBracketFirstBelow(erow *row, int from, int depth, int target) {
+  int t = 0;
+  for (int i = 0; i < row->rsize; i++) {
+    int dir = editorBracketDir(row, i, &t);
+    depth += dir;
+    if (dir && i >= from && depth <= target)
+      return i;
+  }
+  return -1;
+}
+
+int editorBracketDepthAt(int row, int pos) {
+  erow *r = editorRowPrepare(row);
+  int depth = editorBracketPrefix(row), t = 0;
+  for (int i = 0; i < pos; i++)
+    depth += editorBracketDir(r, i, &t);
+  return depth;
+}
+
+/* Finds the innermost bracket still open at render byte pos of a row. The
+ * row search skips every row that stays above its depth. Returns 0 if
+ * there is none. */
+int editorBracketOpenBefore(int row, int pos, int *openRow, int *openPos) {
+  editorBracketSync();
+  int target = editorBracketDepthAt(row, pos) - 1;
+  int found = editorBracketLastBelow(&E.row[row], pos,
+                                     editorBracketPrefix(row), target);
+  if (found == -1) {
+    row = editorBracketSearch(1, 0, E.brackets.leaves, 0, 0, row, target, 1);
+    if (row == -1)
+      return 0;
+    erow *r = editorRowPrepare(row);
+    found = editorBracketLastBelow(r, r->rsize, editorBracketPrefix(row),
+                                   target);
+  }
+  *openRow = row;
+  *openPos = found;
+  return found != -1;
+}
+
+/* Finds the bracket that closes the block open at render byte pos. */
+int editorBracketCloseAfter(int row, int pos, int *closeRow, int *closePos) {
+  editorBracketSync();
+  int target = editorBracketDepthAt(row, pos) - 1;
+  int found = editorBracketFirstBelow(&E.row[row], pos,
+                                      editorBracketPrefix(row), target);
+  if (found == -1) {
+    row = editorBracketSearch(1, 0, E.brackets.leaves, 0, row + 1,
+                              E.numrows, target, 0);
+    if (row == -1)
+      return 0;
+    found = editorBracketFirstBelow(editorRowPrepare(row), 0,
+                                    editorBracketPrefix(row), target);
+  }
+  *closeRow = row;
+  *closePos = found;
+  return found != -1;
+}
+
+/* Matching needs every row's summary, so a pending highlight pass is run
+ * to the end first. */
+void editorBracketFinish(void) {
+  while (E.syntaxPending)
+    editorSyntaxStep();
+}
+
+/* Moves the cursor to the bracket matching the one under it. */
+void editorBracketJump(void) {
+  if (E.cy >= E.numrows)
+    return;
+  editorBracketFinish();
+  erow *row = editorRowPrepare(E.cy);
+  int pos = editorRowColStart(row, editorRowCxToRx(row, E.cx)), t = 0;
+  int dir = pos < row->rsize ? editorBracketDir(row, pos, &t) : 0;
+  if (!dir) {
+    editorSetStatusMessage("No bracket under the cursor");
+    return;
+  }
+
+  int at, match;
+  if (!(dir > 0 ? editorBracketCloseAfter(E.cy, pos + 1, &at, &match)
+                : editorBracketOpenBefore(E.cy, pos, &at, &match))) {
+    editorSetStatusMessage("No matching bracket");
+    return;
+  }
+  char open = dir > 0 ? row->render[pos] : E.row[at].render[match];
+  char close = dir > 0 ? E.row[at].render[match] : row->render[pos];
+  if (strchr("()[]{}", open)[1] != close)
+    editorSetStatusMessage("Mismatched %c and %c", open, close);
+  E.cy = at;
+  E.cx = editorRowRxToCx(&E.row[at], editorRowCol(&E.row[at], match));
+}
+
+/* Finds the child of a trie node for one more byte, adding it if asked. */
+int editorWordsChild(int node, char c, int create) {
+  wordIndex *wi = &E.words;
+  for (int n = wi->nodes[node].child; n != -1; n = wi->nodes[n].sibling)
+    if (wi->nodes[n].c == c)
+      return n;
+  if (!create)
+    return -1;
+  if (wi->numNodes == wi->capNodes) {
+    wi->capNodes = wi->capNodes ? wi->capNodes * 2 : 1024;
+    wi->nodes = editorRealloc(MEM_TOKENS, wi->nodes,
+                              sizeof(wordNode) * wi->capNodes);
+  }
+  int n = wi->numNodes++;
+  wi->nodes[n] = (wordNode){-1, wi->nodes[node].child, node, 0, 0, c};
+  wi->nodes[node].child = n;
+  return n;
+}
+
+/* Changes a word's count and carries the new subtree maximum up until an
+ * ancestor's does not change. A count going up only raises maxima, and one
+ * going down only matters where it was the maximum. */
+void editorWordsAdjust(int node, int delta) {
+  wordNode *nodes = E.words.nodes;
+  int old = nodes[node].count, count = old + delta;
+  nodes[node].count = count;
+  for (int n = node; n != -1; n = nodes[n].parent) {
+    if (delta > 0) {
+      if (nodes[n].best >= count)
+        break;
+      nodes[n].best = count;
+      continue;
+    }
+    if (nodes[n].best > old)
+      break;
+    int best = nodes[n].count;
+    for (int c = nodes[n].child; c != -1; c = nodes[c].sibling)
+      if (nodes[c].best > best)
+        best = nodes[c].best;
+    if (best == nodes[n].best)
+      break;
+    nodes[n].best = best;
+  }
+}
+
+/* Finds the node of a word, adding it with a count of zero if needed. */
+int editorWordsNode(const char *s, int len) {
+  wordIndex *wi = &E.words;
+  if (wi->numNodes == 0) {
+    if (!wi->nodes) {
+      wi->capNodes = 1024;
+      wi->nodes = editorAlloc(MEM_TOKENS, sizeof(wordNode) * wi->capNodes);
+    }
+    wi->nodes[0] = (wordNode){-1, -1, -1, 0, 0, '\0'};
+    wi->numNodes = 1;
+  }
+  int node = 0;
+  for (int i = 0; i < len; i++)
+    node = editorWordsChild(node, s[i], 1);
+  return node;
+}
+
+void editorWordsRelease(int *words) {
+  for (int *w = words; w && *w != -1; w++)
+    editorWordsAdjust(*w, -1);
+  editorRelease(words);
+}
+
+/* Replaces the words a row adds to the index with those in its new
+ * tokens: identifiers the tokenizer left untyped, and function names.
+ * Keywords, types, comments and strings are skipped. */
+void editorWordsIndexRow(erow *row) {
+  wordIndex *wi = &E.words;
+  if (!wi->active || row < E.row || row >= E.row + wi->numRows)
+    return;
+  char *r = row->render;
+  int *words = NULL, num = 0, t = 0;
+  for (int i = 0; i < row->rsize;) {
+    if (!isalnum((unsigned char)r[i]) && r[i] != '_') {
+      i++;
+      continue;
+    }
+    int start = i;
+    while (i < row->rsize && (isalnum((unsigned char)r[i]) || r[i] == '_'))
+      i++;
+    while (t < row->numTokens &&
+           row->tokens[t].start + row->tokens[t].length <= start)
+      t++;
+    if (isdigit((unsigned char)r[start]) || i - start < 2 ||
+        i - start > WORD_MAX ||
+        (t < row->numTokens && row->tokens[t].start <= start &&
+         row->tokens[t].type != TOKEN_FUNCTION))
+      continue;
+    /* Grows at powers of two, like the token array, with room for the
+     * terminator. */
+    if ((num & (num - 1)) == 0)
+      words = editorRealloc(MEM_TOKENS, words, sizeof(int) * (num * 2 + 2));
+    words[num++] = editorWordsNode(&r[start], i - start);
+  }
+  if (words)
+    words[num] = -1;
+
+  /* Most rows are tokenized again with the same words. */
+  int at = row - E.row;
+  int *old = wi->rows[at], same = 0;
+  while (old && words && same < num && old[same] == words[same])
+    same++;
+  if (same == num && (old ? old[same] == -1 : !words)) {
+    editorRelease(words);
+    return;
+  }
+  for (int j = 0; j < num; j++)
+    editorWordsAdjust(words[j], 1);
+  wi->rows[at] = words;
+  editorWordsRelease(old);
+}
+
+/* Rows that go away take back their words. New rows add theirs when they
+ * are tokenized. */
+void editorWordsChanged(int at, int removed, int added) {
+  wordIndex *wi = &E.words;
+  if (!wi->active)
+    return;
+  for (int i = at; i < at + removed; i++)
+    editorWordsRelease(wi->rows[i]);
+  int n = wi->numRows + added - removed;
+  if (n > wi->capRows) {
+    while (wi->capRows < n)
+      wi->capRows = wi->capRows ? wi->capRows * 2 : 1024;
+    wi->rows =
+        editorRealloc(MEM_TOKENS, wi->rows, sizeof(int *) * wi->capRows);
+  }
+  memmove(&wi->rows[at + added], &wi->rows[at + removed],
+          sizeof(int *) * (wi->numRows - at - removed));
+  memset(&wi->rows[at], 0, sizeof(int *) * added);
+  wi->numRows = n;
+  if (n == 0)
+    wi->numNodes = 0;
+}
+
+/* Indexes every row the highlighter has reached. Rows it has not reached
+ * yet are indexed when it does, and evicted rows are tokenized once and
+ * evicted again. */
+void editorWordsBuild(void) {
+  wordIndex *wi = &E.words;
+  if (wi->active)
+    return;
+  wi->active = 1;
+  editorWordsChanged(0, 0, E.numrows);
+  int end = E.syntaxPending ? E.syntaxNext : E.numrows;
+  for (int i = 0; i < end; i++) {
+    erow *row = &E.row[i];
+    if (row->render) {
+      editorWordsIndexRow(row);
+    } else {
+      editorRowPrepare(i);
+      editorRowEvict(row);
+    }
+  }
+}
+
+/* Gathers the most used words in a subtree into found[], most used first.
+ * Subtrees whose best word would not make the list are skipped. */
+void editorWordsCollect(int node, int skip, int *found, int *num) {
+  wordNode *nodes = E.words.nodes;
+  if (nodes[node].best == 0 ||
+      (*num == COMPLETE_MAX &&
+       nodes[node].best <= nodes[found[COMPLETE_MAX - 1]].count))
+    return;
+  int count = nodes[node].count;
+  if (node != skip && count > 0 &&
+      (*num < COMPLETE_MAX || count > nodes[found[COMPLETE_MAX - 1]].count)) {
+    int i = *num < COMPLETE_MAX ? (*num)++ : COMPLETE_MAX - 1;
+    for (; i > 0 && nodes[found[i - 1]].count < count; i--)
+      found[i] = found[i - 1];
+    found[i] = node;
+  }
+  for (int c = nodes[node].child; c != -1; c = nodes[c].sibling)
+    editorWordsCollect(c, skip, found, num);
+}
+
+int editorWordsSpell(int node, char *buf) {
+  wordNode *nodes = E.words.nodes;
+  int len = 0;
+  for (int n = node; n > 0; n = nodes[n].parent)
+    len++;
+  buf[len] = '\0';
+  for (int n = node, i = len; n > 0; n = nodes[n].parent)
+    buf[--i] = nodes[n].c;
+  return len;
+}
+
+/* Fills words[] with completions of a prefix, most used identifiers first
+ * and then the language's keywords and types. Keywords are never in the
+ * index, but a word in both keyword lists is only offered once. */
+int editorWordsLookup(const char *prefix, int len,
+                      char words[][WORD_MAX + 1]) {
+  int found[COMPLETE_MAX], num = 0;
+  int node = E.words.numNodes ? 0 : -1;
+  for (int i = 0; i < len && node != -1; i++)
+    node = editorWordsChild(node, prefix[i], 0);
+  if (node != -1)
+    editorWordsCollect(node, node, found, &num);
+  for (int i = 0; i < num; i++)
+    editorWordsSpell(found[i], words[i]);
+
+  languageDef *def = E.languages[E.currentLanguage];
+  for (int list = 0; def && list < 2; list++) {
+    char **kw = list ? def->types : def->keywords;
+    int numKw = list ? def->numTypes : def->numKeywords;
+    for (int k = 0; k < numKw && num < COMPLETE_MAX; k++) {
+      int kwLen = strlen(kw[k]);
+      if (kwLen <= len || kwLen > WORD_MAX || strncmp(kw[k], prefix, len))
+        continue;
+      int seen = 0;
+      for (int i = 0; i < num && !seen; i++)
+        seen = strcmp(words[i], kw[k]) == 0;
+      if (!seen)
+        memcpy(words[num++], kw[k], kwLen + 1);
+    }
+  }
+  return num;
+}
+
+/* Completes the word before the cursor with the most used word starting
+ * with it. Completing again right away swaps in the next candidate. */
+void editorComplete(void) {
+  completion *cp = &E.complete;
+  if (E.cy >= E.numrows)
+    return;
+  editorWordsBuild();
+  erow *row = &E.row[E.cy];
+
+  if (cp->numWords > 0 && cp->version == E.version && cp->cy == E.cy &&
+      cp->end == E.cx) {
+    int from = cp->start + cp->prefixLen;
+    if (E.cx > from)
+      editorAddToUndo(OP_DELETE_CHAR, from, E.cy, &row->chars[from],
+                      E.cx - from);
+    while (E.cx > from)
+      editorDelChar();
+    cp->next = (cp->next + 1) % cp->numWords;
+  } else {
+    int start = E.cx;
+    while (start > 0 && (isalnum((unsigned char)row->chars[start - 1]) ||
+                         row->chars[start - 1] == '_'))
+      start--;
+    int len = E.cx - start;
+    if (len == 0 || len > WORD_MAX ||
+        isdigit((unsigned char)row->chars[start])) {
+      cp->numWords = 0;
+      editorSetStatusMessage("No word to complete");
+      return;
+    }
+    cp->numWords = editorWordsLookup(&row->chars[start], len, cp->words);
+    if (cp->numWords == 0) {
+      editorSetStatusMessage("No completions for %.*s", len,
+                             &row->chars[start]);
+      return;
+    }
+    cp->cy = E.cy;
+    cp->start = start;
+    cp->prefixLen = len;
+    cp->next = 0;
+  }
+
+  const char *word = cp->words[cp->next];
+  for (int i = cp->prefixLen; word[i]; i++) {
+    editorAddToUndo(OP_INSERT_CHAR, E.cx, E.cy, &word[i], 1);
+    editorInsertChar(word[i]);
+  }
+  cp->end = E.cx;
+  cp->version = E.version;
+  editorSetStatusMessage("Completion %d of %d: %s", cp->next + 1,
+                         cp->numWords, word);
+}
+
+int editorDirEntryCompare(const void *a, const void *b) {
+  const dirEntry *x = a;
+  const dirEntry *y = b;
+  if (x->isDir != y->isDir)
+    return y->isDir - x->isDir;
+  return strcmp(x->name, y->name);
+}
+
+/* Reads a directory in large batches on its own thread. Each batch is
+ * sorted and merged into the running result, and a copy is published for
+ * the UI thread to adopt, so big directories show up progressively. */
+void *editorDirScanThread(void *arg) {
+  dirListing *dl = arg;
+  dirEntry *sorted = NULL;
+  int numSorted = 0;
+  dirEntry *batch = NULL;
+  int batchCap = 0;
+  char *arena = NULL;
+  size_t arenaUsed = DIR_NAME_ARENA;
+
+  int fd = open(dl->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd == -1)
+    dl->error = errno;
+
+#ifdef __linux__
+  char *buf = editorAlloc(MEM_BROWSER, DIR_SCAN_BATCH);
+#else
+  DIR *dir = fd != -1 ? fdopendir(dup(fd)) : NULL;
+#endif
+
+  while (fd != -1 && !__atomic_load_n(&dl->cancel, __ATOMIC_RELAXED)) {
+    int numBatch = 0;
+#ifdef __linux__
+    long n = syscall(SYS_getdents64, fd, buf, DIR_SCAN_BATCH);
+    if (n <= 0)
+      break;
+    for (long pos = 0; pos < n;) {
+      struct linuxDirent64 *d = (struct linuxDirent64 *)(buf + pos);
+      const char *name = d->d_name;
+      unsigned char type = d->d_type;
+      pos += d->d_reclen;
+#else
+    struct dirent *d;
+    while (numBatch < 4096 && dir && (d = readdir(dir)) != NULL) {
+      const char *name = d->d_name;
+      unsigned char type = d->d_type;
+#endif
+      size_t len = strlen(name) + 1;
+      if (arenaUsed + len > DIR_NAME_ARENA) {
+        arena = editorAlloc(MEM_BROWSER,
+                            len > DIR_NAME_ARENA ? len : DIR_NAME_ARENA);
+        dl->arenas = editorRealloc(MEM_BROWSER, dl->arenas,
+                                   sizeof(char *) * (dl->numArenas + 1));
+        dl->arenas[dl->numArenas++] = arena;
+        arenaUsed = 0;
+      }
+      char *copy = arena + arenaUsed;
+      memcpy(copy, name, len);
+      arenaUsed += len;
+
+      int isDir = type == DT_DIR;
+      if (type == DT_UNKNOWN || type == DT_LNK) {
+        struct stat st;
+        isDir = fstatat(fd, name, &st, 0) == 0 && S_ISDIR(st.st_mode);
+      }
+
+      if (numBatch == batchCap) {
+        batchCap = batchCap ? batchCap * 2 : 1024;
+        batch = editorRealloc(MEM_BROWSER, batch, sizeof(dirEntry) * batchCap);
+      }
+      batch[numBatch].name = copy;
+      batch[numBatch].isDir = isDir;
+      numBatch++;
+    }
+#ifndef __linux__
+    if (numBatch == 0)
+      break;
+#endif
+
+    qsort(batch, numBatch, sizeof(dirEntry), editorDirEntryCompare);
+    dirEntry *merged =
+        editorAlloc(MEM_BROWSER, sizeof(dirEntry) * (numSorted + numBatch));
+    int i = 0, j = 0, k = 0;
+    while (i < numSorted && j < numBatch)
+      merged[k++] = editorDirEntryCompare(&sorted[i], &batch[j]) <= 0
+                        ? sorted[i++]
+                        : batch[j++];
+    while (i < numSorted)
+      merged[k++] = sorted[i++];
+    while (j < numBatch)
+      merged[k++] = batch[j++];
+    editorRelease(sorted);
+    sorted = merged;
+    numSorted = k;
+
+    size_t publish = sizeof(dirEntry) * (numSorted ? numSorted : 1);
+    dirEntry *copy = editorAlloc(MEM_BROWSER, publish);
+    memcpy(copy, sorted, sizeof(dirEntry) * numSorted);
+    pthread_mutex_lock(&dl->lock);
+    editorRelease(dl->published);
+    dl->published = copy;
+    dl->numPublished = numSorted;
+    pthread_mutex_unlock(&dl->lock);
+    editorWake();
+  }
+
+#ifdef __linux__
+  editorRelease(buf);
+#else
+  if (dir)
+    closedir(dir);
+#endif
+  if (fd != -1)
+    close(fd);
+
+  pthread_mutex_lock(&dl->lock);
+  if (!dl->published && !dl->entries) {
+    dl->published = sorted;
+    dl->numPublished = numSorted;
+    sorted = NULL;
+  }
+  __atomic_store_n(&dl->scanning, 0, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&dl->lock);
+  editorRelease(sorted);
+  editorRelease(batch);
+  editorWake();
+  return NULL;
+}
+
+void editorDirListingFree(dirListing *dl) {
+  __atomic_store_n(&dl->cancel, 1, __ATOMIC_RELAXED);
+  if (dl->started)
+    pthread_join(dl->thread, NULL);
+  editorWatchRemove(dl->wd);
+  for (int i = 0; i < dl->numArenas; i++)
+    editorRelease(dl->arenas[i]);
+  editorRelease(dl->arenas);
+  editorRelease(dl->published);
+  editorRelease(dl->entries);
+  pthread_mutex_destroy(&dl->lock);
+  editorRelease(dl);
+}
+
+void editorDirCacheRemove(dirListing *dl) {
+  for (int i = 0; i < E.fb.numCached; i++) {
+    if (E.fb.cache[i] != dl)
+      continue;
+    memmove(&E.fb.cache[i], &E.fb.cache[i + 1],
+            sizeof(dirListing *) * (E.fb.numCached - i - 1));
+    E.fb.numCached--;
+    break;
+  }
+  if (E.fb.listing == dl) {
+    E.fb.listing = NULL;
+    E.fb.entries = NULL;
+    E.fb.numEntries = 0;
+  }
+  editorDirListingFree(dl);
+}
+
+dirListing *editorDirCacheGet(const char *path) {
+  for (int i = 0; i < E.fb.numCached; i++) {
+    dirListing *dl = E.fb.cache[i];
+    if (strcmp(dl->path, path) != 0)
+      continue;
+    if (dl->stale && !dl->scanning) {
+      editorDirCacheRemove(dl);
+      break;
+    }
+    dl->lastUsed = ++E.fb.clock;
+    return dl;
+  }
+
+  if (E.fb.numCached == MAX_DIR_CACHE) {
+    dirListing *victim = NULL;
+    for (int i = 0; i < E.fb.numCached; i++) {
+      dirListing *dl = E.fb.cache[i];
+      if (dl != E.fb.listing && (!victim || dl->lastUsed < victim->lastUsed))
+        victim = dl;
+    }
+    editorDirCacheRemove(victim);
+  }
+
+  dirListing *dl = editorAlloc(MEM_BROWSER, sizeof(dirListing));
+  memset(dl, 0, sizeof(dirListing));
+  snprintf(dl->path, sizeof(dl->path), "%s", path);
+  pthread_mutex_init(&dl->lock, NULL);
+  dl->scanning = 1;
+  dl->wd = editorWatchAdd(path);
+  dl->lastUsed = ++E.fb.clock;
+  E.fb.cache[E.fb.numCached++] = dl;
+
+  if (pthread_create(&dl->thread, NULL, editorDirScanThread, dl) == 0)
+    dl->started = 1;
+  else
+    editorDirScanThread(dl);
+  return dl;
+}
+
+void editorFileBrowserSync(void) {
+  dirListing *dl = E.fb.listing;
+  if (!dl)
+    return;
+
+  const char *selName = NULL;
+  dirEntry sel;
+  if (E.fb.restoreName[0]) {
+    sel.name = E.fb.restoreName;
+    sel.isDir = E.fb.restoreIsDir;
+    selName = sel.name;
+  } else if (E.fb.selected >= 0 && E.fb.selected < E.fb.numEntries) {
+    sel = E.fb.entries[E.fb.selected];
+    selName = sel.name;
+  }
+
+  pthread_mutex_lock(&dl->lock);
+  if (dl->published) {
+    editorRelease(dl->entries);
+    dl->entries = dl->published;
+    dl->numEntries = dl->numPublished;
+    dl->published = NULL;
+  }
+  int scanning = __atomic_load_n(&dl->scanning, __ATOMIC_ACQUIRE);
+  pthread_mutex_unlock(&dl->lock);
+
+  E.fb.entries = dl->entries;
+  E.fb.numEntries = dl->numEntries;
+
+  if (selName) {
+    dirEntry *found = bsearch(&sel, E.fb.entries, E.fb.numEntries,
+                              sizeof(dirEntry), editorDirEntryCompare);
+    if (found) {
+      E.fb.restoreName[0] = '\0';
+      E.fb.selected = found - E.fb.entries;
+      int visibleRows = E.screenrows - 4;
+      if (E.fb.selected < E.fb.scroll)
+        E.fb.scroll = E.fb.selected;
+      else if (E.fb.selected >= E.fb.scroll + visibleRows)
+        E.fb.scroll = E.fb.selected - visibleRows + 1;
+    }
+  }
+  if (!scanning)
+    E.fb.restoreName[0] = '\0';
+  if (E.fb.selected < 0 || E.fb.selected >= E.fb.numEntries)
+    E.fb.selected = E.fb.numEntries > 0 ? E.fb.numEntries - 1 : 0;
+
+  if (!scanning && dl->stale) {
+    editorFileBrowserRefresh();
+    return;
+  }
+
+  if (!scanning && !dl->complete) {
+    dl->complete = 1;
+    if (dl->error)
+      editorSetStatusMessage("Cannot open directory: %s", dl->path);
+    else
+      editorSetStatusMessage("File browser updated: %s (%d entries)", dl->path,
+                             dl->numEntries);
+  }
+}
+
+void editorFileBrowserUpdate(void) {
+  E.fb.listing = editorDirCacheGet(E.fb.currentDir);
+  E.fb.entries = NULL;
+  E.fb.numEntries = 0;
+  editorFileBrowserSync();
+}
+
+void editorFileBrowserRefresh(void) {
+  if (E.fb.selected >= 0 && E.fb.selected < E.fb.numEntries) {
+    dirEntry *sel = &E.fb.entries[E.fb.selected];
+    snprintf(E.fb.restoreName, sizeof(E.fb.restoreName), "%s", sel->name);
+    E.fb.restoreIsDir = sel->isDir;
+  }
+  if (E.fb.listing)
+    editorDirCacheRemove(E.fb.listing);
+  editorFileBrowserUpdate();
+}
+
+#ifdef __linux__
+#define WATCH_MASK                                                             \
+  (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_CLOSE_WRITE |      \
+   IN_MODIFY | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+#define WATCH_LISTING_MASK                                                     \
+  (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF |      \
+   IN_MOVE_SELF | IN_IGNORED)
+#endif
+
+int editorWatchAdd(const char *dir) {
+#ifdef __linux__
+  if (E.inotifyFd == -1)
+    return -1;
+  int wd = inotify_add_watch(E.inotifyFd, dir, WATCH_MASK);
+  if (wd == -1)
+    return -1;
+  for (int i = 0; i < E.numWatches; i++) {
+    if (E.watches[i].wd == wd) {
+      E.watches[i].refs++;
+      return wd;
+    }
+  }
+  if (E.numWatches == MAX_WATCHES) {
+    inotify_rm_watch(E.inotifyFd, wd);
+    return -1;
+  }
+  E.watches[E.numWatches].wd = wd;
+  E.watches[E.numWatches].refs = 1;
+  E.numWatches++;
+  return wd;
+#else
+  (void)dir;
+  return -1;
+#endif
+}
+
+void editorWatchRemove(int wd) {
+  if (wd < 0)
+    return;
+  for (int i = 0; i < E.numWatches; i++) {
+    if (E.watches[i].wd != wd)
+      continue;
+    if (--E.watches[i].refs == 0) {
+#ifdef __linux__
+      inotify_rm_watch(E.inotifyFd, wd);
+#endif
+      E.watches[i] = E.watches[--E.numWatches];
+    }
+    return;
+  }
+}
+
+void editorWatchFile(void) {
+  editorWatchRemove(E.fileWd);
+  E.fileWd = -1;
+  if (!E.filename)
+    return;
+
+  char dir[1024];
+  snprintf(dir, sizeof(dir), "%s", E.filename);
+  char *slash = strrchr(dir, '/');
+  if (!slash)
+    strcpy(dir, ".");
+  else if (slash == dir)
+    dir[1] = '\0';
+  else
+    *slash = '\0';
+  E.fileWd = editorWatchAdd(dir);
+}
+
+void editorRecordDiskState(void) {
+  if (!E.filename || stat(E.filename, &E.disk) == -1)
+    memset(&E.disk, 0, sizeof(E.disk));
+  E.diskChanged = 0;
+}
+
+int editorDiskStateChanged(void) {
+  struct stat st;
+  if (!E.filename)
+    return 0;
+  if (stat(E.filename, &st) == -1)
+    return E.disk.st_ino != 0;
+  if (st.st_ino != E.disk.st_ino || st.st_size != E.disk.st_size)
+    return 1;
+#ifdef __linux__
+  return st.st_mtim.tv_sec != E.disk.st_mtim.tv_sec ||
+         st.st_mtim.tv_nsec != E.disk.st_mtim.tv_nsec;
+#else
+  return st.st_mtime != E.disk.st_mtime;
+#endif
+}
+
+/* Drains inotify: listings whose directory changed are marked stale (the
+ * visible one is rescanned right away), and the open buffer is flagged when
+ * its file no longer matches what was last loaded or saved. */
+void editorWatchProcessEvents(void) {
+#ifdef __linux__
+  long long buf[2048];
+  const char *base = NULL;
+  int fileEvent = 0;
+  ssize_t n;
+
+  if (E.filename) {
+    base = strrchr(E.filename, '/');
+    base = base ? base + 1 : E.filename;
+  }
+
+  while ((n = read(E.inotifyFd, buf, sizeof(buf))) > 0) {
+    char *p = (char *)buf;
+    while (p < (char *)buf + n) {
+      struct inotify_event *ev = (struct inotify_event *)p;
+      p += sizeof(struct inotify_event) + ev->len;
+
+      if (ev->mask & IN_Q_OVERFLOW) {
+        for (int i = 0; i < E.fb.numCached; i++)
+          E.fb.cache[i]->stale = 1;
+        fileEvent = 1;
+        continue;
+      }
+
+      if (ev->mask & WATCH_LISTING_MASK) {
+        for (int i = 0; i < E.fb.numCached; i++)
+          if (E.fb.cache[i]->wd == ev->wd)
+            E.fb.cache[i]->stale = 1;
+      }
+
+      if (ev->wd == E.fileWd && base && ev->len &&
+          strcmp(ev->name, base) == 0)
+        fileEvent = 1;
+
+      if (ev->mask & IN_IGNORED) {
+        for (int i = 0; i < E.numWatches; i++)
+          if (E.watches[i].wd == ev->wd)
+            E.watches[i] = E.watches[--E.numWatches];
+        for (int i = 0; i < E.fb.numCached; i++)
+          if (E.fb.cache[i]->wd == ev->wd)
+            E.fb.cache[i]->wd = -1;
+        if (E.fileWd == ev->wd) {
+          E.fileWd = -1;
+          fileEvent = 1;
+        }
+      }
+    }
+  }
+
+  if (E.fb.visible && E.fb.listing && E.fb.listing->stale &&
+      !E.fb.listing->scanning)
+    editorFileBrowserRefresh();
+
+  if (fileEvent && E.follow) {
+    editorFollowUpdate();
+  } else if (fileEvent && !E.diskChanged && editorDiskStateChanged()) {
+    E.diskChanged = 1;
+    struct stat st;
+    if (stat(E.filename, &st) == -1)
+      editorSetStatusMessage("File was deleted on disk");
+    else
+      editorSetStatusMessage("File changed on disk. Ctrl-R to reload");
+  }
+#endif
+}
+
+int editorFileBrowserPath(const char *name, char *out, size_t size) {
+  size_t dirlen = strlen(E.fb.currentDir);
+  const char *sep = dirlen > 0 && E.fb.currentDir[dirlen - 1] == '/' ? "" : "/";
+  int len = snprintf(out, size, "%s%s%s", E.fb.currentDir, sep, name);
+  return len < 0 || (size_t)len >= size ? -1 : len;
+}
+
+void editorFileBrowserToggle(void) {
+  E.fb.visible = !E.fb.visible;
+
+  if (E.fb.visible) {
+    if (E.fb.currentDir[0] == '\0') {
+      getcwd(E.fb.currentDir, sizeof(E.fb.currentDir));
+    }
+    editorFileBrowserUpdate();
+  }
+}
+
+void editorFileBrowserDraw(void) {
+  if (!E.fb.visible)
+    return;
+
+  int width = E.screencols / 4;
+  if (width < 20)
+    width = 20;
+  if (width > 40)
+    width = 40;
+
+  char buf[32];
+  int rows = E.screenrows - 2;
+
+  for (int y = 0; y < rows; y++) {
+    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", y + 1, 1);
+    editorWrite(buf, strlen(buf));
+
+    setColor(COLOR_BACKGROUND);
+
+    for (int i = 0; i < width; i++) {
+      editorWrite(" ", 1);
+    }
+  }
+
+  snprintf(buf, sizeof(buf), "\x1b[%d;%dH", 1, 1);
+  editorWrite(buf, strlen(buf));
+  setColor(COLOR_STATUS_BG);
+
+  char title[41];
+  int titleLen;
+  if (E.fb.listing && E.fb.listing->scanning)
+    titleLen = snprintf(title, sizeof(title), " File Browser (%d...) ",
+                        E.fb.numEntries);
+  else
+    titleLen = snprintf(title, sizeof(title), " File Browser ");
+  if (titleLen >= (int)sizeof(title))
+    titleLen = sizeof(title) - 1;
+  editorWrite(title, titleLen);
+  for (int i = titleLen; i < width; i++) {
+    editorWrite(" ", 1);
+  }
+
+  int visible_rows = rows - 2;
+  int start = E.fb.scroll;
+  int end = start + visible_rows;
+  if (end > E.fb.numEntries)
+    end = E.fb.numEntries;
+
+  for (int i = start, y = 2; i < end; i++, y++) {
+    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", y, 1);
+    editorWrite(buf, strlen(buf));
+
+    if (i == E.fb.selected) {
+      setColor(COLOR_SELECTION);
+    } else {
+      setColor(COLOR_FOREGROUND);
+    }
+
+    dirEntry *entry = &E.fb.entries[i];
+    char line[41];
+    if (entry->isDir) {
+      snprintf(line, sizeof(line), " [%s]", entry->name);
+    } else {
+      snprintf(line, sizeof(line), " %s", entry->name);
+    }
+
+    int len = strlen(line);
+    if (len > width - 1) {
+      line[width - 4] = '.';
+      line[width - 3] = '.';
+      line[width - 2] = '.';
+      line[width - 1] = '\0';
+      len = width - 1;
+    }
+
+    editorWrite(line, len);
+
+    for (int j = len; j < width; j++) {
+      editorWrite(" ", 1);
+    }
+  }
+
+  resetColor();
+}
+
+void editorFileBrowserProcessKey(int key) {
+  switch (key) {
+  case ARROW_UP:
+    if (E.fb.selected > 0) {
+      E.fb.selected--;
+      if (E.fb.selected < E.fb.scroll) {
+        E.fb.scroll = E.fb.selected;
+      }
+    }
+    break;
+
+  case ARROW_DOWN:
+    if (E.fb.selected < E.fb.numEntries - 1) {
+      E.fb.selected++;
+      if (E.fb.selected >= E.fb.scroll + E.screenrows - 4) {
+        E.fb.scroll++;
+      }
+    }
+    break;
+
+  case '\r':
+    if (E.fb.selected >= 0 && E.fb.selected < E.fb.numEntries) {
+      dirEntry *entry = &E.fb.entries[E.fb.selected];
+
+      if (entry->isDir) {
+        char newPath[sizeof(E.fb.currentDir)];
+        if (strcmp(entry->name, "..") == 0) {
           char *lastSlash = strrchr(E.fb.currentDir, '/');
           if (lastSlash != NULL && lastSlash != E.fb.currentDir) {
             *lastSlash = '\0';
@@ -785,190 +4585,2362 @@ void editorFileBrowserProcessKey(int key) {
           }
         } else if (strcmp(entry->name, ".") == 0) {
         } else {
-          if (E.fb.currentDir[strlen(E.fb.currentDir) - 1] != '/') {
-            snprintf(newPath, sizeof(newPath), "%s/%s", E.fb.currentDir,
-                     entry->name);
-          } else {
-            snprintf(newPath, sizeof(newPath), "%s%s", E.fb.currentDir,
-                     entry->name);
+          if (editorFileBrowserPath(entry->name, newPath, sizeof(newPath)) ==
+              -1) {
+            editorSetStatusMessage("Path too long");
+            break;
           }
           strcpy(E.fb.currentDir, newPath);
         }
 
-        editorFileBrowserUpdate();
-        E.fb.selected = 0;
-        E.fb.scroll = 0;
+        editorFileBrowserUpdate();
+        E.fb.selected = 0;
+        E.fb.scroll = 0;
+      } else {
+        char filePath[sizeof(E.fb.currentDir)];
+        if (editorFileBrowserPath(entry->name, filePath, sizeof(filePath)) ==
+            -1) {
+          editorSetStatusMessage("Path too long");
+          break;
+        }
+
+        if (E.dirty) {
+          editorSetStatusMessage(
+              "WARNING!!! File has unsaved changes. Save first!");
+        } else {
+          editorOpen(filePath);
+          editorFileBrowserToggle();
+        }
+      }
+    }
+    break;
+
+  case CTRL_KEY('r'):
+    editorFileBrowserRefresh();
+    break;
+
+  case CTRL_KEY('h'):
+    strcpy(E.fb.currentDir, getenv("HOME"));
+    editorFileBrowserUpdate();
+    E.fb.selected = 0;
+    E.fb.scroll = 0;
+    break;
+  }
+}
+
+/* Parses the .gitignore in dirfd, if any, into a list chained onto the
+ * parent directory's rules. The caller owns one reference to the result. */
+ignoreList *editorIgnoreLoad(int dirfd, const char *base, ignoreList *parent) {
+  editorIgnoreRetain(parent);
+  int fd = openat(dirfd, ".gitignore", O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+    return parent;
+  FILE *fp = fdopen(fd, "r");
+  if (!fp) {
+    close(fd);
+    return parent;
+  }
+
+  ignoreList *list = calloc(1, sizeof(ignoreList));
+  list->refcount = 1;
+  list->parent = parent;
+  list->base = strdup(base);
+  list->baseLen = strlen(base);
+
+  char *line = NULL;
+  size_t cap = 0;
+  ssize_t len;
+  while ((len = getline(&line, &cap, fp)) != -1) {
+    while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r' ||
+                       line[len - 1] == ' '))
+      line[--len] = '\0';
+    char *p = line;
+    if (*p == '\0' || *p == '#')
+      continue;
+
+    ignoreRule rule = {NULL, 0, 0, 0};
+    if (*p == '!') {
+      rule.negate = 1;
+      p++;
+    } else if (*p == '\\') {
+      p++;
+    }
+    len = strlen(p);
+    if (len > 0 && p[len - 1] == '/') {
+      rule.dirOnly = 1;
+      p[--len] = '\0';
+    }
+    if (strncmp(p, "**/", 3) == 0)
+      p += 3;
+    else if (*p == '/' && (rule.anchored = 1))
+      p++;
+    else if (strchr(p, '/'))
+      rule.anchored = 1;
+    if (*p == '\0')
+      continue;
+
+    rule.pattern = strdup(p);
+    list->rules =
+        realloc(list->rules, sizeof(ignoreRule) * (list->numRules + 1));
+    list->rules[list->numRules++] = rule;
+  }
+  free(line);
+  fclose(fp);
+  return list;
+}
+
+void editorIgnoreRetain(ignoreList *list) {
+  if (list)
+    __atomic_add_fetch(&list->refcount, 1, __ATOMIC_RELAXED);
+}
+
+void editorIgnoreRelease(ignoreList *list) {
+  while (list &&
+         __atomic_sub_fetch(&list->refcount, 1, __ATOMIC_ACQ_REL) == 0) {
+    ignoreList *parent = list->parent;
+    for (int i = 0; i < list->numRules; i++)
+      free(list->rules[i].pattern);
+    free(list->rules);
+    free(list->base);
+    free(list);
+    list = parent;
+  }
+}
+
+/* Deeper .gitignore files win over their parents and, within a file, the
+ * last matching rule wins, as in git. */
+int editorIgnoreMatch(ignoreList *list, const char *path, int isDir) {
+  const char *name = strrchr(path, '/');
+  name = name ? name + 1 : path;
+
+  for (; list; list = list->parent) {
+    const char *rel = path + (list->baseLen ? list->baseLen + 1 : 0);
+    for (int i = list->numRules - 1; i >= 0; i--) {
+      ignoreRule *rule = &list->rules[i];
+      if (rule->dirOnly && !isDir)
+        continue;
+      int flags = strstr(rule->pattern, "**") ? 0 : FNM_PATHNAME;
+      if (fnmatch(rule->pattern, rule->anchored ? rel : name, flags) == 0)
+        return !rule->negate;
+    }
+  }
+  return 0;
+}
+
+void editorWalkPush(fileWalker *w, int worker, char *path, ignoreList *ignore) {
+  walkQueue *q = &w->queues[worker];
+  __atomic_add_fetch(&w->pending, 1, __ATOMIC_RELAXED);
+
+  pthread_mutex_lock(&q->lock);
+  if (q->tail - q->head == q->cap) {
+    int cap = q->cap ? q->cap * 2 : 64;
+    walkJob *jobs = malloc(sizeof(walkJob) * cap);
+    for (int i = 0; i < q->cap; i++)
+      jobs[i] = q->jobs[(q->head + i) % q->cap];
+    free(q->jobs);
+    q->jobs = jobs;
+    q->tail -= q->head;
+    q->head = 0;
+    q->cap = cap;
+  }
+  q->jobs[q->tail % q->cap].path = path;
+  q->jobs[q->tail % q->cap].ignore = ignore;
+  q->tail++;
+  pthread_mutex_unlock(&q->lock);
+}
+
+/* Takes the newest job from the worker's own queue, which keeps the walk
+ * depth first, or steals the oldest job from another worker. */
+int editorWalkPop(fileWalker *w, int worker, walkJob *job) {
+  for (int k = 0; k < w->numThreads; k++) {
+    walkQueue *q = &w->queues[(worker + k) % w->numThreads];
+    pthread_mutex_lock(&q->lock);
+    int found = q->tail != q->head;
+    if (found && k == 0)
+      *job = q->jobs[--q->tail % q->cap];
+    else if (found)
+      *job = q->jobs[q->head++ % q->cap];
+    pthread_mutex_unlock(&q->lock);
+    if (found)
+      return 1;
+  }
+  return 0;
+}
+
+void editorWalkDir(fileWalker *w, int worker, walkJob *job) {
+  int fd = openat(w->rootFd, job->path[0] ? job->path : ".",
+                  O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd == -1)
+    return;
+
+  ignoreList *ignore = editorIgnoreLoad(fd, job->path, job->ignore);
+  char path[4096];
+  size_t baseLen = strlen(job->path);
+  memcpy(path, job->path, baseLen);
+  if (baseLen)
+    path[baseLen++] = '/';
+
+#ifdef __linux__
+  long long buf[4096];
+  long n;
+  while ((n = syscall(SYS_getdents64, fd, buf, sizeof(buf))) > 0) {
+    for (long pos = 0; pos < n;) {
+      struct linuxDirent64 *d = (struct linuxDirent64 *)((char *)buf + pos);
+      const char *name = d->d_name;
+      unsigned char type = d->d_type;
+      pos += d->d_reclen;
+#else
+  DIR *dir = fdopendir(dup(fd));
+  struct dirent *d;
+  while (dir && (d = readdir(dir)) != NULL) {
+    {
+      const char *name = d->d_name;
+      unsigned char type = d->d_type;
+#endif
+      if (__atomic_load_n(&w->cancel, __ATOMIC_RELAXED))
+        break;
+      if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0 ||
+          strcmp(name, ".git") == 0)
+        continue;
+
+      size_t nameLen = strlen(name);
+      if (baseLen + nameLen + 1 > sizeof(path))
+        continue;
+      memcpy(path + baseLen, name, nameLen + 1);
+
+      int isDir = type == DT_DIR, isFile = type == DT_REG;
+      if (type == DT_UNKNOWN || type == DT_LNK) {
+        struct stat st;
+        if (fstatat(fd, name, &st, 0) == -1)
+          continue;
+        /* Linked directories are not followed, so the walk cannot loop. */
+        isDir = type == DT_UNKNOWN && S_ISDIR(st.st_mode);
+        isFile = S_ISREG(st.st_mode);
+      }
+      if ((!isDir && !isFile) || editorIgnoreMatch(ignore, path, isDir))
+        continue;
+
+      if (isDir) {
+        editorIgnoreRetain(ignore);
+        editorWalkPush(w, worker, strdup(path), ignore);
+      } else {
+        w->visit(w, worker, path, baseLen + nameLen);
+      }
+    }
+  }
+
+#ifndef __linux__
+  if (dir)
+    closedir(dir);
+#endif
+  editorIgnoreRelease(ignore);
+  close(fd);
+}
+
+void *editorWalkThread(void *arg) {
+  walkWorker *ww = arg;
+  fileWalker *w = ww->walker;
+  walkJob job;
+
+  while (!__atomic_load_n(&w->cancel, __ATOMIC_RELAXED)) {
+    if (editorWalkPop(w, ww->id, &job)) {
+      editorWalkDir(w, ww->id, &job);
+      free(job.path);
+      editorIgnoreRelease(job.ignore);
+      __atomic_sub_fetch(&w->pending, 1, __ATOMIC_ACQ_REL);
+    } else if (__atomic_load_n(&w->pending, __ATOMIC_ACQUIRE) == 0) {
+      break;
+    } else {
+      struct timespec ts = {0, 200000};
+      nanosleep(&ts, NULL);
+    }
+  }
+
+  if (w->done)
+    w->done(w, ww->id);
+  if (__atomic_sub_fetch(&w->running, 1, __ATOMIC_ACQ_REL) == 0)
+    editorWake();
+  return NULL;
+}
+
+/* Walks the tree under root on one thread per core. Each worker calls visit
+ * for the regular files it finds and done once it runs out of work. */
+int editorWalkStart(fileWalker *w, const char *root) {
+  w->rootFd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (w->rootFd == -1)
+    return -1;
+
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  w->numThreads = cpus < 1 ? 1 : cpus > WALK_MAX_THREADS ? WALK_MAX_THREADS
+                                                         : cpus;
+  w->pending = 0;
+  w->cancel = 0;
+  w->running = w->numThreads;
+  for (int i = 0; i < w->numThreads; i++) {
+    pthread_mutex_init(&w->queues[i].lock, NULL);
+    w->queues[i].jobs = NULL;
+    w->queues[i].head = w->queues[i].tail = w->queues[i].cap = 0;
+  }
+  editorWalkPush(w, 0, strdup(""), NULL);
+
+  for (int i = 0; i < w->numThreads; i++) {
+    w->workers[i].walker = w;
+    w->workers[i].id = i;
+    w->workers[i].started = pthread_create(&w->workers[i].thread, NULL,
+                                           editorWalkThread,
+                                           &w->workers[i]) == 0;
+    if (!w->workers[i].started)
+      editorWalkThread(&w->workers[i]);
+  }
+  return 0;
+}
+
+void editorWalkJoin(fileWalker *w) {
+  for (int i = 0; i < w->numThreads; i++)
+    if (w->workers[i].started)
+      pthread_join(w->workers[i].thread, NULL);
+
+  for (int i = 0; i < w->numThreads; i++) {
+    walkQueue *q = &w->queues[i];
+    for (int j = q->head; j < q->tail; j++) {
+      free(q->jobs[j % q->cap].path);
+      editorIgnoreRelease(q->jobs[j % q->cap].ignore);
+    }
+    free(q->jobs);
+    pthread_mutex_destroy(&q->lock);
+  }
+  close(w->rootFd);
+}
+
+void editorIndexVisit(fileWalker *w, int worker, const char *path, size_t len) {
+  fileIndex *idx = w->arg;
+  indexWorker *iw = &idx->workers[worker];
+
+  if (!iw->arena || iw->arenaUsed + len + 1 > DIR_NAME_ARENA) {
+    iw->arena = malloc(DIR_NAME_ARENA);
+    iw->arenaUsed = 0;
+    pthread_mutex_lock(&idx->lock);
+    idx->arenas = realloc(idx->arenas, sizeof(char *) * (idx->numArenas + 1));
+    idx->arenas[idx->numArenas++] = iw->arena;
+    pthread_mutex_unlock(&idx->lock);
+  }
+  char *copy = iw->arena + iw->arenaUsed;
+  memcpy(copy, path, len + 1);
+  iw->arenaUsed += len + 1;
+
+  if (!iw->batch)
+    iw->batch = malloc(sizeof(char *) * WALK_BATCH);
+  iw->batch[iw->numBatch++] = copy;
+  if (iw->numBatch == WALK_BATCH)
+    editorIndexFlush(w, worker);
+}
+
+void editorIndexFlush(fileWalker *w, int worker) {
+  fileIndex *idx = w->arg;
+  indexWorker *iw = &idx->workers[worker];
+  if (iw->numBatch == 0)
+    return;
+
+  pthread_mutex_lock(&idx->lock);
+  if (idx->numPublished + iw->numBatch > idx->capPublished) {
+    idx->capPublished = (idx->numPublished + iw->numBatch) * 2;
+    idx->published =
+        realloc(idx->published, sizeof(char *) * idx->capPublished);
+  }
+  memcpy(&idx->published[idx->numPublished], iw->batch,
+         sizeof(char *) * iw->numBatch);
+  idx->numPublished += iw->numBatch;
+  pthread_mutex_unlock(&idx->lock);
+
+  iw->numBatch = 0;
+  editorWake();
+}
+
+fileIndex *editorIndexCreate(const char *root) {
+  fileIndex *idx = calloc(1, sizeof(fileIndex));
+  snprintf(idx->root, sizeof(idx->root), "%s", root);
+  pthread_mutex_init(&idx->lock, NULL);
+  idx->walker.visit = editorIndexVisit;
+  idx->walker.done = editorIndexFlush;
+  idx->walker.arg = idx;
+  if (editorWalkStart(&idx->walker, root) == -1) {
+    pthread_mutex_destroy(&idx->lock);
+    free(idx);
+    return NULL;
+  }
+  idx->walking = 1;
+  return idx;
+}
+
+void editorIndexFree(fileIndex *idx) {
+  if (idx->walking) {
+    __atomic_store_n(&idx->walker.cancel, 1, __ATOMIC_RELAXED);
+    editorWalkJoin(&idx->walker);
+  }
+  for (int i = 0; i < WALK_MAX_THREADS; i++)
+    free(idx->workers[i].batch);
+  for (int i = 0; i < idx->numArenas; i++)
+    free(idx->arenas[i]);
+  free(idx->arenas);
+  free(idx->published);
+  free(idx->paths);
+  free(idx->masks);
+  free(idx->lens);
+  pthread_mutex_destroy(&idx->lock);
+  free(idx);
+}
+
+/* One bit per letter or digit plus a few bits for punctuation. A path can
+ * only match a query whose mask is a subset of its own. */
+unsigned long long editorFuzzyMask(const char *s, int len) {
+  unsigned long long mask = 0;
+  for (int i = 0; i < len; i++) {
+    unsigned char c = tolower((unsigned char)s[i]);
+    if (c >= 'a' && c <= 'z')
+      mask |= 1ULL << (c - 'a');
+    else if (c >= '0' && c <= '9')
+      mask |= 1ULL << (26 + c - '0');
+    else
+      mask |= 1ULL << (36 + c % 28);
+  }
+  return mask;
+}
+
+#define FUZZY_LOWER(c) ((c) >= 'A' && (c) <= 'Z' ? (c) + 32 : (c))
+
+/* Scores a case-insensitive subsequence match of the lowercase query, or
+ * returns 0 when there is none. The first match is found going forward, then
+ * tightened going backward from its end, so the window is short without a
+ * full dynamic program. Word starts, runs and hits in the basename score
+ * higher. */
+int editorFuzzyScore(const char *path, int len, const char *query, int qlen) {
+  int qi = 0, end = -1;
+  char want = query[0];
+  for (int i = 0; i < len; i++) {
+    char c = path[i];
+    if (FUZZY_LOWER(c) != want)
+      continue;
+    if (++qi == qlen) {
+      end = i;
+      break;
+    }
+    want = query[qi];
+  }
+  if (end < 0)
+    return 0;
+
+  int start = end;
+  qi = qlen - 1;
+  for (int i = end; i >= 0; i--) {
+    if (FUZZY_LOWER(path[i]) == query[qi] && --qi < 0) {
+      start = i;
+      break;
+    }
+  }
+
+  const char *slash = memrchr(path, '/', len);
+  int base = slash ? slash - path + 1 : 0;
+  int score = 1000, run = 0;
+  qi = 0;
+  for (int i = start; i <= end && qi < qlen; i++) {
+    if (FUZZY_LOWER(path[i]) != query[qi]) {
+      score -= 2;
+      run = 0;
+      continue;
+    }
+    int bonus = 16;
+    char prev = i > 0 ? path[i - 1] : '/';
+    if (prev == '/' || prev == '_' || prev == '-' || prev == '.' || prev == ' ')
+      bonus += 24;
+    else if (islower((unsigned char)prev) && isupper((unsigned char)path[i]))
+      bonus += 16;
+    if (run > 0)
+      bonus += 8 * run;
+    if (i >= base)
+      bonus += 12;
+    score += bonus;
+    run++;
+    qi++;
+  }
+  score -= len / 4;
+  return score > 1 ? score : 1;
+}
+
+int editorFinderAddCandidate(int index) {
+  fileFinder *f = &E.finder;
+  fileIndex *idx = f->index;
+  if ((idx->masks[index] & f->queryMask) != f->queryMask)
+    return 0;
+  int score = editorFuzzyScore(idx->paths[index], idx->lens[index], f->query,
+                               f->queryLen);
+  if (score == 0)
+    return 0;
+  editorFinderPush(index, score);
+  return 1;
+}
+
+/* Does one time slice of ranking and returns whether work remains. The
+ * previous candidates are narrowed first, then index entries not yet seen by
+ * this query are scanned. Matches go to the candidate list and to a bounded
+ * min-heap of the best results, which is kept sorted for display between
+ * slices. */
+int editorFinderRank(void) {
+  fileFinder *f = &E.finder;
+  fileIndex *idx = f->index;
+  int work = 0, more = 1;
+
+  while (more) {
+    if (++work % 1024 == 0 && editorIdleYield())
+      break;
+
+    if (f->narrowPos < f->narrowEnd) {
+      int i = f->candidates[f->narrowPos++];
+      if (editorFinderAddCandidate(i))
+        f->candidates[f->narrowOut++] = i;
+      if (f->narrowPos == f->narrowEnd)
+        f->numCandidates = f->narrowOut;
+    } else if (f->scored < idx->numPaths) {
+      int i = f->scored++;
+      if (f->queryLen == 0) {
+        editorFinderPush(i, -i);
+        if (f->numResults == FINDER_MAX_RESULTS)
+          f->scored = idx->numPaths;
+      } else if (editorFinderAddCandidate(i)) {
+        if (f->numCandidates == f->capCandidates) {
+          f->capCandidates = f->capCandidates ? f->capCandidates * 2 : 1024;
+          f->candidates =
+              realloc(f->candidates, sizeof(int) * f->capCandidates);
+        }
+        f->candidates[f->numCandidates++] = i;
+      }
+    } else {
+      more = 0;
+    }
+  }
+
+  qsort(f->results, f->numResults, sizeof(finderMatch), editorFinderCompare);
+  return more;
+}
+
+int editorFinderCompare(const void *a, const void *b) {
+  const finderMatch *x = a;
+  const finderMatch *y = b;
+  if (x->score != y->score)
+    return x->score < y->score ? -1 : 1;
+  return y->index - x->index;
+}
+
+void editorFinderPush(int index, int score) {
+  fileFinder *f = &E.finder;
+  finderMatch m = {index, score};
+  int i, n = f->numResults;
+
+  if (n < FINDER_MAX_RESULTS) {
+    for (i = f->numResults++; i > 0; i = (i - 1) / 2) {
+      if (editorFinderCompare(&m, &f->results[(i - 1) / 2]) >= 0)
+        break;
+      f->results[i] = f->results[(i - 1) / 2];
+    }
+    f->results[i] = m;
+    return;
+  }
+
+  if (editorFinderCompare(&m, &f->results[0]) <= 0)
+    return;
+  for (i = 0;;) {
+    int c = 2 * i + 1;
+    if (c >= n)
+      break;
+    if (c + 1 < n &&
+        editorFinderCompare(&f->results[c + 1], &f->results[c]) < 0)
+      c++;
+    if (editorFinderCompare(&f->results[c], &m) >= 0)
+      break;
+    f->results[i] = f->results[c];
+    i = c;
+  }
+  f->results[i] = m;
+}
+
+/* Restarts ranking after a query change. Appending a character can only
+ * shrink the match set, so the previous candidates are narrowed instead of
+ * rescanning the index. Candidates a cut-short slice had not narrowed yet
+ * are kept, since they are still a superset. */
+void editorFinderSetQuery(int narrow) {
+  fileFinder *f = &E.finder;
+  f->queryMask = editorFuzzyMask(f->query, f->queryLen);
+  f->numResults = 0;
+  f->selected = 0;
+  f->scroll = 0;
+  if (!f->index)
+    return;
+
+  if (narrow && f->queryLen > 1) {
+    int pending = f->narrowEnd - f->narrowPos;
+    memmove(&f->candidates[f->narrowOut], &f->candidates[f->narrowPos],
+            sizeof(int) * pending);
+    if (f->narrowPos < f->narrowEnd)
+      f->numCandidates = f->narrowOut + pending;
+  } else {
+    f->numCandidates = 0;
+    f->scored = 0;
+  }
+  f->narrowPos = 0;
+  f->narrowOut = 0;
+  f->narrowEnd = f->numCandidates;
+  if (f->narrowEnd == 0)
+    f->numCandidates = 0;
+  editorIdleSchedule(IDLE_FINDER, IDLE_VISIBLE);
+}
+
+void editorFinderSync(void) {
+  fileIndex *idx = E.finder.index;
+  if (!idx)
+    return;
+
+  pthread_mutex_lock(&idx->lock);
+  if (idx->numPublished > 0) {
+    int total = idx->numPaths + idx->numPublished;
+    if (total > idx->capPaths) {
+      idx->capPaths = total * 2;
+      idx->paths = realloc(idx->paths, sizeof(char *) * idx->capPaths);
+      idx->masks =
+          realloc(idx->masks, sizeof(unsigned long long) * idx->capPaths);
+      idx->lens = realloc(idx->lens, sizeof(int) * idx->capPaths);
+    }
+    memcpy(&idx->paths[idx->numPaths], idx->published,
+           sizeof(char *) * idx->numPublished);
+    idx->numPublished = 0;
+    for (int i = idx->numPaths; i < total; i++) {
+      idx->lens[i] = strlen(idx->paths[i]);
+      idx->masks[i] = editorFuzzyMask(idx->paths[i], idx->lens[i]);
+    }
+    idx->numPaths = total;
+  }
+  pthread_mutex_unlock(&idx->lock);
+
+  if (idx->walking &&
+      __atomic_load_n(&idx->walker.running, __ATOMIC_ACQUIRE) == 0) {
+    editorWalkJoin(&idx->walker);
+    idx->walking = 0;
+    editorSetStatusMessage("Indexed %d files under %.40s", idx->numPaths,
+                           idx->root);
+  }
+
+  if (E.finder.visible && editorFinderPending())
+    editorIdleSchedule(IDLE_FINDER, IDLE_VISIBLE);
+}
+
+int editorFinderStep(void) {
+  if (!E.finder.visible || !editorFinderPending())
+    return 0;
+  int more = editorFinderRank();
+  E.idle.redraw = 1;
+  return more;
+}
+
+int editorFinderPending(void) {
+  fileFinder *f = &E.finder;
+  return f->index &&
+         (f->narrowPos < f->narrowEnd || f->scored < f->index->numPaths);
+}
+
+void editorFinderToggle(void) {
+  fileFinder *f = &E.finder;
+  f->visible = !f->visible;
+  if (!f->visible)
+    return;
+
+  if (!f->index) {
+    char root[1024];
+    if (!getcwd(root, sizeof(root)) ||
+        (f->index = editorIndexCreate(root)) == NULL) {
+      f->visible = 0;
+      editorSetStatusMessage("Cannot index the current directory");
+      return;
+    }
+  }
+  f->query[0] = '\0';
+  f->queryLen = 0;
+  editorFinderSync();
+  editorFinderSetQuery(0);
+}
+
+void editorFinderDraw(void) {
+  fileFinder *f = &E.finder;
+  if (!f->visible)
+    return;
+
+  abuf ab = ABUF_INIT;
+  char buf[64];
+  int len;
+
+  len = snprintf(buf, sizeof(buf), "\x1b[H\x1b[48;5;%dm\x1b[38;5;%dm",
+                 E.colors[COLOR_STATUS_BG], E.colors[COLOR_STATUS_FG]);
+  abAppend(&ab, buf, len);
+  char title[320];
+  int titleLen = snprintf(title, sizeof(title), " Open file: %s", f->query);
+  char count[64];
+  int countLen = snprintf(count, sizeof(count), "%d/%d%s ",
+                          f->narrowPos < f->narrowEnd ? f->narrowOut
+                          : f->queryLen               ? f->numCandidates
+                                                      : f->index->numPaths,
+                          f->index->numPaths,
+                          f->index->walking       ? " indexing..."
+                          : editorFinderPending() ? " ranking..."
+                                                  : "");
+  if (titleLen > E.screencols)
+    titleLen = E.screencols;
+  abAppend(&ab, title, titleLen);
+  int pad = E.screencols - titleLen - countLen;
+  for (int i = 0; i < pad; i++)
+    abAppend(&ab, " ", 1);
+  if (pad >= 0)
+    abAppend(&ab, count, countLen);
+  abAppend(&ab, "\x1b[49m", 5);
+
+  int rows = E.screenrows - 1;
+  if (f->selected < f->scroll)
+    f->scroll = f->selected;
+  else if (f->selected >= f->scroll + rows)
+    f->scroll = f->selected - rows + 1;
+
+  for (int y = 0; y < rows; y++) {
+    int r = f->scroll + y;
+    len = snprintf(buf, sizeof(buf), "\x1b[%d;1H\x1b[38;5;%dm", y + 2,
+                   E.colors[r == f->selected ? COLOR_SELECTION
+                                             : COLOR_FOREGROUND]);
+    abAppend(&ab, buf, len);
+    if (r < f->numResults) {
+      const char *path =
+          f->index->paths[f->results[f->numResults - 1 - r].index];
+      int plen = f->index->lens[f->results[f->numResults - 1 - r].index];
+      abAppend(&ab, r == f->selected ? "> " : "  ", 2);
+      abAppend(&ab, path, plen > E.screencols - 2 ? E.screencols - 2 : plen);
+    }
+    abAppend(&ab, "\x1b[K", 3);
+  }
+
+  editorWrite(ab.b, ab.len);
+  abFree(&ab);
+}
+
+void editorFinderProcessKey(int key) {
+  fileFinder *f = &E.finder;
+
+  switch (key) {
+  case '\x1b':
+  case CTRL_KEY('p'):
+  case CTRL_KEY('q'):
+    f->visible = 0;
+    break;
+
+  case '\r':
+    if (f->selected < f->numResults) {
+      finderMatch *m = &f->results[f->numResults - 1 - f->selected];
+      const char *rel = f->index->paths[m->index];
+      char path[2048];
+      snprintf(path, sizeof(path), "%s/%s", f->index->root, rel);
+      if (E.dirty) {
+        editorSetStatusMessage(
+            "WARNING!!! File has unsaved changes. Save first!");
+      } else {
+        f->visible = 0;
+        editorOpen(path);
+      }
+    }
+    break;
+
+  case ARROW_UP:
+    if (f->selected > 0)
+      f->selected--;
+    break;
+
+  case ARROW_DOWN:
+    if (f->selected < f->numResults - 1)
+      f->selected++;
+    break;
+
+  case PAGE_UP:
+    f->selected -= E.screenrows - 1;
+    if (f->selected < 0)
+      f->selected = 0;
+    break;
+
+  case PAGE_DOWN:
+    f->selected += E.screenrows - 1;
+    if (f->selected > f->numResults - 1)
+      f->selected = f->numResults > 0 ? f->numResults - 1 : 0;
+    break;
+
+  case CTRL_KEY('r'):
+    editorIndexFree(f->index);
+    f->index = NULL;
+    f->visible = 0;
+    editorFinderToggle();
+    break;
+
+  case BACKSPACE:
+  case DEL_KEY:
+  case CTRL_KEY('h'):
+    if (f->queryLen > 0) {
+      f->query[--f->queryLen] = '\0';
+      editorFinderSetQuery(0);
+    }
+    break;
+
+  default:
+    if (key > 0 && key < 128 && !iscntrl(key) &&
+        f->queryLen < (int)sizeof(f->query) - 1) {
+      f->query[f->queryLen++] = tolower(key);
+      f->query[f->queryLen] = '\0';
+      editorFinderSetQuery(1);
+    }
+    break;
+  }
+}
+
+char *editorGrepCopy(grepScan *gs, int worker, const char *s, size_t len) {
+  grepWorker *gw = &gs->workers[worker];
+  if (!gw->arena || gw->arenaUsed + len + 1 > DIR_NAME_ARENA) {
+    gw->arena = malloc(DIR_NAME_ARENA);
+    gw->arenaUsed = 0;
+    pthread_mutex_lock(&gs->lock);
+    gs->arenas = realloc(gs->arenas, sizeof(char *) * (gs->numArenas + 1));
+    gs->arenas[gs->numArenas++] = gw->arena;
+    pthread_mutex_unlock(&gs->lock);
+  }
+  char *copy = gw->arena + gw->arenaUsed;
+  memcpy(copy, s, len);
+  copy[len] = '\0';
+  gw->arenaUsed += len + 1;
+  return copy;
+}
+
+/* Searches one file on a walker thread. The file is mapped, skipped when it
+ * looks binary, and searched a chunk at a time so a cancelled scan stops
+ * promptly even inside a large file. */
+void editorGrepVisit(fileWalker *w, int worker, const char *path, size_t len) {
+  grepScan *gs = w->arg;
+  grepWorker *gw = &gs->workers[worker];
+
+  int fd = openat(w->rootFd, path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+    return;
+  struct stat st;
+  if (fstat(fd, &st) == -1 || st.st_size == 0) {
+    close(fd);
+    return;
+  }
+  size_t size = st.st_size;
+  char *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED)
+    return;
+  madvise(data, size, MADV_SEQUENTIAL);
+  __atomic_add_fetch(&gs->filesScanned, 1, __ATOMIC_RELAXED);
+
+  char *pathCopy = NULL;
+  size_t pos = 0, counted = 0;
+  int line = 1;
+  if (memchr(data, '\0', size < 8192 ? size : 8192))
+    pos = size;
+
+  while (pos < size && !__atomic_load_n(&w->cancel, __ATOMIC_RELAXED)) {
+    /* Chunks overlap by queryLen - 1 bytes so no match straddles a gap. */
+    size_t chunk = size - pos;
+    if (chunk > GREP_CHUNK + (size_t)gs->queryLen - 1)
+      chunk = GREP_CHUNK + gs->queryLen - 1;
+    const char *hit =
+        editorMemSearch(data + pos, chunk, gs->query, gs->queryLen);
+    if (!hit) {
+      pos = pos + chunk == size ? size : pos + GREP_CHUNK;
+      continue;
+    }
+
+    size_t off = hit - data;
+    for (const char *p = data + counted;
+         (p = memchr(p, '\n', data + off - p)) != NULL; p++)
+      line++;
+    const char *start = memrchr(data, '\n', off);
+    start = start ? start + 1 : data;
+    const char *end = memchr(hit, '\n', size - off);
+    if (!end)
+      end = data + size;
+
+    if (!pathCopy)
+      pathCopy = editorGrepCopy(gs, worker, path, len);
+    size_t textLen = end - start;
+    if (textLen > GREP_LINE_MAX)
+      textLen = GREP_LINE_MAX;
+    char *text = editorGrepCopy(gs, worker, start, textLen);
+    for (size_t i = 0; i < textLen; i++)
+      if (iscntrl((unsigned char)text[i]))
+        text[i] = ' ';
+
+    if (!gw->batch)
+      gw->batch = malloc(sizeof(grepHit) * WALK_BATCH);
+    gw->batch[gw->numBatch].path = pathCopy;
+    gw->batch[gw->numBatch].line = line;
+    gw->batch[gw->numBatch].col = off - (start - data);
+    gw->batch[gw->numBatch].offset = off;
+    gw->batch[gw->numBatch].text = text;
+    if (++gw->numBatch == WALK_BATCH)
+      editorGrepFlush(w, worker);
+
+    if (__atomic_add_fetch(&gs->numHits, 1, __ATOMIC_RELAXED) >=
+        GREP_MAX_HITS) {
+      __atomic_store_n(&w->cancel, 1, __ATOMIC_RELAXED);
+      gs->truncated = 1;
+    }
+    pos = end - data + 1;
+    counted = pos;
+    line++;
+  }
+  munmap(data, size);
+
+  /* Flush per file so hits stream in while the walk is still running. */
+  if (gw->numBatch > 0)
+    editorGrepFlush(w, worker);
+}
+
+void editorGrepFlush(fileWalker *w, int worker) {
+  grepScan *gs = w->arg;
+  grepWorker *gw = &gs->workers[worker];
+  if (gw->numBatch == 0)
+    return;
+
+  pthread_mutex_lock(&gs->lock);
+  if (gs->numPublished + gw->numBatch > gs->capPublished) {
+    gs->capPublished = (gs->numPublished + gw->numBatch) * 2;
+    gs->published =
+        realloc(gs->published, sizeof(grepHit) * gs->capPublished);
+  }
+  memcpy(&gs->published[gs->numPublished], gw->batch,
+         sizeof(grepHit) * gw->numBatch);
+  gs->numPublished += gw->numBatch;
+  pthread_mutex_unlock(&gs->lock);
+
+  gw->numBatch = 0;
+  editorWake();
+}
+
+grepScan *editorGrepStart(const char *root, const char *query) {
+  grepScan *gs = calloc(1, sizeof(grepScan));
+  snprintf(gs->root, sizeof(gs->root), "%s", root);
+  snprintf(gs->query, sizeof(gs->query), "%s", query);
+  gs->queryLen = strlen(gs->query);
+  pthread_mutex_init(&gs->lock, NULL);
+  gs->walker.visit = editorGrepVisit;
+  gs->walker.done = editorGrepFlush;
+  gs->walker.arg = gs;
+  if (editorWalkStart(&gs->walker, root) == -1) {
+    pthread_mutex_destroy(&gs->lock);
+    free(gs);
+    return NULL;
+  }
+  gs->walking = 1;
+  return gs;
+}
+
+void editorGrepFree(grepScan *gs) {
+  if (gs->walking) {
+    __atomic_store_n(&gs->walker.cancel, 1, __ATOMIC_RELAXED);
+    editorWalkJoin(&gs->walker);
+  }
+  for (int i = 0; i < WALK_MAX_THREADS; i++)
+    free(gs->workers[i].batch);
+  for (int i = 0; i < gs->numArenas; i++)
+    free(gs->arenas[i]);
+  free(gs->arenas);
+  free(gs->published);
+  pthread_mutex_destroy(&gs->lock);
+  free(gs);
+}
+
+/* Cancels any running scan and starts one for the current query. */
+void editorGrepRestart(void) {
+  grepPanel *g = &E.grep;
+  if (g->scan)
+    editorGrepFree(g->scan);
+  g->scan = NULL;
+  g->numHits = 0;
+  g->selected = 0;
+  g->scroll = 0;
+  if (g->queryLen == 0)
+    return;
+
+  g->scan = editorGrepStart(g->root, g->query);
+  if (!g->scan)
+    editorSetStatusMessage("Cannot search %.60s", g->root);
+}
+
+void editorGrepSync(void) {
+  grepPanel *g = &E.grep;
+  grepScan *gs = g->scan;
+  if (!gs)
+    return;
+
+  pthread_mutex_lock(&gs->lock);
+  if (gs->numPublished > 0) {
+    if (g->numHits + gs->numPublished > g->capHits) {
+      g->capHits = (g->numHits + gs->numPublished) * 2;
+      g->hits = realloc(g->hits, sizeof(grepHit) * g->capHits);
+    }
+    memcpy(&g->hits[g->numHits], gs->published,
+           sizeof(grepHit) * gs->numPublished);
+    g->numHits += gs->numPublished;
+    gs->numPublished = 0;
+  }
+  pthread_mutex_unlock(&gs->lock);
+
+  if (gs->walking &&
+      __atomic_load_n(&gs->walker.running, __ATOMIC_ACQUIRE) == 0) {
+    editorWalkJoin(&gs->walker);
+    gs->walking = 0;
+    editorSetStatusMessage("%d hit%s in %d files%s", g->numHits,
+                           g->numHits == 1 ? "" : "s", gs->filesScanned,
+                           gs->truncated ? " (limit reached)" : "");
+  }
+}
+
+void editorGrepToggle(void) {
+  grepPanel *g = &E.grep;
+  g->visible = !g->visible;
+  if (!g->visible)
+    return;
+
+  if (E.fb.currentDir[0])
+    snprintf(g->root, sizeof(g->root), "%s", E.fb.currentDir);
+  else if (!getcwd(g->root, sizeof(g->root)))
+    snprintf(g->root, sizeof(g->root), ".");
+  editorGrepRestart();
+}
+
+void editorGrepDraw(void) {
+  grepPanel *g = &E.grep;
+  if (!g->visible)
+    return;
+
+  abuf ab = ABUF_INIT;
+  char buf[64];
+  int len;
+
+  len = snprintf(buf, sizeof(buf), "\x1b[H\x1b[48;5;%dm\x1b[38;5;%dm",
+                 E.colors[COLOR_STATUS_BG], E.colors[COLOR_STATUS_FG]);
+  abAppend(&ab, buf, len);
+  char title[320];
+  int titleLen = snprintf(title, sizeof(title), " Grep: %s", g->query);
+  char count[64];
+  int countLen =
+      snprintf(count, sizeof(count), "%d hits%s ", g->numHits,
+               g->scan && g->scan->walking ? " searching..." : "");
+  if (titleLen > E.screencols)
+    titleLen = E.screencols;
+  abAppend(&ab, title, titleLen);
+  int pad = E.screencols - titleLen - countLen;
+  for (int i = 0; i < pad; i++)
+    abAppend(&ab, " ", 1);
+  if (pad >= 0)
+    abAppend(&ab, count, countLen);
+  abAppend(&ab, "\x1b[49m", 5);
+
+  int rows = E.screenrows - 1;
+  if (g->selected < g->scroll)
+    g->scroll = g->selected;
+  else if (g->selected >= g->scroll + rows)
+    g->scroll = g->selected - rows + 1;
+
+  for (int y = 0; y < rows; y++) {
+    int r = g->scroll + y;
+    len = snprintf(buf, sizeof(buf), "\x1b[%d;1H", y + 2);
+    abAppend(&ab, buf, len);
+    if (r < g->numHits) {
+      grepHit *hit = &g->hits[r];
+      char loc[1100];
+      int locLen = snprintf(loc, sizeof(loc), "%s%s:%d: ",
+                            r == g->selected ? "> " : "  ", hit->path,
+                            hit->line);
+      if (locLen > E.screencols)
+        locLen = E.screencols;
+      len = snprintf(buf, sizeof(buf), "\x1b[38;5;%dm",
+                     E.colors[r == g->selected ? COLOR_SELECTION
+                                               : COLOR_LINENUMBER]);
+      abAppend(&ab, buf, len);
+      abAppend(&ab, loc, locLen);
+      len = snprintf(buf, sizeof(buf), "\x1b[38;5;%dm",
+                     E.colors[COLOR_FOREGROUND]);
+      abAppend(&ab, buf, len);
+      int textLen = strlen(hit->text);
+      if (textLen > E.screencols - locLen)
+        textLen = E.screencols - locLen;
+      abAppend(&ab, hit->text, textLen);
+    }
+    abAppend(&ab, "\x1b[K", 3);
+  }
+
+  editorWrite(ab.b, ab.len);
+  abFree(&ab);
+}
+
+void editorGrepProcessKey(int key) {
+  grepPanel *g = &E.grep;
+
+  switch (key) {
+  case '\x1b':
+  case CTRL_KEY('a'):
+  case CTRL_KEY('q'):
+    g->visible = 0;
+    break;
+
+  case '\r':
+    if (g->selected < g->numHits) {
+      grepHit *hit = &g->hits[g->selected];
+      char path[2048];
+      snprintf(path, sizeof(path), "%s/%s", g->scan->root, hit->path);
+      if (E.dirty) {
+        editorSetStatusMessage(
+            "WARNING!!! File has unsaved changes. Save first!");
+        break;
+      }
+      g->visible = 0;
+      editorOpen(path);
+      /* The byte offset locates the hit directly wherever the buffer holds
+       * the file byte for byte; other files go by the line number. */
+      int row = hit->line - 1, col = hit->col;
+      if (E.diskCanonical)
+        row = editorOffsetToRow(hit->offset, &col);
+      if (row < E.numrows) {
+        E.cy = row;
+        E.cx = col <= E.row[E.cy].size ? col : 0;
+        E.rowoff = E.cy > E.screenrows / 2 ? E.cy - E.screenrows / 2 : 0;
+      }
+    }
+    break;
+
+  case ARROW_UP:
+    if (g->selected > 0)
+      g->selected--;
+    break;
+
+  case ARROW_DOWN:
+    if (g->selected < g->numHits - 1)
+      g->selected++;
+    break;
+
+  case PAGE_UP:
+    g->selected -= E.screenrows - 1;
+    if (g->selected < 0)
+      g->selected = 0;
+    break;
+
+  case PAGE_DOWN:
+    g->selected += E.screenrows - 1;
+    if (g->selected > g->numHits - 1)
+      g->selected = g->numHits > 0 ? g->numHits - 1 : 0;
+    break;
+
+  case BACKSPACE:
+  case DEL_KEY:
+  case CTRL_KEY('h'):
+    if (g->queryLen > 0) {
+      g->query[--g->queryLen] = '\0';
+      editorGrepRestart();
+    }
+    break;
+
+  default:
+    if (key > 0 && key < 128 && !iscntrl(key) &&
+        g->queryLen < (int)sizeof(g->query) - 1) {
+      g->query[g->queryLen++] = key;
+      g->query[g->queryLen] = '\0';
+      editorGrepRestart();
+    }
+    break;
+  }
+}
+
+int editorEncodeUtf8(unsigned int cp, char *out) {
+  if (cp < 0x80) {
+    out[0] = cp;
+    return 1;
+  } else if (cp < 0x800) {
+    out[0] = 0xC0 | (cp >> 6);
+    out[1] = 0x80 | (cp & 0x3F);
+    return 2;
+  } else if (cp < 0x10000) {
+    out[0] = 0xE0 | (cp >> 12);
+    out[1] = 0x80 | ((cp >> 6) & 0x3F);
+    out[2] = 0x80 | (cp & 0x3F);
+    return 3;
+  }
+  out[0] = 0xF0 | (cp >> 18);
+  out[1] = 0x80 | ((cp >> 12) & 0x3F);
+  out[2] = 0x80 | ((cp >> 6) & 0x3F);
+  out[3] = 0x80 | (cp & 0x3F);
+  return 4;
+}
+
+void editorGridInit(termGrid *g, int rows, int cols) {
+  memset(g, 0, sizeof(*g));
+  g->rows = rows > 0 ? rows : 1;
+  g->cols = cols > 0 ? cols : 1;
+  g->cells = editorAlloc(MEM_TERMINAL, sizeof(termCell) * g->rows * g->cols);
+  g->shown = editorAlloc(MEM_TERMINAL, sizeof(termCell) * g->rows * g->cols);
+  g->damage = editorAlloc(MEM_TERMINAL, g->rows);
+  g->pen.ch = ' ';
+  g->pen.fg = -1;
+  g->pen.bg = -1;
+  g->top = 0;
+  g->bottom = g->rows - 1;
+  g->state = TERM_STATE_GROUND;
+  for (int r = 0; r < g->rows; r++)
+    editorGridClear(g, r, 0, g->cols);
+  memcpy(g->shown, g->cells, sizeof(termCell) * g->rows * g->cols);
+}
+
+void editorGridFree(termGrid *g) {
+  editorRelease(g->cells);
+  editorRelease(g->shown);
+  editorRelease(g->damage);
+  g->cells = g->shown = NULL;
+  g->damage = NULL;
+}
+
+void editorGridClear(termGrid *g, int row, int from, int to) {
+  if (row < 0 || row >= g->rows)
+    return;
+  if (from < 0)
+    from = 0;
+  if (to > g->cols)
+    to = g->cols;
+  termCell *line = &g->cells[row * g->cols];
+  for (int c = from; c < to; c++) {
+    line[c] = g->pen;
+    line[c].ch = ' ';
+    line[c].attr &= ~TERM_ATTR_UNDERLINE;
+  }
+  g->damage[row] = 1;
+}
+
+/* Scrolls rows top..bottom up by n (down when n < 0). Rows leaving the top
+ * of the whole screen are kept as plain text in the job's scrollback. */
+void editorGridScroll(terminalJob *job, int top, int bottom, int n) {
+  termGrid *g = &job->grid;
+  int height = bottom - top + 1;
+  if (height <= 0 || n == 0)
+    return;
+
+  if (n > 0) {
+    if (n > height)
+      n = height;
+    if (top == 0) {
+      char *line = editorAlloc(MEM_TERMINAL, g->cols * 4 + 1);
+      for (int r = 0; r < n; r++) {
+        int len = 0;
+        termCell *cells = &g->cells[(top + r) * g->cols];
+        for (int c = 0; c < g->cols; c++) {
+          len += editorEncodeUtf8(cells[c].ch, &line[len]);
+        }
+        while (len > 0 && line[len - 1] == ' ')
+          len--;
+        line[len++] = '\n';
+        editorScrollbackAppend(&job->sb, line, len);
+      }
+      editorRelease(line);
+    }
+    memmove(&g->cells[top * g->cols], &g->cells[(top + n) * g->cols],
+            sizeof(termCell) * (height - n) * g->cols);
+    for (int r = bottom - n + 1; r <= bottom; r++)
+      editorGridClear(g, r, 0, g->cols);
+  } else {
+    n = -n;
+    if (n > height)
+      n = height;
+    memmove(&g->cells[(top + n) * g->cols], &g->cells[top * g->cols],
+            sizeof(termCell) * (height - n) * g->cols);
+    for (int r = top; r < top + n; r++)
+      editorGridClear(g, r, 0, g->cols);
+  }
+  memset(&g->damage[top], 1, height);
+}
+
+void editorGridNewline(terminalJob *job) {
+  termGrid *g = &job->grid;
+  g->wrapPending = 0;
+  if (g->cy == g->bottom)
+    editorGridScroll(job, g->top, g->bottom, 1);
+  else if (g->cy < g->rows - 1)
+    g->cy++;
+}
+
+void editorGridPut(terminalJob *job, unsigned int ch) {
+  termGrid *g = &job->grid;
+  if (g->wrapPending) {
+    g->cx = 0;
+    editorGridNewline(job);
+  }
+  termCell *cell = &g->cells[g->cy * g->cols + g->cx];
+  *cell = g->pen;
+  cell->ch = ch;
+  g->damage[g->cy] = 1;
+  if (g->cx == g->cols - 1)
+    g->wrapPending = 1;
+  else
+    g->cx++;
+}
+
+void editorGridCsi(terminalJob *job, int final) {
+  termGrid *g = &job->grid;
+  int *p = g->params;
+  int n = g->numParams;
+  int a = n > 0 && p[0] > 0 ? p[0] : 1;
+
+  if (g->priv)
+    return;
+
+  g->wrapPending = 0;
+  switch (final) {
+  case 'A':
+    g->cy -= a;
+    break;
+  case 'B':
+  case 'e':
+    g->cy += a;
+    break;
+  case 'C':
+  case 'a':
+    g->cx += a;
+    break;
+  case 'D':
+    g->cx -= a;
+    break;
+  case 'E':
+    g->cy += a;
+    g->cx = 0;
+    break;
+  case 'F':
+    g->cy -= a;
+    g->cx = 0;
+    break;
+  case 'G':
+  case '`':
+    g->cx = a - 1;
+    break;
+  case 'd':
+    g->cy = a - 1;
+    break;
+  case 'H':
+  case 'f':
+    g->cy = a - 1;
+    g->cx = (n > 1 && p[1] > 0 ? p[1] : 1) - 1;
+    break;
+  case 'J': {
+    int mode = n > 0 ? p[0] : 0;
+    if (mode == 0) {
+      editorGridClear(g, g->cy, g->cx, g->cols);
+      for (int r = g->cy + 1; r < g->rows; r++)
+        editorGridClear(g, r, 0, g->cols);
+    } else if (mode == 1) {
+      for (int r = 0; r < g->cy; r++)
+        editorGridClear(g, r, 0, g->cols);
+      editorGridClear(g, g->cy, 0, g->cx + 1);
+    } else {
+      for (int r = 0; r < g->rows; r++)
+        editorGridClear(g, r, 0, g->cols);
+    }
+  } break;
+  case 'K': {
+    int mode = n > 0 ? p[0] : 0;
+    if (mode == 0)
+      editorGridClear(g, g->cy, g->cx, g->cols);
+    else if (mode == 1)
+      editorGridClear(g, g->cy, 0, g->cx + 1);
+    else
+      editorGridClear(g, g->cy, 0, g->cols);
+  } break;
+  case 'X':
+    editorGridClear(g, g->cy, g->cx, g->cx + a);
+    break;
+  case 'P':
+  case '@': {
+    termCell *line = &g->cells[g->cy * g->cols];
+    if (a > g->cols - g->cx)
+      a = g->cols - g->cx;
+    if (final == 'P') {
+      memmove(&line[g->cx], &line[g->cx + a],
+              sizeof(termCell) * (g->cols - g->cx - a));
+      editorGridClear(g, g->cy, g->cols - a, g->cols);
+    } else {
+      memmove(&line[g->cx + a], &line[g->cx],
+              sizeof(termCell) * (g->cols - g->cx - a));
+      editorGridClear(g, g->cy, g->cx, g->cx + a);
+    }
+  } break;
+  case 'L':
+  case 'M':
+    if (g->cy >= g->top && g->cy <= g->bottom)
+      editorGridScroll(job, g->cy, g->bottom, final == 'L' ? -a : a);
+    break;
+  case 'S':
+    editorGridScroll(job, g->top, g->bottom, a);
+    break;
+  case 'T':
+    editorGridScroll(job, g->top, g->bottom, -a);
+    break;
+  case 'r': {
+    int top = (n > 0 && p[0] > 0 ? p[0] : 1) - 1;
+    int bottom = (n > 1 && p[1] > 0 ? p[1] : g->rows) - 1;
+    if (top < bottom && bottom < g->rows) {
+      g->top = top;
+      g->bottom = bottom;
+      g->cx = 0;
+      g->cy = 0;
+    }
+  } break;
+  case 's':
+    g->savedCx = g->cx;
+    g->savedCy = g->cy;
+    break;
+  case 'u':
+    g->cx = g->savedCx;
+    g->cy = g->savedCy;
+    break;
+  case 'm':
+    if (n == 0)
+      n = 1;
+    for (int i = 0; i < n; i++) {
+      int v = p[i];
+      if (v == 0) {
+        g->pen.fg = g->pen.bg = -1;
+        g->pen.attr = 0;
+      } else if (v == 1) {
+        g->pen.attr |= TERM_ATTR_BOLD;
+      } else if (v == 4) {
+        g->pen.attr |= TERM_ATTR_UNDERLINE;
+      } else if (v == 7) {
+        g->pen.attr |= TERM_ATTR_REVERSE;
+      } else if (v == 22) {
+        g->pen.attr &= ~TERM_ATTR_BOLD;
+      } else if (v == 24) {
+        g->pen.attr &= ~TERM_ATTR_UNDERLINE;
+      } else if (v == 27) {
+        g->pen.attr &= ~TERM_ATTR_REVERSE;
+      } else if (v >= 30 && v <= 37) {
+        g->pen.fg = v - 30;
+      } else if (v == 39) {
+        g->pen.fg = -1;
+      } else if (v >= 40 && v <= 47) {
+        g->pen.bg = v - 40;
+      } else if (v == 49) {
+        g->pen.bg = -1;
+      } else if (v >= 90 && v <= 97) {
+        g->pen.fg = v - 90 + 8;
+      } else if (v >= 100 && v <= 107) {
+        g->pen.bg = v - 100 + 8;
+      } else if ((v == 38 || v == 48) && i + 2 < n && p[i + 1] == 5) {
+        if (v == 38)
+          g->pen.fg = p[i + 2] & 0xFF;
+        else
+          g->pen.bg = p[i + 2] & 0xFF;
+        i += 2;
+      } else if ((v == 38 || v == 48) && i + 4 < n && p[i + 1] == 2) {
+        int idx = 16 + 36 * (p[i + 2] * 6 / 256) + 6 * (p[i + 3] * 6 / 256) +
+                  p[i + 4] * 6 / 256;
+        if (v == 38)
+          g->pen.fg = idx;
+        else
+          g->pen.bg = idx;
+        i += 4;
+      }
+    }
+    break;
+  }
+
+  if (g->cx < 0)
+    g->cx = 0;
+  if (g->cx >= g->cols)
+    g->cx = g->cols - 1;
+  if (g->cy < 0)
+    g->cy = 0;
+  if (g->cy >= g->rows)
+    g->cy = g->rows - 1;
+}
+
+void editorGridFeed(terminalJob *job, const char *s, size_t len) {
+  termGrid *g = &job->grid;
+
+  for (size_t i = 0; i < len; i++) {
+    unsigned char c = s[i];
+
+    switch (g->state) {
+    case TERM_STATE_ESC:
+      g->state = TERM_STATE_GROUND;
+      if (c == '[') {
+        g->state = TERM_STATE_CSI;
+        g->numParams = 0;
+        g->priv = 0;
+        memset(g->params, 0, sizeof(g->params));
+      } else if (c == ']') {
+        g->state = TERM_STATE_OSC;
+      } else if (c == '(' || c == ')') {
+        g->state = TERM_STATE_CHARSET;
+      } else if (c == '7') {
+        g->savedCx = g->cx;
+        g->savedCy = g->cy;
+      } else if (c == '8') {
+        g->cx = g->savedCx;
+        g->cy = g->savedCy;
+      } else if (c == 'D') {
+        editorGridNewline(job);
+      } else if (c == 'E') {
+        g->cx = 0;
+        editorGridNewline(job);
+      } else if (c == 'M') {
+        if (g->cy == g->top)
+          editorGridScroll(job, g->top, g->bottom, -1);
+        else if (g->cy > 0)
+          g->cy--;
+      } else if (c == 'c') {
+        int rows = g->rows, cols = g->cols;
+        editorGridFree(g);
+        editorGridInit(g, rows, cols);
+        memset(g->damage, 1, g->rows);
+      }
+      continue;
+
+    case TERM_STATE_CSI:
+      if (c >= '0' && c <= '9') {
+        if (g->numParams == 0)
+          g->numParams = 1;
+        int *v = &g->params[g->numParams - 1];
+        if (*v < 10000)
+          *v = *v * 10 + (c - '0');
+      } else if (c == ';' || c == ':') {
+        if (g->numParams == 0)
+          g->numParams = 1;
+        if (g->numParams < TERM_MAX_PARAMS)
+          g->numParams++;
+      } else if (c == '?' || c == '>' || c == '<' || c == '=') {
+        g->priv = 1;
+      } else if (c >= 0x40 && c <= 0x7E) {
+        editorGridCsi(job, c);
+        g->state = TERM_STATE_GROUND;
+      } else if (c == 0x18 || c == 0x1A) {
+        g->state = TERM_STATE_GROUND;
+      }
+      continue;
+
+    case TERM_STATE_OSC:
+      if (c == '\a')
+        g->state = TERM_STATE_GROUND;
+      else if (c == 0x1b)
+        g->state = TERM_STATE_OSC_ESC;
+      continue;
+
+    case TERM_STATE_OSC_ESC:
+      g->state = c == '\\' ? TERM_STATE_GROUND : TERM_STATE_OSC;
+      continue;
+
+    case TERM_STATE_CHARSET:
+      g->state = TERM_STATE_GROUND;
+      continue;
+
+    case TERM_STATE_GROUND:
+      break;
+    }
+
+    if (g->utf8Need > 0) {
+      if ((c & 0xC0) == 0x80) {
+        g->utf8 = (g->utf8 << 6) | (c & 0x3F);
+        if (--g->utf8Need == 0)
+          editorGridPut(job, g->utf8);
+        continue;
+      }
+      g->utf8Need = 0;
+      editorGridPut(job, 0xFFFD);
+    }
+
+    if (c >= 0x80) {
+      if ((c & 0xE0) == 0xC0) {
+        g->utf8 = c & 0x1F;
+        g->utf8Need = 1;
+      } else if ((c & 0xF0) == 0xE0) {
+        g->utf8 = c & 0x0F;
+        g->utf8Need = 2;
+      } else if ((c & 0xF8) == 0xF0) {
+        g->utf8 = c & 0x07;
+        g->utf8Need = 3;
       } else {
-        char filePath[1024];
-        if (E.fb.currentDir[strlen(E.fb.currentDir) - 1] != '/') {
-          snprintf(filePath, sizeof(filePath), "%s/%s", E.fb.currentDir,
-                   entry->name);
-        } else {
-          snprintf(filePath, sizeof(filePath), "%s%s", E.fb.currentDir,
-                   entry->name);
-        }
+        editorGridPut(job, 0xFFFD);
+      }
+      continue;
+    }
 
-        if (E.dirty) {
-          editorSetStatusMessage(
-              "WARNING!!! File has unsaved changes. Save first!");
+    switch (c) {
+    case 0x1b:
+      g->state = TERM_STATE_ESC;
+      break;
+    case '\r':
+      g->cx = 0;
+      g->wrapPending = 0;
+      break;
+    case '\n':
+    case '\v':
+    case '\f':
+      editorGridNewline(job);
+      break;
+    case '\b':
+      if (g->cx > 0)
+        g->cx--;
+      g->wrapPending = 0;
+      break;
+    case '\t':
+      g->cx = (g->cx / 8 + 1) * 8;
+      if (g->cx >= g->cols)
+        g->cx = g->cols - 1;
+      break;
+    default:
+      if (c >= 0x20 && c != 0x7F)
+        editorGridPut(job, c);
+      break;
+    }
+  }
+}
+
+/* Compares field by field, since the padding in termCell is never
+ * initialized. */
+int editorGridCellEquals(const termCell *a, const termCell *b) {
+  return a->ch == b->ch && a->fg == b->fg && a->bg == b->bg &&
+         a->attr == b->attr;
+}
+
+void editorGridDrawRow(termGrid *g, abuf *ab, int r, int screenRow, int full,
+                       int cursor) {
+  termCell *cells = &g->cells[r * g->cols];
+  termCell *shown = &g->shown[r * g->cols];
+  termCell pen = {0, -2, -2, 0xFF};
+  int at = -1;
+  char buf[64];
+
+  for (int c = 0; c < g->cols; c++) {
+    termCell cell = cells[c];
+    if (c == cursor)
+      cell.attr ^= TERM_ATTR_REVERSE;
+
+    if (!full && editorGridCellEquals(&cell, &shown[c]))
+      continue;
+    shown[c] = cell;
+
+    if (at != c) {
+      int len = snprintf(buf, sizeof(buf), "\x1b[%d;%dH", screenRow, c + 1);
+      abAppend(ab, buf, len);
+    }
+    if (cell.fg != pen.fg || cell.bg != pen.bg || cell.attr != pen.attr) {
+      int len = snprintf(buf, sizeof(buf), "\x1b[0%s%s%s;38;5;%d",
+                         cell.attr & TERM_ATTR_BOLD ? ";1" : "",
+                         cell.attr & TERM_ATTR_UNDERLINE ? ";4" : "",
+                         cell.attr & TERM_ATTR_REVERSE ? ";7" : "",
+                         cell.fg >= 0 ? cell.fg : E.colors[COLOR_FOREGROUND]);
+      abAppend(ab, buf, len);
+      if (cell.bg >= 0) {
+        len = snprintf(buf, sizeof(buf), ";48;5;%d", cell.bg);
+        abAppend(ab, buf, len);
+      }
+      abAppend(ab, "m", 1);
+      pen = cell;
+    }
+
+    char u[4];
+    abAppend(ab, u, editorEncodeUtf8(cell.ch, u));
+    at = c + 1;
+  }
+}
+
+void editorTerminalToggle(void) {
+  E.term.visible = !E.term.visible;
+  E.term.fullRedraw = 1;
+
+  if (E.term.visible && E.term.numJobs == 0)
+    editorSetStatusMessage("Terminal: Enter or Ctrl-N runs a command");
+}
+
+void editorScrollbackInit(termScrollback *sb, size_t cap) {
+  sb->data = editorAlloc(MEM_TERMINAL, cap);
+  sb->cap = cap;
+  sb->end = 0;
+  sb->linesCap = 64;
+  sb->lines = editorAlloc(MEM_TERMINAL, sizeof(*sb->lines) * sb->linesCap);
+  sb->lines[0] = 0;
+  sb->lineHead = 0;
+  sb->numLines = 1;
+}
+
+void editorScrollbackFree(termScrollback *sb) {
+  editorRelease(sb->data);
+  editorRelease(sb->lines);
+  sb->data = NULL;
+  sb->lines = NULL;
+  sb->numLines = 0;
+}
+
+void editorScrollbackPushLine(termScrollback *sb, unsigned long long start) {
+  if (sb->numLines == sb->linesCap) {
+    unsigned long long *lines =
+        editorAlloc(MEM_TERMINAL, sizeof(*lines) * sb->linesCap * 2);
+    for (int i = 0; i < sb->numLines; i++)
+      lines[i] = sb->lines[(sb->lineHead + i) % sb->linesCap];
+    editorRelease(sb->lines);
+    sb->lines = lines;
+    sb->lineHead = 0;
+    sb->linesCap *= 2;
+  }
+  sb->lines[(sb->lineHead + sb->numLines) % sb->linesCap] = start;
+  sb->numLines++;
+}
+
+void editorScrollbackAppend(termScrollback *sb, const char *s, size_t len) {
+  if (len > sb->cap) {
+    const char *nl = memrchr(s, '\n', len - sb->cap);
+    if (nl)
+      editorScrollbackPushLine(sb, sb->end + (nl - s) + 1);
+    sb->end += len - sb->cap;
+    s += len - sb->cap;
+    len = sb->cap;
+  }
+
+  size_t off = sb->end % sb->cap;
+  size_t first = sb->cap - off < len ? sb->cap - off : len;
+  memcpy(sb->data + off, s, first);
+  memcpy(sb->data, s + first, len - first);
+
+  const char *p = s;
+  const char *stop = s + len;
+  while ((p = memchr(p, '\n', stop - p)) != NULL) {
+    p++;
+    editorScrollbackPushLine(sb, sb->end + (p - s));
+  }
+  sb->end += len;
+
+  unsigned long long base = sb->end > sb->cap ? sb->end - sb->cap : 0;
+  while (sb->numLines > 1 &&
+         sb->lines[(sb->lineHead + 1) % sb->linesCap] <= base) {
+    sb->lineHead = (sb->lineHead + 1) % sb->linesCap;
+    sb->numLines--;
+  }
+}
+
+int editorScrollbackGetLine(termScrollback *sb, int idx, char *out, int max) {
+  if (idx < 0 || idx >= sb->numLines)
+    return 0;
+
+  unsigned long long base = sb->end > sb->cap ? sb->end - sb->cap : 0;
+  unsigned long long start = sb->lines[(sb->lineHead + idx) % sb->linesCap];
+  unsigned long long stop = sb->end;
+  if (idx + 1 < sb->numLines)
+    stop = sb->lines[(sb->lineHead + idx + 1) % sb->linesCap] - 1;
+  if (start < base)
+    start = base;
+
+  int len = 0;
+  for (unsigned long long i = start; i < stop && len < max; i++) {
+    char c = sb->data[i % sb->cap];
+    if (c != '\r')
+      out[len++] = c;
+  }
+  return len;
+}
+
+void editorTerminalCloseJob(int idx) {
+  if (idx < 0 || idx >= E.term.numJobs)
+    return;
+
+  terminalJob *job = &E.term.jobs[idx];
+  if (job->fd != -1)
+    close(job->fd);
+  if (job->pid > 0) {
+    kill(-job->pid, SIGKILL);
+    waitpid(job->pid, NULL, 0);
+  }
+  editorRelease(job->cmd);
+  editorScrollbackFree(&job->sb);
+  editorGridFree(&job->grid);
+
+  memmove(&E.term.jobs[idx], &E.term.jobs[idx + 1],
+          sizeof(terminalJob) * (E.term.numJobs - idx - 1));
+  E.term.numJobs--;
+  if (E.term.active >= E.term.numJobs)
+    E.term.active = E.term.numJobs - 1;
+  if (E.term.active < 0)
+    E.term.active = 0;
+  E.term.fullRedraw = 1;
+}
+
+void editorTerminalExecute(const char *cmd) {
+  if (E.term.numJobs == MAX_TERM_JOBS) {
+    int idx;
+    for (idx = 0; idx < E.term.numJobs; idx++)
+      if (E.term.jobs[idx].fd == -1 && E.term.jobs[idx].pid <= 0)
+        break;
+    if (idx == E.term.numJobs) {
+      editorSetStatusMessage("Too many running jobs");
+      return;
+    }
+    editorTerminalCloseJob(idx);
+  }
+
+  int master = posix_openpt(O_RDWR | O_NOCTTY);
+  if (master == -1 || grantpt(master) == -1 || unlockpt(master) == -1) {
+    editorSetStatusMessage("Failed to open pty: %s", strerror(errno));
+    if (master != -1)
+      close(master);
+    return;
+  }
+  char *slaveName = ptsname(master);
+  fcntl(master, F_SETFL, fcntl(master, F_GETFL) | O_NONBLOCK);
+  fcntl(master, F_SETFD, FD_CLOEXEC);
+
+  struct winsize ws;
+  memset(&ws, 0, sizeof(ws));
+  ws.ws_row = E.screenrows / 2 - 1;
+  ws.ws_col = E.screencols;
+
+  pid_t pid = fork();
+  if (pid < 0) {
+    editorSetStatusMessage("Fork failed");
+    close(master);
+    return;
+  } else if (pid == 0) {
+    setsid();
+    int slave = open(slaveName, O_RDWR);
+    if (slave == -1)
+      _exit(127);
+    ioctl(slave, TIOCSCTTY, 0);
+    ioctl(slave, TIOCSWINSZ, &ws);
+    dup2(slave, STDIN_FILENO);
+    dup2(slave, STDOUT_FILENO);
+    dup2(slave, STDERR_FILENO);
+    if (slave > STDERR_FILENO)
+      close(slave);
+    setenv("TERM", "vt100", 1);
+    execl("/bin/sh", "sh", "-c", cmd, (char *)NULL);
+    _exit(127);
+  }
+
+  terminalJob *job = &E.term.jobs[E.term.numJobs];
+  job->cmd = editorStrdup(MEM_TERMINAL, cmd);
+  job->pid = pid;
+  job->fd = master;
+  job->status = 0;
+  job->scroll = 0;
+  editorScrollbackInit(&job->sb, E.term.size);
+  editorGridInit(&job->grid, ws.ws_row, ws.ws_col);
+
+  E.term.active = E.term.numJobs++;
+  E.term.visible = 1;
+  E.term.fullRedraw = 1;
+  editorSetStatusMessage("Started job %d: %s", E.term.active + 1, cmd);
+}
+
+int editorTerminalPollFds(struct pollfd *fds) {
+  int n = 0;
+  for (int i = 0; i < E.term.numJobs; i++) {
+    if (E.term.jobs[i].fd == -1)
+      continue;
+    fds[n].fd = E.term.jobs[i].fd;
+    fds[n].events = POLLIN;
+    fds[n].revents = 0;
+    n++;
+  }
+  return n;
+}
+
+int editorTerminalPollTimeout(void) {
+  for (int i = 0; i < E.term.numJobs; i++)
+    if (E.term.jobs[i].fd == -1 && E.term.jobs[i].pid > 0)
+      return 100;
+  return -1;
+}
+
+int editorTerminalHandlePoll(struct pollfd *fds, int nfds) {
+  int changed = 0;
+
+  for (int p = 0; p < nfds; p++) {
+    if (!fds[p].revents)
+      continue;
+
+    terminalJob *job = NULL;
+    for (int i = 0; i < E.term.numJobs; i++)
+      if (E.term.jobs[i].fd == fds[p].fd)
+        job = &E.term.jobs[i];
+    if (!job)
+      continue;
+
+    char buffer[4096];
+    ssize_t n;
+    while ((n = read(job->fd, buffer, sizeof(buffer))) > 0) {
+      editorGridFeed(job, buffer, n);
+      changed = 1;
+    }
+    if (n == 0 || (n == -1 && errno != EAGAIN && errno != EINTR)) {
+      close(job->fd);
+      job->fd = -1;
+      changed = 1;
+    }
+  }
+
+  for (int i = 0; i < E.term.numJobs; i++) {
+    terminalJob *job = &E.term.jobs[i];
+    if (job->fd != -1 || job->pid <= 0)
+      continue;
+    if (waitpid(job->pid, &job->status, WNOHANG) == job->pid) {
+      job->pid = 0;
+      editorSetStatusMessage("Job %d finished (exit %d): %s", i + 1,
+                             WIFEXITED(job->status) ? WEXITSTATUS(job->status)
+                                                    : 128 + WTERMSIG(job->status),
+                             job->cmd);
+      changed = 1;
+    }
+  }
+
+  return changed;
+}
+
+void editorTerminalDraw(void) {
+  if (!E.term.visible)
+    return;
+
+  int height = E.screenrows / 2;
+  int startRow = E.screenrows - height;
+  int full = E.term.fullRedraw || E.fb.visible;
+  E.term.fullRedraw = 0;
+
+  abuf ab = ABUF_INIT;
+  char buf[32];
+  int len = snprintf(buf, sizeof(buf), "\x1b[%d;%dH\x1b[0;7m", startRow + 1, 1);
+  abAppend(&ab, buf, len);
+
+  char title[256];
+  int titleLen = snprintf(title, sizeof(title), " Terminal ");
+  for (int j = 0; j < E.term.numJobs && titleLen < (int)sizeof(title); j++) {
+    terminalJob *job = &E.term.jobs[j];
+    titleLen += snprintf(title + titleLen, sizeof(title) - titleLen,
+                         "%s%d:%.12s%s%s", j == E.term.active ? "[" : " ",
+                         j + 1, job->cmd,
+                         job->fd != -1 || job->pid > 0 ? "*" : "",
+                         j == E.term.active ? "]" : " ");
+  }
+  if (titleLen >= (int)sizeof(title))
+    titleLen = sizeof(title) - 1;
+  if (titleLen > E.screencols)
+    titleLen = E.screencols;
+  abAppend(&ab, title, titleLen);
+  for (int i = titleLen; i < E.screencols; i++)
+    abAppend(&ab, " ", 1);
+  abAppend(&ab, "\x1b[0m", 4);
+
+  if (E.term.numJobs == 0) {
+    for (int y = 1; full && y < height; y++) {
+      len = snprintf(buf, sizeof(buf), "\x1b[%d;1H\x1b[K", startRow + y + 1);
+      abAppend(&ab, buf, len);
+    }
+  } else {
+    terminalJob *job = &E.term.jobs[E.term.active];
+    termGrid *g = &job->grid;
+    int sbLines = job->sb.numLines - 1;
+    if (job->scroll > sbLines)
+      job->scroll = sbLines;
+
+    if (job->scroll > 0) {
+      int top = sbLines - job->scroll;
+      char *line = editorAlloc(MEM_TERMINAL, E.screencols);
+      for (int y = 0; y < g->rows && y < height - 1; y++) {
+        int screenRow = startRow + y + 2;
+        len = snprintf(buf, sizeof(buf), "\x1b[%d;1H\x1b[K", screenRow);
+        abAppend(&ab, buf, len);
+        if (top + y < sbLines) {
+          len = editorScrollbackGetLine(&job->sb, top + y, line, E.screencols);
+          abAppend(&ab, line, len);
         } else {
-          editorOpen(filePath);
-          editorFileBrowserToggle();
+          editorGridDrawRow(g, &ab, top + y - sbLines, screenRow, 1, -1);
+          abAppend(&ab, "\x1b[0m", 4);
         }
       }
+      editorRelease(line);
+      E.term.fullRedraw = 1;
+    } else {
+      int cursor = job->fd != -1 ? g->cx : -1;
+      for (int r = 0; r < g->rows && r < height - 1; r++) {
+        if (full || g->damage[r] || r == g->cy || r == g->shownCy)
+          editorGridDrawRow(g, &ab, r, startRow + r + 2, full,
+                            r == g->cy ? cursor : -1);
+        g->damage[r] = 0;
+      }
+      g->shownCy = g->cy;
     }
-    break;
+  }
 
-  case CTRL_KEY('h'):
-    strcpy(E.fb.currentDir, getenv("HOME"));
-    editorFileBrowserUpdate();
-    E.fb.selected = 0;
-    E.fb.scroll = 0;
+  abAppend(&ab, "\x1b[0m", 4);
+  editorWrite(ab.b, ab.len);
+  abFree(&ab);
+  resetColor();
+}
+
+void editorTerminalProcessKey(int key) {
+  terminalJob *job =
+      E.term.numJobs > 0 ? &E.term.jobs[E.term.active] : NULL;
+
+  switch (key) {
+  case CTRL_KEY('t'):
+    editorTerminalToggle();
+    return;
+
+  case CTRL_KEY('n'): {
+    char *cmd = editorPrompt("Command: %s (ESC to cancel)", NULL);
+    if (cmd) {
+      editorTerminalExecute(cmd);
+      free(cmd);
+    }
+    return;
+  }
+
+  case CTRL_KEY('k'):
+    editorTerminalCloseJob(E.term.active);
+    return;
+
+  case CTRL_KEY('o'):
+    if (E.term.numJobs > 0)
+      E.term.active = (E.term.active + 1) % E.term.numJobs;
+    E.term.fullRedraw = 1;
+    return;
+
+  case PAGE_UP:
+    if (job)
+      job->scroll += E.screenrows / 2 - 1;
+    return;
+
+  case PAGE_DOWN:
+    if (job) {
+      job->scroll -= E.screenrows / 2 - 1;
+      if (job->scroll < 0)
+        job->scroll = 0;
+    }
+    E.term.fullRedraw = 1;
+    return;
+  }
+
+  if (!job || job->fd == -1) {
+    if (key == '\r')
+      editorTerminalProcessKey(CTRL_KEY('n'));
+    return;
+  }
+
+  const char *seq = NULL;
+  switch (key) {
+  case ARROW_UP:
+    seq = "\x1b[A";
+    break;
+  case ARROW_DOWN:
+    seq = "\x1b[B";
+    break;
+  case ARROW_RIGHT:
+    seq = "\x1b[C";
+    break;
+  case ARROW_LEFT:
+    seq = "\x1b[D";
+    break;
+  case HOME_KEY:
+    seq = "\x1b[H";
     break;
+  case END_KEY:
+    seq = "\x1b[F";
+    break;
+  case DEL_KEY:
+    seq = "\x1b[3~";
+    break;
+  }
+
+  if (seq) {
+    write(job->fd, seq, strlen(seq));
+  } else if (key < 256) {
+    char c = key;
+    write(job->fd, &c, 1);
+  }
+}
+
+/* Soft wrap splits each row's render into screen lines of the text width.
+ * E.wrapLines sums the screen lines of every row, so a screen line maps to
+ * its row in O(log n); E.rowoff and E.wrapoff name the first line on
+ * screen. Without wrap each row is one line, and rows in a closed fold are
+ * none in either mode. */
+int editorWrapWidth(void) {
+  int width = E.screencols - (E.showLineNumbers ? 4 : 0);
+  return width > 0 ? width : 1;
+}
+
+/* End of the screen line starting at render byte start. A line breaks
+ * before a character that would cross the right edge, but always holds at
+ * least one character. */
+int editorWrapNext(erow *row, int start) {
+  int end = editorRowColEnd(row, editorRowCol(row, start) + E.wrapWidth);
+  if (end <= start && start < row->rsize) {
+    end = start + 1;
+    while (end < row->rsize && editorUtf8IsCont(row->render[end]))
+      end++;
+  }
+  return end;
+}
+
+/* Render byte where screen line sub of a row starts. */
+int editorWrapLine(erow *row, int sub) {
+  if (!row->cols)
+    return sub * E.wrapWidth < row->rsize ? sub * E.wrapWidth : row->rsize;
+  int start = 0;
+  while (sub-- > 0 && start < row->rsize)
+    start = editorWrapNext(row, start);
+  return start;
+}
+
+/* Screen line of a row that holds display column rx, and where it starts.
+ * The end of a row stays on its last line. */
+int editorWrapLineOf(erow *row, int rx, int *start) {
+  if (!row->cols) {
+    int sub = rx / E.wrapWidth;
+    int last = row->rsize > 0 ? (row->rsize - 1) / E.wrapWidth : 0;
+    if (sub > last)
+      sub = last;
+    *start = sub * E.wrapWidth;
+    return sub;
+  }
+  int sub = 0, next;
+  *start = 0;
+  while ((next = editorWrapNext(row, *start)) < row->rsize &&
+         row->cols[next] <= rx) {
+    *start = next;
+    sub++;
   }
+  return sub;
 }
 
-void editorTerminalToggle(void) {
-  E.term.visible = !E.term.visible;
-
-  if (E.term.visible && E.term.buffer == NULL) {
-    E.term.size = E.screencols * (E.screenrows / 2);
-    E.term.buffer = malloc(E.term.size);
-    memset(E.term.buffer, 0, E.term.size);
+long long editorRowHeight(int at) {
+  erow *row = &E.row[at];
+  if (row->hidden || !E.softWrap)
+    return !row->hidden;
+  if (row->render ? !row->cols : editorIsAscii(row->chars, row->size)) {
+    int width = row->render ? row->rsize : editorRowCxToRx(row, row->size);
+    return width > 0 ? (width + E.wrapWidth - 1) / E.wrapWidth : 1;
   }
+  int evicted = !row->render;
+  if (evicted)
+    editorRowRender(row);
+  long long lines = 1;
+  for (int start = editorWrapNext(row, 0); start < row->rsize;
+       start = editorWrapNext(row, start))
+    lines++;
+  if (evicted)
+    editorRowEvict(row);
+  return lines;
 }
 
-void editorTerminalExecute(const char *cmd) {
-  int pipefd[2];
-  if (pipe(pipefd) == -1) {
-    editorSetStatusMessage("Failed to create pipe");
-    return;
+/* Re-measures edited rows, or every row once the text width changed. */
+void editorWrapSync(void) {
+  if (E.softWrap && E.wrapWidth != editorWrapWidth()) {
+    E.wrapWidth = editorWrapWidth();
+    E.wrapLines.stale = 0;
   }
+  editorRowIndexSync(&E.wrapLines, editorRowHeight);
+}
 
-  pid_t pid = fork();
-  if (pid < 0) {
-    editorSetStatusMessage("Fork failed");
-    close(pipefd[0]);
-    close(pipefd[1]);
-    return;
-  } else if (pid == 0) {
-    close(pipefd[0]);
-    dup2(pipefd[1], STDOUT_FILENO);
-    dup2(pipefd[1], STDERR_FILENO);
-    close(pipefd[1]);
-    execl("/bin/sh", "sh", "-c", cmd, NULL);
-    exit(1);
-  } else {
-    close(pipefd[1]);
-    ssize_t n;
-    char buffer[1024];
-    size_t total = 0;
-
-    while ((n = read(pipefd[0], buffer, sizeof(buffer))) > 0) {
-      if (total + n >= E.term.size) {
-        memmove(E.term.buffer, E.term.buffer + n, E.term.size - n);
-        memcpy(E.term.buffer + (E.term.size - n), buffer, n);
-      } else {
-        memcpy(E.term.buffer + total, buffer, n);
-        total += n;
-      }
-    }
-
-    if (total < E.term.size) {
-      E.term.buffer[total] = '\0';
-    } else {
-      E.term.buffer[E.term.size - 1] = '\0';
-    }
-
-    close(pipefd[0]);
-    int status;
-    waitpid(pid, &status, 0);
-    editorSetStatusMessage("Command executed: %s", cmd);
+/* Screen line of the cursor counted from the top of the file, and its
+ * column within that line. */
+long long editorWrapCursorLine(int *col) {
+  editorWrapSync();
+  long long line = editorRowIndexPrefix(&E.wrapLines, E.cy);
+  *col = E.rx;
+  if (E.cy < E.numrows && E.softWrap) {
+    erow *row = editorRowPrepare(E.cy);
+    int start;
+    line += editorWrapLineOf(row, E.rx, &start);
+    *col = E.rx - editorRowCol(row, start);
   }
+  return line;
 }
 
-void editorTerminalDraw(void) {
-  if (!E.term.visible || E.term.buffer == NULL)
-    return;
-
-  int height = E.screenrows / 2;
-  int startRow = E.screenrows - height;
+long long editorWrapTop(void) {
+  editorWrapSync();
+  if (E.rowoff > E.numrows)
+    E.rowoff = E.numrows;
+  return editorRowIndexPrefix(&E.wrapLines, E.rowoff) + E.wrapoff;
+}
 
-  char buf[32];
+void editorWrapSetTop(long long line) {
+  long long rest;
+  E.rowoff = editorRowIndexFind(&E.wrapLines, line, &rest);
+  E.wrapoff = rest;
+}
 
-  for (int y = 0; y < height; y++) {
-    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", startRow + y + 1, 1);
-    write(STDOUT_FILENO, buf, strlen(buf));
+/* Puts the cursor at the start of a screen line. */
+void editorWrapSetCursor(long long line) {
+  long long sub;
+  E.cy = editorRowIndexFind(&E.wrapLines, line, &sub);
+  E.cx = 0;
+  if (E.cy < E.numrows) {
+    erow *row = editorRowPrepare(E.cy);
+    E.cx = editorRowRxToCx(row, editorRowCol(row, editorWrapLine(row, sub)));
+  }
+}
 
-    setColor(COLOR_BACKGROUND);
+/* Moves the cursor one screen line up or down, keeping its column within
+ * the line. */
+void editorWrapMoveCursor(int key) {
+  editorWrapSync();
+  int sub = 0, col = 0;
+  if (E.cy < E.numrows) {
+    erow *row = editorRowPrepare(E.cy);
+    int rx = editorRowCxToRx(row, E.cx), start;
+    sub = editorWrapLineOf(row, rx, &start);
+    col = rx - editorRowCol(row, start);
+  }
 
-    for (int i = 0; i < E.screencols; i++) {
-      write(STDOUT_FILENO, " ", 1);
+  if (key == ARROW_UP) {
+    if (sub > 0) {
+      sub--;
+    } else if (E.cy > 0) {
+      E.cy = editorPrevVisibleRow(E.cy);
+      sub = editorRowHeight(E.cy) - 1;
+    }
+  } else if (E.cy < E.numrows) {
+    if (sub < editorRowHeight(E.cy) - 1) {
+      sub++;
+    } else {
+      E.cy = editorNextVisibleRow(E.cy);
+      sub = 0;
     }
   }
-
-  snprintf(buf, sizeof(buf), "\x1b[%d;%dH", startRow + 1, 1);
-  write(STDOUT_FILENO, buf, strlen(buf));
-  setColor(COLOR_STATUS_BG);
-
-  char title[80] = " Terminal ";
-  int titleLen = strlen(title);
-  write(STDOUT_FILENO, title, titleLen);
-  for (int i = titleLen; i < E.screencols; i++) {
-    write(STDOUT_FILENO, " ", 1);
+  E.cx = 0;
+  if (E.cy < E.numrows) {
+    /* Lines holding wide characters can end short of the text width. */
+    erow *row = editorRowPrepare(E.cy);
+    int start = editorWrapLine(row, sub), next = editorWrapNext(row, start);
+    int rx = editorRowCol(row, start) + col;
+    if (next < row->rsize && rx >= editorRowCol(row, next))
+      rx = editorRowCol(row, next) - 1;
+    E.cx = editorRowRxToCx(row, rx);
   }
+}
 
-  setColor(COLOR_FOREGROUND);
-
-  int bufferLen = strlen(E.term.buffer);
-
-  int linesNeeded = height - 2;
-  int lineCount = 0;
-  int startPos = bufferLen;
+void editorWrapToggle(void) {
+  E.softWrap = !E.softWrap;
+  E.wrapLines.stale = 0;
+  E.wrapoff = 0;
+  E.coloff = 0;
+  editorSetStatusMessage("Soft wrap %s", E.softWrap ? "on" : "off");
+}
 
-  for (int i = bufferLen - 1; i >= 0 && lineCount < linesNeeded; i--) {
-    if (E.term.buffer[i] == '\n') {
-      lineCount++;
-      if (lineCount >= linesNeeded) {
-        startPos = i + 1;
-        break;
-      }
-    }
-  }
+/* Rows past a closed fold are found through the line index, without
+ * walking the rows it hides. */
+int editorNextVisibleRow(int at) {
+  if (at + 1 >= E.numrows || !E.row[at + 1].hidden)
+    return at + 1;
+  editorWrapSync();
+  long long rest;
+  return editorRowIndexFind(&E.wrapLines,
+                            editorRowIndexPrefix(&E.wrapLines, at + 1), &rest);
+}
 
-  if (lineCount < linesNeeded)
-    startPos = 0;
+int editorPrevVisibleRow(int at) {
+  if (at <= 0 || !E.row[at - 1].hidden)
+    return at - 1;
+  editorWrapSync();
+  long long rest;
+  return editorRowIndexFind(&E.wrapLines,
+                            editorRowIndexPrefix(&E.wrapLines, at) - 1, &rest);
+}
 
-  int currentLine = 0;
-  int row = startRow + 2;
+/* First row below the screen. */
+int editorScreenEndRow(void) {
+  long long rest;
+  return editorRowIndexFind(&E.wrapLines, editorWrapTop() + E.screenrows,
+                            &rest);
+}
 
-  for (int i = startPos; i < bufferLen && row < E.screenrows; i++) {
-    if (E.term.buffer[i] == '\n') {
-      row++;
-      currentLine = 0;
-    } else {
-      if (currentLine == 0) {
-        snprintf(buf, sizeof(buf), "\x1b[%d;%dH", row, currentLine + 1);
-        write(STDOUT_FILENO, buf, strlen(buf));
-      }
+/* Hides or shows rows [from, to), which changes their screen lines. */
+void editorFoldSet(int from, int to, int hidden) {
+  for (int i = from; i < to; i++)
+    E.row[i].hidden = hidden;
+  editorRowIndexChanged(&E.wrapLines, from, to - from, to - from);
+}
 
-      write(STDOUT_FILENO, &E.term.buffer[i], 1);
-      currentLine++;
+/* Opens the closed fold holding row `at`. */
+void editorFoldOpen(int at) {
+  int from = at, to = at;
+  while (from > 0 && E.row[from - 1].hidden)
+    from--;
+  while (to < E.numrows && E.row[to].hidden)
+    to++;
+  editorFoldSet(from, to, 0);
+}
 
-      if (currentLine >= E.screencols) {
-        currentLine = 0;
-        row++;
-      }
+/* Closes the block opened on the cursor row, or else the innermost block
+ * around the cursor, keeping its first and last rows on screen. On the
+ * first row of a closed fold, opens it again. */
+void editorFoldToggle(void) {
+  if (E.cy >= E.numrows)
+    return;
+  if (E.cy + 1 < E.numrows && E.row[E.cy + 1].hidden) {
+    editorFoldOpen(E.cy + 1);
+    editorSetStatusMessage("Fold opened");
+    return;
+  }
+  editorBracketFinish();
+  erow *row = editorRowPrepare(E.cy);
+
+  /* The outermost bracket the row leaves open. */
+  int open = -1, openDepth = 0, depth = 0, t = 0;
+  for (int i = 0; i < row->rsize; i++) {
+    int dir = editorBracketDir(row, i, &t);
+    if (dir > 0 && open == -1) {
+      open = i;
+      openDepth = depth;
     }
+    depth += dir;
+    if (open != -1 && depth <= openDepth)
+      open = -1;
   }
 
-  resetColor();
+  int openRow = E.cy, closeRow, closePos;
+  int rx = editorRowColStart(row, editorRowCxToRx(row, E.cx));
+  if ((open == -1 && !editorBracketOpenBefore(E.cy, rx, &openRow, &open)) ||
+      !editorBracketCloseAfter(openRow, open + 1, &closeRow, &closePos) ||
+      closeRow - openRow < 2) {
+    editorSetStatusMessage("Nothing to fold");
+    return;
+  }
+  editorFoldSet(openRow + 1, closeRow, 1);
+  E.cy = openRow;
+  E.cx = editorRowRxToCx(&E.row[openRow], editorRowCol(&E.row[openRow], open));
+  int hidden = closeRow - openRow - 1;
+  editorSetStatusMessage("Folded %d line%s", hidden, hidden == 1 ? "" : "s");
 }
 
-void editorTerminalProcessKey(int key) {
-  if (key == CTRL_KEY('t')) {
-    editorTerminalToggle();
-  }
+void editorHandleSigwinch(int sig) {
+  (void)sig;
+  int saved = errno;
+  E.resized = 1;
+  editorWake();
+  errno = saved;
+}
+
+/* Picks up a new terminal size before the next draw. Wrapped rows are
+ * only re-measured if the text width changed. */
+void editorResize(void) {
+  E.resized = 0;
+  int rows, cols;
+  if (getWindowSize(&rows, &cols) == -1)
+    return;
+  E.screenrows = rows - 2;
+  E.screencols = cols;
+  E.term.fullRedraw = 1;
 }
 
 void editorScroll(void) {
@@ -977,12 +6949,23 @@ void editorScroll(void) {
     E.rx = editorRowCxToRx(&E.row[E.cy], E.cx);
   }
 
-  if (E.cy < E.rowoff) {
-    E.rowoff = E.cy;
-  }
-  if (E.cy >= E.rowoff + E.screenrows) {
-    E.rowoff = E.cy - E.screenrows + 1;
+  /* A jump into a closed fold opens it. */
+  if (E.cy < E.numrows && E.row[E.cy].hidden)
+    editorFoldOpen(E.cy);
+
+  int col;
+  long long cursor = editorWrapCursorLine(&col);
+  long long top = editorWrapTop();
+  if (cursor < top)
+    top = cursor;
+  if (cursor >= top + E.screenrows)
+    top = cursor - E.screenrows + 1;
+  editorWrapSetTop(top);
+  if (E.softWrap) {
+    E.coloff = 0;
+    return;
   }
+
   if (E.rx < E.coloff) {
     E.coloff = E.rx;
   }
@@ -991,12 +6974,37 @@ void editorScroll(void) {
   }
 }
 
+/* Writes `len` columns of the row's render from `from`, colored by its
+ * tokens. */
+void editorDrawRowSegment(erow *row, int from, int len) {
+  int pos = from, stop = from + len, t = 0;
+  while (pos < stop) {
+    while (t < row->numTokens &&
+           row->tokens[t].start + row->tokens[t].length <= pos)
+      t++;
+    int color = COLOR_FOREGROUND, end = stop;
+    if (t < row->numTokens && row->tokens[t].start <= pos) {
+      color = editorSyntaxToColor(row->tokens[t].type);
+      if (row->tokens[t].start + row->tokens[t].length < end)
+        end = row->tokens[t].start + row->tokens[t].length;
+    } else if (t < row->numTokens && row->tokens[t].start < end) {
+      end = row->tokens[t].start;
+    }
+    setColor(color);
+    editorWrite(&row->render[pos], end - pos);
+    pos = end;
+  }
+  setColor(COLOR_FOREGROUND);
+}
+
 void editorDrawRows(void) {
   int y;
   int lineNumberWidth = E.showLineNumbers ? 4 : 0;
+  int rows = E.term.visible ? E.screenrows - E.screenrows / 2 : E.screenrows;
+  int filerow = E.rowoff, sub = E.softWrap ? E.wrapoff : 0, next = 0;
 
-  for (y = 0; y < E.screenrows; y++) {
-    int filerow = y + E.rowoff;
+  for (y = 0; y < rows; y++) {
+    int full = 0;
 
     if (filerow >= E.numrows) {
       if (E.numrows == 0 && y == E.screenrows / 3) {
@@ -1010,91 +7018,199 @@ void editorDrawRows(void) {
 
         if (E.showLineNumbers) {
           setColor(COLOR_LINENUMBER);
-          write(STDOUT_FILENO, "    ", 4);
+          editorWrite("    ", 4);
         }
 
         if (padding) {
-          write(STDOUT_FILENO, "~", 1);
+          editorWrite("~", 1);
           padding--;
         }
 
         setColor(COLOR_FOREGROUND);
         while (padding--)
-          write(STDOUT_FILENO, " ", 1);
+          editorWrite(" ", 1);
 
-        write(STDOUT_FILENO, welcome, welcomelen);
+        editorWrite(welcome, welcomelen);
       } else {
         if (E.showLineNumbers) {
           setColor(COLOR_LINENUMBER);
-          write(STDOUT_FILENO, "    ", 4);
+          editorWrite("    ", 4);
         }
 
         setColor(COLOR_FOREGROUND);
-        write(STDOUT_FILENO, "~", 1);
+        editorWrite("~", 1);
       }
     } else {
       if (E.showLineNumbers) {
         char lineNumBuf[5];
         int lineNumLen =
             snprintf(lineNumBuf, sizeof(lineNumBuf), "%3d ", filerow + 1);
+        if (sub > 0)
+          lineNumLen = snprintf(lineNumBuf, sizeof(lineNumBuf), "    ");
         setColor(COLOR_LINENUMBER);
-        write(STDOUT_FILENO, lineNumBuf, lineNumLen);
+        editorWrite(lineNumBuf, lineNumLen);
       }
 
-      setColor(COLOR_FOREGROUND);
-      int len = E.row[filerow].rsize - E.coloff;
-      if (len < 0)
-        len = 0;
-      if (len > E.screencols - lineNumberWidth)
-        len = E.screencols - lineNumberWidth;
-
-      if (len > 0) {
-        write(STDOUT_FILENO, &E.row[filerow].render[E.coloff], len);
+      erow *row = &E.row[filerow];
+      if ((y == 0 || sub == 0) &&
+          (!row->render || (E.syntaxPending && filerow >= E.syntaxNext)))
+        editorSyntaxTokenize(
+            row, filerow > 0 ? E.row[filerow - 1].hasMultilineComment : 0);
+      /* Columns map to render bytes through the row's width cache. A wide
+       * character cut by the left edge leaves blanks in its place. */
+      int from, end, pad = 0;
+      if (E.softWrap) {
+        from = sub == 0 ? 0 : y == 0 ? editorWrapLine(row, sub) : next;
+        end = editorWrapNext(row, from);
+      } else {
+        from = editorRowColStart(row, E.coloff);
+        end = editorRowColEnd(row, E.coloff + E.screencols - lineNumberWidth);
+        if (end < from)
+          end = from;
+        if (from < end)
+          pad = editorRowCol(row, from) - E.coloff;
+      }
+      for (int i = 0; i < pad; i++)
+        editorWrite(" ", 1);
+      editorDrawRowSegment(row, from, end - from);
+      int used = lineNumberWidth + pad + editorRowCol(row, end) -
+                 editorRowCol(row, from);
+
+      /* A wrapped row continues on the next line while render is left. */
+      next = end;
+      if (E.softWrap && end < row->rsize)
+        sub++;
+      else
+        sub = 0;
+
+      if (sub == 0 && filerow + 1 < E.numrows && E.row[filerow + 1].hidden) {
+        char fold[32];
+        int hidden = editorNextVisibleRow(filerow) - filerow - 1;
+        int foldLen = snprintf(fold, sizeof(fold), " ... %d line%s", hidden,
+                               hidden == 1 ? "" : "s");
+        if (foldLen > E.screencols - used)
+          foldLen = E.screencols - used;
+        setColor(COLOR_COMMENT);
+        editorWrite(fold, foldLen);
+        setColor(COLOR_FOREGROUND);
+        used += foldLen;
       }
+      full = used == E.screencols;
     }
+    if (sub == 0)
+      filerow = editorNextVisibleRow(filerow);
+
+    /* Erasing after a full line would clear its last column. */
+    if (!full)
+      editorWrite("\x1b[K", 3);
+    editorWrite("\r\n", 2);
+  }
 
-    write(STDOUT_FILENO, "\x1b[K", 3);
-    write(STDOUT_FILENO, "\r\n", 2);
+  if (rows < E.screenrows) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "\x1b[%d;1H", E.screenrows + 1);
+    editorWrite(buf, strlen(buf));
   }
 }
 
 void editorDrawStatusBar(void) {
-  write(STDOUT_FILENO, "\x1b[7m", 4);
+  editorWrite("\x1b[7m", 4);
   char status[80], rstatus[80];
-  int len = snprintf(status, sizeof(status), "%.20s - %d lines %s",
+  int len = snprintf(status, sizeof(status), "%.20s - %d lines %s%s%s",
                      E.filename ? E.filename : "[No Name]", E.numrows,
-                     E.dirty ? "(modified)" : "");
-  int rlen = snprintf(rstatus, sizeof(rstatus), "%d/%d", E.cy + 1, E.numrows);
+                     E.dirty ? "(modified)" : "",
+                     E.dirty && (E.diskChanged || E.follow) ? " " : "",
+                     E.diskChanged ? "(changed on disk)"
+                     : E.follow    ? "(following)"
+                                   : "");
+  long long total = editorRowOffset(E.numrows);
+  long long byte = editorRowOffset(E.cy) + (E.cy < E.numrows ? E.cx : 0);
+  int rlen = snprintf(rstatus, sizeof(rstatus), "%s%sbyte %lld %d%% | %d/%d",
+                      E.format.bom ? "bom " : "", E.format.crlf ? "crlf " : "",
+                      byte, total ? (int)(byte * 100 / total) : 0, E.cy + 1,
+                      E.numrows);
   if (len > E.screencols)
     len = E.screencols;
-  write(STDOUT_FILENO, status, len);
+  editorWrite(status, len);
   while (len < E.screencols) {
     if (E.screencols - len == rlen) {
-      write(STDOUT_FILENO, rstatus, rlen);
+      editorWrite(rstatus, rlen);
       break;
     } else {
-      write(STDOUT_FILENO, " ", 1);
+      editorWrite(" ", 1);
       len++;
     }
   }
-  write(STDOUT_FILENO, "\x1b[m", 3);
-  write(STDOUT_FILENO, "\r\n", 2);
+  editorWrite("\x1b[m", 3);
+  editorWrite("\r\n", 2);
+}
+
+/* Profiler overlay on the last text line, just above the status bar. It
+ * shows the previous frame, since the current one is still being drawn. */
+void editorDrawProfiler(void) {
+  frameProfiler *p = &E.prof;
+  if (!p->visible)
+    return;
+
+  char hud[160];
+  int len = snprintf(hud, sizeof(hud), " frame %.2fms:", p->lastFrameNs / 1e6);
+  for (int i = 0; i < PROF_PHASES; i++)
+    len += snprintf(hud + len, sizeof(hud) - len, " %s %.2f",
+                    PROF_PHASE_SHORT[i], p->lastNs[i] / 1e6);
+  len += snprintf(hud + len, sizeof(hud) - len, " | %ld sys %.1fKB",
+                  p->lastSyscalls, p->lastBytes / 1024.0);
+  if (p->heap >= 0)
+    len += snprintf(hud + len, sizeof(hud) - len, " | heap %.1fMB",
+                    p->heap / (1024.0 * 1024.0));
+  len += snprintf(hud + len, sizeof(hud) - len, " | idle q%d ", E.idle.depth);
+  if (len > E.screencols)
+    len = E.screencols;
+
+  char buf[32];
+  int blen = snprintf(buf, sizeof(buf), "\x1b[%d;%dH\x1b[7m", E.screenrows,
+                      E.screencols - len + 1);
+  editorWrite(buf, blen);
+  editorWrite(hud, len);
+  editorWrite("\x1b[m", 3);
+}
+
+/* Memory line above the profiler overlay, shown and hidden with it. */
+void editorDrawMemory(void) {
+  if (!E.prof.visible || E.screenrows < 2)
+    return;
+  char line[256];
+  editorMemFormat(line, sizeof(line));
+  int len = strlen(line);
+  if (len > E.screencols)
+    len = E.screencols;
+
+  char buf[32];
+  int blen = snprintf(buf, sizeof(buf), "\x1b[%d;%dH\x1b[7m",
+                      E.screenrows - 1, E.screencols - len + 1);
+  editorWrite(buf, blen);
+  editorWrite(line, len);
+  editorWrite("\x1b[m", 3);
 }
 
 void editorDrawMessageBar(void) {
-  write(STDOUT_FILENO, "\x1b[K", 3);
+  editorWrite("\x1b[K", 3);
   int msglen = strlen(E.statusmsg);
   if (msglen > E.screencols)
     msglen = E.screencols;
   if (msglen && time(NULL) - E.statusmsg_time < 5)
-    write(STDOUT_FILENO, E.statusmsg, msglen);
+    editorWrite(E.statusmsg, msglen);
 }
 
 void editorRefreshScreen(void) {
+  if (E.resized)
+    editorResize();
+  editorProfEnter(PROF_DRAW);
+  editorProfEnter(PROF_SCROLL);
   editorScroll();
+  editorProfLeave();
 
-  write(STDOUT_FILENO, "\x1b[?25l", 6);
-  write(STDOUT_FILENO, "\x1b[H", 3);
+  editorWrite("\x1b[?25l", 6);
+  editorWrite("\x1b[H", 3);
 
   setColor(COLOR_BACKGROUND);
 
@@ -1104,15 +7220,29 @@ void editorRefreshScreen(void) {
 
   editorFileBrowserDraw();
   editorTerminalDraw();
+  editorFinderDraw();
+  editorGrepDraw();
+  editorDrawProfiler();
+  editorDrawMemory();
 
   char buf[32];
   int lineNumberWidth = E.showLineNumbers ? 4 : 0;
-  snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (E.cy - E.rowoff) + 1,
-           (E.rx - E.coloff) + 1 + lineNumberWidth);
-  write(STDOUT_FILENO, buf, strlen(buf));
+  if (E.grep.visible)
+    snprintf(buf, sizeof(buf), "\x1b[1;%dH", 8 + E.grep.queryLen);
+  else if (E.finder.visible)
+    snprintf(buf, sizeof(buf), "\x1b[1;%dH", 13 + E.finder.queryLen);
+  else {
+    int col;
+    long long line = editorWrapCursorLine(&col);
+    snprintf(buf, sizeof(buf), "\x1b[%d;%dH",
+             (int)(line - editorWrapTop()) + 1,
+             col - E.coloff + 1 + lineNumberWidth);
+  }
+  editorWrite(buf, strlen(buf));
 
   resetColor();
-  write(STDOUT_FILENO, "\x1b[?25h", 6);
+  editorWrite("\x1b[?25h", 6);
+  editorProfLeave();
 }
 
 void editorSetStatusMessage(const char *fmt, ...) {
@@ -1123,34 +7253,98 @@ void editorSetStatusMessage(const char *fmt, ...) {
   E.statusmsg_time = time(NULL);
 }
 
+char *editorPrompt(const char *prompt, void (*callback)(char *, int)) {
+  size_t bufsize = 128;
+  char *buf = malloc(bufsize);
+
+  size_t buflen = 0;
+  buf[0] = '\0';
+
+  while (1) {
+    editorSetStatusMessage(prompt, buf);
+    editorRefreshScreen();
+    if (!editorPollEvents())
+      continue;
+
+    int c = editorReadKey();
+    if (c == DEL_KEY || c == CTRL_KEY('h') || c == BACKSPACE) {
+      if (buflen != 0)
+        buf[--buflen] = '\0';
+    } else if (c == '\x1b') {
+      editorSetStatusMessage("");
+      if (callback)
+        callback(buf, c);
+      free(buf);
+      return NULL;
+    } else if (c == '\r') {
+      if (buflen != 0) {
+        editorSetStatusMessage("");
+        if (callback)
+          callback(buf, c);
+        return buf;
+      }
+    } else if (c > 0 && c < 128 && !iscntrl(c)) {
+      if (buflen == bufsize - 1) {
+        bufsize *= 2;
+        buf = realloc(buf, bufsize);
+      }
+      buf[buflen++] = c;
+      buf[buflen] = '\0';
+    }
+
+    if (callback)
+      callback(buf, c);
+  }
+}
+
+
+/* Asks a yes/no question on the message bar. */
+int editorConfirm(const char *prompt) {
+  for (;;) {
+    editorSetStatusMessage("%s (y/n)", prompt);
+    editorRefreshScreen();
+    if (!editorPollEvents())
+      continue;
+    int c = editorReadKey();
+    if (c == 'y' || c == 'Y' || c == 'n' || c == 'N' || c == '\x1b') {
+      editorSetStatusMessage("");
+      return c == 'y' || c == 'Y';
+    }
+  }
+}
+
 void editorMoveCursor(int key) {
+  if (E.softWrap && (key == ARROW_UP || key == ARROW_DOWN)) {
+    editorWrapMoveCursor(key);
+    return;
+  }
   erow *row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
 
   switch (key) {
   case ARROW_LEFT:
     if (E.cx != 0) {
-      E.cx--;
+      E.cx = editorRowPrevChar(row, E.cx);
     } else if (E.cy > 0) {
-      E.cy--;
+      E.cy = editorPrevVisibleRow(E.cy);
       E.cx = E.row[E.cy].size;
     }
     break;
   case ARROW_RIGHT:
     if (row && E.cx < row->size) {
-      E.cx++;
+      E.cx = editorRowNextChar(row, E.cx);
     } else if (row && E.cx == row->size) {
-      E.cy++;
+      E.cy = editorNextVisibleRow(E.cy);
       E.cx = 0;
     }
     break;
   case ARROW_UP:
     if (E.cy != 0) {
-      E.cy--;
+      E.cy = editorPrevVisibleRow(E.cy);
     }
     break;
   case ARROW_DOWN:
     if (E.cy < E.numrows) {
-      E.cy++;
+      E.cy = editorNextVisibleRow(E.cy);
     }
     break;
   }
@@ -1160,11 +7354,97 @@ void editorMoveCursor(int key) {
   if (E.cx > rowlen) {
     E.cx = rowlen;
   }
+  while (E.cx > 0 && E.cx < rowlen && editorUtf8IsCont(row->chars[E.cx]))
+    E.cx--;
+}
+
+void editorWake(void) {
+  char c = 0;
+  if (write(E.wakePipe[1], &c, 1) == -1 && errno != EAGAIN)
+    return;
+}
+
+/* Waits until a key is ready on stdin, servicing terminal jobs meanwhile.
+ * Returns 0 when only background output arrived, so the caller can redraw
+ * without blocking on a read. Queued idle tasks run whenever nothing else
+ * is ready, and return to the caller only when they changed the screen. */
+int editorPollEvents(void) {
+  for (;;) {
+    struct pollfd fds[3 + MAX_TERM_JOBS];
+    int nfds = 0;
+
+    fds[nfds].fd = STDIN_FILENO;
+    fds[nfds].events = POLLIN;
+    fds[nfds].revents = 0;
+    nfds++;
+
+    fds[nfds].fd = E.wakePipe[0];
+    fds[nfds].events = POLLIN;
+    fds[nfds].revents = 0;
+    nfds++;
+
+    fds[nfds].fd = E.inotifyFd;
+    fds[nfds].events = POLLIN;
+    fds[nfds].revents = 0;
+    nfds++;
+
+    int termBase = nfds;
+    nfds += editorTerminalPollFds(&fds[nfds]);
+
+    int timeout = editorTerminalPollTimeout();
+    int swapTimeout = editorSwapPollTimeout();
+    if (swapTimeout != -1 && (timeout == -1 || swapTimeout < timeout))
+      timeout = swapTimeout;
+    if (E.follow && E.inotifyFd == -1 && (timeout == -1 || timeout > 250))
+      timeout = 250;
+    if (editorIdlePending())
+      timeout = 0;
+
+    E.prof.syscalls++;
+    int ready = poll(fds, nfds, timeout);
+    if (ready == -1) {
+      if (errno == EINTR)
+        return 0;
+      die("poll");
+    }
+
+    if (fds[1].revents & POLLIN) {
+      char drain[64];
+      while (read(E.wakePipe[0], drain, sizeof(drain)) > 0)
+        ;
+      editorFileBrowserSync();
+      editorFinderSync();
+      editorGrepSync();
+    }
+
+    if (fds[2].revents & POLLIN)
+      editorWatchProcessEvents();
+    else if (E.follow && E.inotifyFd == -1)
+      editorFollowUpdate();
+
+    editorTerminalHandlePoll(&fds[termBase], nfds - termBase);
+    editorSwapTick();
+
+    if (fds[0].revents & (POLLIN | POLLHUP | POLLERR))
+      return 1;
+    if (ready > 0 || !editorIdlePending() || editorIdleRun())
+      return 0;
+  }
 }
 
 void editorProcessKeypress(void) {
   static int quit_times = QUIT_TIMES;
 
+  if (E.grep.visible) {
+    editorGrepProcessKey(editorReadKey());
+    return;
+  }
+
+  if (E.finder.visible) {
+    editorFinderProcessKey(editorReadKey());
+    return;
+  }
+
   if (E.fb.visible) {
     int c = editorReadKey();
     if (c == CTRL_KEY('b')) {
@@ -1204,8 +7484,10 @@ void editorProcessKeypress(void) {
       quit_times--;
       return;
     }
-    write(STDOUT_FILENO, "\x1b[2J", 4);
-    write(STDOUT_FILENO, "\x1b[H", 3);
+    editorSwapClose(0);
+    editorSwapShutdown();
+    editorWrite("\x1b[2J", 4);
+    editorWrite("\x1b[H", 3);
     exit(0);
     break;
 
@@ -1217,6 +7499,26 @@ void editorProcessKeypress(void) {
     editorReload();
     break;
 
+  case CTRL_KEY('d'):
+    editorFollowToggle();
+    break;
+
+  case CTRL_KEY('p'):
+    editorFinderToggle();
+    break;
+
+  case CTRL_KEY('a'):
+    editorGrepToggle();
+    break;
+
+  case CTRL_KEY('e'):
+    editorFilter();
+    break;
+
+  case CTRL_KEY('\\'):
+    editorProfToggle();
+    break;
+
   case CTRL_KEY('b'):
     editorFileBrowserToggle();
     break;
@@ -1229,6 +7531,26 @@ void editorProcessKeypress(void) {
     editorFind();
     break;
 
+  case CTRL_KEY('g'):
+    editorGotoByte();
+    break;
+
+  case CTRL_KEY('w'):
+    editorWrapToggle();
+    break;
+
+  case CTRL_KEY(']'):
+    editorBracketJump();
+    break;
+
+  case CTRL_KEY('k'):
+    editorFoldToggle();
+    break;
+
+  case CTRL_KEY('o'):
+    editorComplete();
+    break;
+
   case CTRL_KEY('n'):
     E.showLineNumbers = !E.showLineNumbers;
     editorSetStatusMessage("Line numbers %s",
@@ -1265,22 +7587,36 @@ void editorProcessKeypress(void) {
     char c_char = E.cy < E.numrows && E.cx < E.row[E.cy].size
                       ? E.row[E.cy].chars[E.cx]
                       : '\0';
+    int from = E.cx, y = E.cy;
 
-    editorAddToUndo(OP_DELETE_CHAR, E.cx, E.cy, &c_char, 1);
-
-    if (c == DEL_KEY)
+    if (c == DEL_KEY) {
       editorMoveCursor(ARROW_RIGHT);
-    editorDelChar();
+    } else if (E.cy < E.numrows && E.cx > 0) {
+      from = E.cx - 1;
+      while (from > 0 && editorUtf8IsCont(E.row[E.cy].chars[from]))
+        from--;
+    }
+
+    /* A multibyte character is deleted whole, and undo puts all of its
+     * bytes back. */
+    if (E.cy == y && E.cx > from)
+      editorAddToUndo(OP_DELETE_CHAR, from, y, &E.row[y].chars[from],
+                      E.cx - from);
+    else
+      editorAddToUndo(OP_DELETE_CHAR, from, y, &c_char, 1);
+    do
+      editorDelChar();
+    while (E.cy == y && E.cx > from);
   } break;
 
   case PAGE_UP:
   case PAGE_DOWN: {
-    if (c == PAGE_UP) {
-      E.cy = E.rowoff;
-    } else if (c == PAGE_DOWN) {
-      E.cy = E.rowoff + E.screenrows - 1;
-      if (E.cy > E.numrows)
-        E.cy = E.numrows;
+    long long line = editorWrapTop() + (c == PAGE_UP ? 0 : E.screenrows - 1);
+    if (E.softWrap) {
+      editorWrapSetCursor(line);
+    } else {
+      long long rest;
+      E.cy = editorRowIndexFind(&E.wrapLines, line, &rest);
     }
 
     int times = E.screenrows;
@@ -1310,6 +7646,311 @@ void editorProcessKeypress(void) {
   quit_times = QUIT_TIMES;
 }
 
+/* Decodes \n, \t and \\ in a script argument in place. */
+int editorBatchUnescape(char *s) {
+  char *out = s;
+  for (char *p = s; *p; p++) {
+    if (*p == '\\' && p[1]) {
+      p++;
+      *out++ = *p == 'n' ? '\n' : *p == 't' ? '\t' : *p;
+    } else {
+      *out++ = *p;
+    }
+  }
+  *out = '\0';
+  return out - s;
+}
+
+/* Parses a batch script. Each line holds one command:
+ *   goto N|$       move to the start of line N or the last line
+ *   search TEXT    move to the next match at or after the cursor
+ *   replace /A/B/  replace every A with B; any delimiter may be used
+ *   insert TEXT    insert TEXT at the cursor
+ *   delete [N]     delete N lines (default 1) starting at the cursor
+ *   save           write the file if it changed
+ * Blank lines and lines starting with '#' are ignored. */
+batchCommand *editorBatchParse(const char *path, int *numCommands) {
+  FILE *fp = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+  if (!fp) {
+    fprintf(stderr, "%s: %s\n", path, strerror(errno));
+    return NULL;
+  }
+
+  batchCommand *cmds = NULL;
+  int num = 0, cap = 0, lineNo = 0, ok = 1;
+  char *line = NULL;
+  size_t lineCap = 0;
+  ssize_t len;
+  while (ok && (len = getline(&line, &lineCap, fp)) != -1) {
+    lineNo++;
+    while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+      line[--len] = '\0';
+    char *p = line;
+    while (isspace((unsigned char)*p))
+      p++;
+    if (*p == '\0' || *p == '#')
+      continue;
+
+    char *arg = p;
+    while (*arg && !isspace((unsigned char)*arg))
+      arg++;
+    if (*arg)
+      *arg++ = '\0';
+    while (*arg == ' ' || *arg == '\t')
+      arg++;
+
+    if (num == cap) {
+      cap = cap ? cap * 2 : 16;
+      cmds = realloc(cmds, sizeof(batchCommand) * cap);
+    }
+    batchCommand *c = &cmds[num];
+    memset(c, 0, sizeof(*c));
+
+    if (strcmp(p, "goto") == 0) {
+      c->op = BATCH_GOTO;
+      c->count = strcmp(arg, "$") == 0 ? -1 : atoi(arg);
+      ok = c->count != 0;
+    } else if (strcmp(p, "search") == 0 || strcmp(p, "insert") == 0) {
+      c->op = p[0] == 's' ? BATCH_SEARCH : BATCH_INSERT;
+      c->text = strdup(arg);
+      c->textLen = editorBatchUnescape(c->text);
+      ok = c->textLen > 0;
+    } else if (strcmp(p, "replace") == 0) {
+      c->op = BATCH_REPLACE;
+      char delim = arg[0];
+      char *mid = delim ? strchr(arg + 1, delim) : NULL;
+      char *end = mid ? strchr(mid + 1, delim) : NULL;
+      ok = end != NULL && mid > arg + 1;
+      if (ok) {
+        *mid = *end = '\0';
+        c->text = strdup(arg + 1);
+        c->textLen = editorBatchUnescape(c->text);
+        c->with = strdup(mid + 1);
+        c->withLen = editorBatchUnescape(c->with);
+      }
+    } else if (strcmp(p, "delete") == 0) {
+      c->op = BATCH_DELETE;
+      c->count = *arg ? atoi(arg) : 1;
+      ok = c->count > 0;
+    } else if (strcmp(p, "save") == 0) {
+      c->op = BATCH_SAVE;
+    } else {
+      ok = 0;
+    }
+    if (ok)
+      num++;
+    else
+      fprintf(stderr, "%s:%d: invalid command: %s\n", path, lineNo, p);
+  }
+  free(line);
+  if (fp != stdin)
+    fclose(fp);
+
+  if (!ok) {
+    editorBatchFree(cmds, num);
+    return NULL;
+  }
+  *numCommands = num;
+  return cmds;
+}
+
+void editorBatchFree(batchCommand *cmds, int numCommands) {
+  for (int i = 0; i < numCommands; i++) {
+    free(cmds[i].text);
+    free(cmds[i].with);
+  }
+  free(cmds);
+}
+
+int editorBatchReplace(const char *from, int fromLen, const char *to,
+                       int toLen) {
+  abuf ab = ABUF_INIT;
+  int total = 0;
+  for (int y = 0; y < E.numrows; y++) {
+    erow *row = &E.row[y];
+    const char *p = row->chars, *end = row->chars + row->size, *hit;
+    ab.len = 0;
+    while ((hit = editorMemSearch(p, end - p, from, fromLen)) != NULL) {
+      abAppend(&ab, p, hit - p);
+      abAppend(&ab, to, toLen);
+      p = hit + fromLen;
+      total++;
+    }
+    if (p == row->chars)
+      continue;
+    abAppend(&ab, p, end - p);
+    lineSpan span = {0, ab.len};
+    editorReplaceRows(y, 1, ab.b ? ab.b : "", &span, 1);
+    E.dirty++;
+  }
+  abFree(&ab);
+  if (E.cy < E.numrows && E.cx > E.row[E.cy].size)
+    E.cx = E.row[E.cy].size;
+  return total;
+}
+
+/* Runs the script against the open buffer. Returns 1 if a search found
+ * nothing and the rest of the script was skipped, -1 if saving failed.
+ * *saved is set once the file has been written. */
+int editorBatchRun(batchCommand *cmds, int numCommands, int *saved) {
+  *saved = 0;
+  for (int i = 0; i < numCommands; i++) {
+    batchCommand *c = &cmds[i];
+    editorMemEnforceBudget();
+    switch (c->op) {
+    case BATCH_GOTO:
+      E.cy = c->count < 0 || c->count > E.numrows ? E.numrows - 1
+                                                  : c->count - 1;
+      if (E.cy < 0)
+        E.cy = 0;
+      E.cx = 0;
+      break;
+
+    case BATCH_SEARCH: {
+      int found = 0;
+      for (int y = E.cy; y < E.numrows && !found; y++) {
+        erow *row = &E.row[y];
+        int from = y == E.cy ? E.cx : 0;
+        if (from > row->size)
+          continue;
+        const char *hit = editorMemSearch(row->chars + from, row->size - from,
+                                          c->text, c->textLen);
+        if (hit) {
+          E.cy = y;
+          E.cx = hit - row->chars;
+          found = 1;
+        }
+      }
+      if (!found)
+        return 1;
+      break;
+    }
+
+    case BATCH_REPLACE:
+      editorBatchReplace(c->text, c->textLen, c->with, c->withLen);
+      break;
+
+    case BATCH_INSERT:
+      for (int j = 0; j < c->textLen; j++) {
+        if (c->text[j] == '\n')
+          editorInsertNewline();
+        else
+          editorInsertChar(c->text[j]);
+      }
+      break;
+
+    case BATCH_DELETE:
+      for (int j = 0; j < c->count && E.cy < E.numrows; j++)
+        editorDelRow(E.cy);
+      E.cx = 0;
+      break;
+
+    case BATCH_SAVE:
+      if (E.dirty) {
+        editorSave();
+        if (E.dirty)
+          return -1;
+        *saved = 1;
+      }
+      break;
+    }
+  }
+  return 0;
+}
+
+/* `ctextedit --batch SCRIPT FILE...` applies a script to every file without
+ * touching the terminal. Files are handed out to one forked worker per core
+ * through a shared counter, since the editor state is process-global. */
+int editorBatchMain(int argc, char *argv[]) {
+  if (argc < 2) {
+    fprintf(stderr, "usage: ctextedit --batch SCRIPT FILE...\n");
+    return 2;
+  }
+
+  int numCommands;
+  batchCommand *cmds = editorBatchParse(argv[0], &numCommands);
+  if (!cmds)
+    return 2;
+  char **files = argv + 1;
+  int numFiles = argc - 1;
+
+  E.headless = 1;
+  initEditor();
+
+  batchStats *stats = mmap(NULL, sizeof(batchStats), PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (stats == MAP_FAILED)
+    die("mmap");
+  memset(stats, 0, sizeof(*stats));
+
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  int numWorkers = cpus < 1 ? 1 : cpus > BATCH_MAX_WORKERS ? BATCH_MAX_WORKERS
+                                                           : cpus;
+  if (numWorkers > numFiles)
+    numWorkers = numFiles;
+
+  pid_t pids[BATCH_MAX_WORKERS];
+  int forked = 0;
+  for (int i = 0; i < numWorkers; i++) {
+    pid_t pid = numWorkers > 1 ? fork() : -1;
+    if (pid == 0) {
+      editorBatchWorker(cmds, numCommands, files, numFiles, stats);
+      _exit(0);
+    }
+    if (pid > 0)
+      pids[forked++] = pid;
+  }
+  if (forked == 0)
+    editorBatchWorker(cmds, numCommands, files, numFiles, stats);
+  for (int i = 0; i < forked; i++) {
+    int status;
+    waitpid(pids[i], &status, 0);
+  }
+
+  /* A worker that crashed leaves its files unclaimed or unreported. */
+  int failed = stats->failed + numFiles - stats->done;
+  char peak[32];
+  editorFormatBytes(peak, sizeof(peak), stats->peakMem);
+  printf("%d files: %d changed, %d skipped, %d failed, peak memory %s per "
+         "worker\n",
+         numFiles, stats->changed, stats->skipped, failed, peak);
+  munmap(stats, sizeof(batchStats));
+  editorBatchFree(cmds, numCommands);
+  return failed ? 1 : 0;
+}
+
+void editorBatchWorker(batchCommand *cmds, int numCommands, char **files,
+                       int numFiles, batchStats *stats) {
+  int i;
+  while ((i = __atomic_fetch_add(&stats->next, 1, __ATOMIC_RELAXED)) <
+         numFiles) {
+    if (editorOpenFile(files[i]) == -1) {
+      fprintf(stderr, "%s: %s\n", files[i], strerror(errno));
+      __atomic_add_fetch(&stats->failed, 1, __ATOMIC_RELAXED);
+    } else {
+      int saved;
+      int result = editorBatchRun(cmds, numCommands, &saved);
+      if (result == -1) {
+        fprintf(stderr, "%s: %s\n", files[i], E.statusmsg);
+        __atomic_add_fetch(&stats->failed, 1, __ATOMIC_RELAXED);
+      } else if (result == 1) {
+        __atomic_add_fetch(&stats->skipped, 1, __ATOMIC_RELAXED);
+      } else if (saved) {
+        __atomic_add_fetch(&stats->changed, 1, __ATOMIC_RELAXED);
+      }
+    }
+    __atomic_add_fetch(&stats->done, 1, __ATOMIC_RELAXED);
+  }
+
+  editorMemTotal();
+  long long peak = E.mem.peak;
+  long long seen = __atomic_load_n(&stats->peakMem, __ATOMIC_RELAXED);
+  while (peak > seen &&
+         !__atomic_compare_exchange_n(&stats->peakMem, &seen, peak, 0,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    ;
+}
+
 void initEditor(void) {
   E.cx = 0;
   E.cy = 0;
@@ -1319,6 +7960,8 @@ void initEditor(void) {
   E.numrows = 0;
   E.row = NULL;
   E.dirty = 0;
+  E.dirtyFirst = -1;
+  E.dirtyTail = 0;
   E.filename = NULL;
   E.statusmsg[0] = '\0';
   E.statusmsg_time = 0;
@@ -1335,31 +7978,119 @@ void initEditor(void) {
   E.fb.scroll = 0;
   E.fb.selected = 0;
   E.fb.visible = 0;
+  E.fb.listing = NULL;
+  E.fb.numCached = 0;
+  E.fb.clock = 0;
+  E.fb.restoreName[0] = '\0';
+  E.fb.restoreIsDir = 0;
+
+  E.grep.scan = NULL;
+  E.grep.visible = 0;
+  E.grep.queryLen = 0;
+  E.grep.query[0] = '\0';
+  E.grep.hits = NULL;
+  E.grep.numHits = E.grep.capHits = 0;
+  E.grep.selected = E.grep.scroll = 0;
+
+  E.finder.index = NULL;
+  E.finder.visible = 0;
+  E.finder.candidates = NULL;
+  E.finder.numCandidates = E.finder.capCandidates = 0;
+  E.finder.narrowPos = E.finder.narrowOut = E.finder.narrowEnd = 0;
+  E.finder.scored = 0;
+  E.finder.numResults = 0;
+
+#ifdef __linux__
+  E.inotifyFd = E.headless ? -1 : inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+#else
+  E.inotifyFd = -1;
+#endif
+  E.numWatches = 0;
+  E.fileWd = -1;
+  memset(&E.disk, 0, sizeof(E.disk));
+  E.diskChanged = 0;
+  E.follow = 0;
+  E.followOffset = 0;
+  E.followPartial = 0;
+  memset(&E.prof, 0, sizeof(E.prof));
+  memset(&E.idle, 0, sizeof(E.idle));
+  E.idle.budget = IDLE_BUDGET_NS;
+  E.syntaxPending = 0;
+  E.syntaxNext = 0;
+
+  if (pipe(E.wakePipe) == -1)
+    die("pipe");
+  for (int i = 0; i < 2; i++) {
+    fcntl(E.wakePipe[i], F_SETFL, O_NONBLOCK);
+    fcntl(E.wakePipe[i], F_SETFD, FD_CLOEXEC);
+  }
 
-  E.term.buffer = NULL;
-  E.term.size = 0;
+  E.term.numJobs = 0;
+  E.term.active = 0;
   E.term.visible = 0;
+  E.term.fullRedraw = 1;
 
   initColors();
+  editorInitSyntax();
 
-  if (getWindowSize(&E.screenrows, &E.screencols) == -1)
+  if (E.headless) {
+    E.screenrows = 24;
+    E.screencols = 80;
+  } else if (getWindowSize(&E.screenrows, &E.screencols) == -1) {
     die("getWindowSize");
+  }
   E.screenrows -= 2;
+
+  E.term.size = TERM_SCROLLBACK_SIZE;
+  char *scrollback = getenv("CTEXTEDIT_SCROLLBACK");
+  if (scrollback) {
+    unsigned long long size = editorParseSize(scrollback);
+    if (size >= 1024)
+      E.term.size = size;
+  }
+  editorMemInit();
 }
 
+#ifndef CTEXTEDIT_NO_MAIN
 int main(int argc, char *argv[]) {
+  if (argc >= 2 && strcmp(argv[1], "--batch") == 0)
+    return editorBatchMain(argc - 2, argv + 2);
+
   enableRawMode();
   initEditor();
-  if (argc >= 2) {
-    editorOpen(argv[1]);
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = editorHandleSigwinch;
+  sa.sa_flags = SA_RESTART;
+  sigaction(SIGWINCH, &sa, NULL);
+  char *filename = NULL;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--profile") == 0 && i + 1 < argc) {
+      if (editorProfTraceOpen(argv[++i]) == -1)
+        die("profile");
+    } else {
+      filename = argv[i];
+    }
   }
-
-  editorSetStatusMessage("HELP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-F = find");
+  editorSetStatusMessage(
+      "HELP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-F = find | Ctrl-A = grep | "
+      "Ctrl-E = filter");
+  if (filename)
+    editorOpen(filename);
 
   while (1) {
+    editorMemEnforceBudget();
     editorRefreshScreen();
-    editorProcessKeypress();
+    editorProfFrameEnd();
+    int ready = editorPollEvents();
+    editorProfFrameBegin();
+    if (ready) {
+      editorProfEnter(PROF_EDIT);
+      editorProcessKeypress();
+      editorProfLeave();
+    }
   }
 
   return 0;
 }
+#endif
@@ -1,14 +1,20 @@
 #ifndef MAIN_H
 #define MAIN_H
 
+#define _GNU_SOURCE
+
 #include <ctype.h>
 #include <dirent.h>
 #include <errno.h>
+#include <poll.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include <termios.h>
 #include <time.h>
 #include <unistd.h>
@@ -20,7 +26,43 @@
 #define MAX_UNDO_OPERATIONS 100
 #define MAX_TABS 16
 #define MAX_HELP_ENTRIES 32
-#define MAX_FILETYPES 16
+#define MAX_FILETYPES 32
+#define MAX_TERM_JOBS 8
+#define MAX_DIR_CACHE 16
+#define DIR_SCAN_BATCH (1024 * 1024)
+#define DIR_NAME_ARENA (256 * 1024)
+#define MAX_WATCHES (MAX_DIR_CACHE + 1)
+#define RELOAD_DIFF_WINDOW 64
+#define WALK_MAX_THREADS 8
+#define WALK_BATCH 1024
+#define FINDER_MAX_RESULTS 256
+#define GREP_MAX_HITS 10000
+#define GREP_LINE_MAX 256
+#define GREP_CHUNK (1024 * 1024)
+#define FILTER_BUF (64 * 1024)
+#define FILTER_GRACE_MS 200
+#define FILTER_IOV 128
+#define BATCH_MAX_WORKERS 64
+#define PROF_MAX_DEPTH 8
+#define MEM_HEADER_SIZE 16
+#define IDLE_BUDGET_NS 4000000LL
+#define IDLE_INPUT_CHECK_NS 250000LL
+#define SWAP_INTERVAL_MS 2000
+#define SWAP_MAX_HUNKS 1024
+#define SWAP_COMPACT_BYTES (8 * 1024 * 1024)
+#define SWAP_IOV 256
+#define SWAP_MAGIC "CTSWAP1\n"
+#define JOURNAL_MAGIC "CTJRNL1\n"
+#define UTF8_BOM "\xEF\xBB\xBF"
+#define SAVE_IOV_MAX 1024
+#define ROW_INDEX_PENDING 16
+#define WORD_MAX 64
+#define COMPLETE_MAX 8
+#define TERM_SCROLLBACK_SIZE (1024 * 1024)
+#define TERM_MAX_PARAMS 16
+#define TERM_ATTR_BOLD 1
+#define TERM_ATTR_UNDERLINE 2
+#define TERM_ATTR_REVERSE 4
 
 #define CTRL_KEY(k) ((k)&0x1F)
 
@@ -60,6 +102,15 @@ enum editorColors {
   COLOR_ERROR
 };
 
+enum termParserState {
+  TERM_STATE_GROUND,
+  TERM_STATE_ESC,
+  TERM_STATE_CSI,
+  TERM_STATE_OSC,
+  TERM_STATE_OSC_ESC,
+  TERM_STATE_CHARSET
+};
+
 enum operationType {
   OP_INSERT_CHAR,
   OP_DELETE_CHAR,
@@ -145,21 +196,325 @@ typedef struct editorBuffer {
   int active;
 } editorBuffer;
 
+typedef struct rowText {
+  int refcount;
+  char chars[];
+} rowText;
+
 typedef struct erow {
   int size;
   int rsize;
-  char *chars;
+  char *chars; /* inside a rowText shared with snapshots */
   char *render;
+  int *cols; /* display column of each render byte, NULL when all ASCII */
   token *tokens;
   int numTokens;
-  int hasMultilineComment;
+  int bracketDepth; /* net change in bracket depth over the row */
+  int bracketMin;   /* lowest depth reached, relative to the row start */
+  char hasMultilineComment;
+  char hidden; /* inside a closed fold */
 } erow;
 
+typedef struct charWidthRange {
+  unsigned first;
+  unsigned last;
+  int width;
+} charWidthRange;
+
+typedef struct lineSpan {
+  size_t start;
+  size_t len;
+} lineSpan;
+
+typedef struct reloadHunk {
+  int oldStart, oldCount;
+  int newStart, newCount;
+} reloadHunk;
+
+typedef struct snapshotRow {
+  rowText *text;
+  int size;
+} snapshotRow;
+
+typedef struct filterOutput {
+  snapshotRow *rows;
+  int numRows, capRows;
+  char *partial;
+  size_t partialLen, partialCap;
+} filterOutput;
+
+enum batchOp {
+  BATCH_GOTO,
+  BATCH_SEARCH,
+  BATCH_REPLACE,
+  BATCH_INSERT,
+  BATCH_DELETE,
+  BATCH_SAVE
+};
+
+typedef struct batchCommand {
+  enum batchOp op;
+  int count;
+  char *text;
+  int textLen;
+  char *with;
+  int withLen;
+} batchCommand;
+
+typedef struct batchStats {
+  int next;
+  int done;
+  int changed;
+  int skipped;
+  int failed;
+  long long peakMem;
+} batchStats;
+
+enum memTag {
+  MEM_ROWS = 0,
+  MEM_RENDER,
+  MEM_TOKENS,
+  MEM_UNDO,
+  MEM_CLIPBOARD,
+  MEM_TERMINAL,
+  MEM_BROWSER,
+  MEM_MISC,
+  MEM_TAGS
+};
+
+enum idlePriority { IDLE_VISIBLE = 0, IDLE_NORMAL, IDLE_BACKGROUND };
+
+enum idleTask { IDLE_FINDER = 0, IDLE_HIGHLIGHT, IDLE_SWAP, IDLE_TASKS };
+
+typedef struct idleTaskDef {
+  const char *name;
+  int (*step)(void);
+} idleTaskDef;
+
+typedef struct idleScheduler {
+  int queued[IDLE_TASKS];
+  int priority[IDLE_TASKS];
+  int depth;
+  long long budget;
+  long long deadline;
+  long long inputCheck;
+  int redraw;
+  long slices;
+  long preemptions;
+} idleScheduler;
+
+typedef struct memHeader {
+  size_t size;
+  int tag;
+  int buffer;
+} memHeader;
+
+typedef struct memStats {
+  long long bytes[MEM_TAGS];
+  long long buffers[MAX_TABS];
+  long long peak;
+  long long budget;
+  long long floor;
+  long evictions;
+} memStats;
+
+enum profPhase {
+  PROF_INPUT = 0,
+  PROF_EDIT,
+  PROF_SCROLL,
+  PROF_HIGHLIGHT,
+  PROF_DRAW,
+  PROF_PHASES
+};
+
+typedef struct frameProfiler {
+  int enabled;
+  int visible;
+  FILE *trace;
+  long long origin;
+  long long mark;
+  int depth;
+  int stack[PROF_MAX_DEPTH];
+  long long starts[PROF_MAX_DEPTH];
+  long long phaseNs[PROF_PHASES];
+  long long lastNs[PROF_PHASES];
+  long long frameStart, lastFrameNs;
+  long syscalls, frameSyscalls, lastSyscalls;
+  long long bytes, frameBytes, lastBytes;
+  long long heap;
+} frameProfiler;
+
+typedef struct editorSnapshot {
+  int refcount;
+  unsigned long version;
+  char *filename;
+  int numrows;
+  snapshotRow *rows;
+} editorSnapshot;
+
+enum swapRecordType {
+  SWAP_DELTA = 'D',
+  SWAP_CHECKPOINT = 'C',
+  SWAP_REMOVE = 'R'
+};
+
+/* A run of rows replaced since the last swap write: oldCount rows at
+ * oldStart in the previous state became newCount rows at newStart. */
+typedef struct swapHunk {
+  int oldStart, oldCount;
+  int newStart, newCount;
+} swapHunk;
+
+typedef struct swapHeader {
+  char magic[8];
+  long long size;
+  long long mtime;
+  long long ino;
+} swapHeader;
+
+typedef struct swapRecordHeader {
+  int type;
+  int numHunks;
+  long long payload;
+} swapRecordHeader;
+
+typedef struct swapRecord {
+  struct swapRecord *next;
+  int type;
+  char path[1024];
+  swapHeader base;
+  swapHunk *hunks;
+  int numHunks;
+  snapshotRow *rows;
+  int numRows;
+  editorSnapshot *snap;
+} swapRecord;
+
+typedef struct swapState {
+  int disabled;
+  int active;
+  char path[1024];
+  swapHeader base;
+  swapHunk hunks[SWAP_MAX_HUNKS];
+  int numHunks;
+  long long dirtySince;
+  long long logBytes;
+  int written;
+  int error;
+  pthread_t thread;
+  int started;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  swapRecord *queue, *tail;
+  int stop;
+  int fd;
+  char openPath[1024];
+} swapState;
+
+/* How the file ends its lines and whether it starts with a UTF-8 byte
+ * order mark. Rows hold neither; saves put them back. canonical means a
+ * save would write the file back byte for byte. */
+typedef struct fileFormat {
+  int crlf;
+  int bom;
+  int mixed;
+  int canonical;
+} fileFormat;
+
+/* Header of the journal an in-place save writes before touching the file:
+ * `length` bytes follow it, to be written at `offset` of a file that then
+ * has `size` bytes. */
+typedef struct saveJournal {
+  char magic[8];
+  long long ino;
+  long long offset;
+  long long length;
+  long long size;
+} saveJournal;
+
+/* Fenwick tree over a per-row value, such as its length in bytes, for
+ * mapping rows to running totals and back. */
+typedef struct rowIndex {
+  long long *tree;
+  int size;
+  int cap;
+  int stale;
+  int pending[ROW_INDEX_PENDING];
+  int numPending;
+} rowIndex;
+
+/* Segment tree over each row's bracket depth change and lowest depth, for
+ * finding the row where a block closes or opens without walking the rows
+ * in between. Leaves past numrows hold zeros. */
+typedef struct bracketIndex {
+  int *sum;
+  int *min;
+  int leaves;
+  int size;
+  int stale;
+} bracketIndex;
+
+/* Trie of the identifiers in the buffer, built the first time completion
+ * is used. Each node counts the occurrences of the word ending at it and
+ * keeps the highest count in its subtree, so the most used words under a
+ * prefix are found without visiting the rest. rows[i] lists the nodes row
+ * i added, ended by -1, so a row that is tokenized again takes back
+ * exactly what it added before. */
+typedef struct wordNode {
+  int child;
+  int sibling;
+  int parent;
+  int count;
+  int best;
+  char c;
+} wordNode;
+
+typedef struct wordIndex {
+  wordNode *nodes;
+  int numNodes;
+  int capNodes;
+  int **rows;
+  int numRows;
+  int capRows;
+  int active;
+} wordIndex;
+
+typedef struct completion {
+  int cy;
+  int start; /* first byte of the word being completed */
+  int prefixLen;
+  int end; /* cursor after the inserted candidate */
+  unsigned long version;
+  char words[COMPLETE_MAX][WORD_MAX + 1];
+  int numWords;
+  int next;
+} completion;
+
 typedef struct dirEntry {
   char *name;
   int isDir;
 } dirEntry;
 
+typedef struct dirListing {
+  char path[1024];
+  pthread_t thread;
+  pthread_mutex_t lock;
+  int started;
+  int scanning;
+  int cancel;
+  int error;
+  int complete;
+  int stale;
+  int wd;
+  char **arenas;
+  int numArenas;
+  dirEntry *published;
+  int numPublished;
+  dirEntry *entries;
+  int numEntries;
+  unsigned long lastUsed;
+} dirListing;
+
 typedef struct fileBrowser {
   char currentDir[1024];
   dirEntry *entries;
@@ -167,14 +522,218 @@ typedef struct fileBrowser {
   int scroll;
   int selected;
   int visible;
+  dirListing *listing;
+  dirListing *cache[MAX_DIR_CACHE];
+  int numCached;
+  unsigned long clock;
+  char restoreName[256];
+  int restoreIsDir;
 } fileBrowser;
 
+typedef struct ignoreRule {
+  char *pattern;
+  int negate;
+  int dirOnly;
+  int anchored;
+} ignoreRule;
+
+typedef struct ignoreList {
+  int refcount;
+  struct ignoreList *parent;
+  char *base;
+  int baseLen;
+  ignoreRule *rules;
+  int numRules;
+} ignoreList;
+
+typedef struct walkJob {
+  char *path;
+  ignoreList *ignore;
+} walkJob;
+
+typedef struct walkQueue {
+  pthread_mutex_t lock;
+  walkJob *jobs;
+  int head, tail, cap;
+} walkQueue;
+
+typedef struct fileWalker fileWalker;
+
+typedef struct walkWorker {
+  fileWalker *walker;
+  int id;
+  pthread_t thread;
+  int started;
+} walkWorker;
+
+struct fileWalker {
+  int rootFd;
+  int numThreads;
+  walkWorker workers[WALK_MAX_THREADS];
+  walkQueue queues[WALK_MAX_THREADS];
+  int pending;
+  int running;
+  int cancel;
+  void (*visit)(fileWalker *w, int worker, const char *path, size_t len);
+  void (*done)(fileWalker *w, int worker);
+  void *arg;
+};
+
+typedef struct indexWorker {
+  char *arena;
+  size_t arenaUsed;
+  char **batch;
+  int numBatch;
+} indexWorker;
+
+typedef struct fileIndex {
+  char root[1024];
+  fileWalker walker;
+  indexWorker workers[WALK_MAX_THREADS];
+  pthread_mutex_t lock;
+  char **published;
+  int numPublished, capPublished;
+  char **arenas;
+  int numArenas;
+  char **paths;
+  unsigned long long *masks;
+  int *lens;
+  int numPaths, capPaths;
+  int walking;
+} fileIndex;
+
+typedef struct finderMatch {
+  int index;
+  int score;
+} finderMatch;
+
+typedef struct fileFinder {
+  fileIndex *index;
+  int visible;
+  char query[256];
+  int queryLen;
+  unsigned long long queryMask;
+  int *candidates;
+  int numCandidates, capCandidates;
+  int narrowPos, narrowOut, narrowEnd;
+  int scored;
+  finderMatch results[FINDER_MAX_RESULTS];
+  int numResults;
+  int selected;
+  int scroll;
+} fileFinder;
+
+typedef struct grepHit {
+  const char *path;
+  int line;
+  int col;
+  long long offset;
+  const char *text;
+} grepHit;
+
+typedef struct grepWorker {
+  char *arena;
+  size_t arenaUsed;
+  grepHit *batch;
+  int numBatch;
+} grepWorker;
+
+typedef struct grepScan {
+  char root[1024];
+  char query[256];
+  int queryLen;
+  fileWalker walker;
+  grepWorker workers[WALK_MAX_THREADS];
+  pthread_mutex_t lock;
+  grepHit *published;
+  int numPublished, capPublished;
+  char **arenas;
+  int numArenas;
+  int numHits;
+  int filesScanned;
+  int truncated;
+  int walking;
+} grepScan;
+
+typedef struct grepPanel {
+  grepScan *scan;
+  int visible;
+  char root[1024];
+  char query[256];
+  int queryLen;
+  grepHit *hits;
+  int numHits, capHits;
+  int selected;
+  int scroll;
+} grepPanel;
+
+typedef struct fileWatch {
+  int wd;
+  int refs;
+} fileWatch;
+
+typedef struct termScrollback {
+  char *data;
+  size_t cap;
+  unsigned long long end;
+  unsigned long long *lines;
+  int linesCap;
+  int lineHead;
+  int numLines;
+} termScrollback;
+
+typedef struct termCell {
+  unsigned int ch;
+  short fg, bg;
+  unsigned char attr;
+} termCell;
+
+typedef struct termGrid {
+  int rows, cols;
+  termCell *cells;
+  termCell *shown;
+  unsigned char *damage;
+  int cx, cy;
+  int savedCx, savedCy;
+  int shownCy;
+  int wrapPending;
+  int top, bottom;
+  termCell pen;
+  enum termParserState state;
+  int params[TERM_MAX_PARAMS];
+  int numParams;
+  int priv;
+  unsigned int utf8;
+  int utf8Need;
+} termGrid;
+
+typedef struct terminalJob {
+  char *cmd;
+  pid_t pid;
+  int fd;
+  int status;
+  termScrollback sb;
+  termGrid grid;
+  int scroll;
+} terminalJob;
+
 typedef struct terminal {
-  char *buffer;
-  int size;
+  terminalJob jobs[MAX_TERM_JOBS];
+  int numJobs;
+  int active;
+  size_t size;
   int visible;
+  int fullRedraw;
 } terminal;
 
+typedef struct abuf {
+  char *b;
+  int len;
+  int cap;
+} abuf;
+
+#define ABUF_INIT {NULL, 0, 0}
+
 typedef struct helpWindow {
   int visible;
   int scroll;
@@ -192,10 +751,40 @@ typedef struct editorConfig {
   int numrows;
   erow *row;
   int dirty;
+  unsigned long version;
   char *filename;
   char statusmsg[80];
   time_t statusmsg_time;
   struct termios orig_termios;
+  int headless;
+  frameProfiler prof;
+  memStats mem;
+  idleScheduler idle;
+  swapState swap;
+  int wakePipe[2];
+
+  int inotifyFd;
+  fileWatch watches[MAX_WATCHES];
+  int numWatches;
+  int fileWd;
+  struct stat disk;
+  int diskChanged;
+  int diskCanonical;
+  fileFormat format;
+  int dirtyFirst;
+  int dirtyTail;
+  rowIndex bytes;
+  rowIndex wrapLines;
+  bracketIndex brackets;
+  wordIndex words;
+  completion complete;
+  int softWrap;
+  int wrapWidth;
+  int wrapoff;
+  volatile sig_atomic_t resized;
+  int follow;
+  off_t followOffset;
+  int followPartial;
 
   int colors[32];
 
@@ -209,6 +798,8 @@ typedef struct editorConfig {
   int undoIndex;
 
   enum languageType currentLanguage;
+  int syntaxPending;
+  int syntaxNext;
   languageDef *languages[MAX_FILETYPES];
 
   editorBuffer tabs[MAX_TABS];
@@ -217,6 +808,10 @@ typedef struct editorConfig {
 
   fileBrowser fb;
 
+  fileFinder finder;
+
+  grepPanel grep;
+
   terminal term;
 
   helpWindow help;
@@ -228,20 +823,92 @@ void enableRawMode(void);
 void disableRawMode(void);
 void die(const char *s);
 int editorReadKey(void);
+int editorReadKeyRaw(void);
 int getCursorPosition(int *rows, int *cols);
 int getWindowSize(int *rows, int *cols);
 
 void *editorMalloc(size_t size);
 void editorFree(void *ptr);
+void editorMemCount(int tag, int buffer, long long delta);
+long long editorMemTotal(void);
+void *editorAlloc(int tag, size_t size);
+void *editorRealloc(int tag, void *ptr, size_t size);
+char *editorStrdup(int tag, const char *s);
+void editorRelease(void *ptr);
+unsigned long long editorParseSize(const char *s);
+void editorMemInit(void);
+void editorMemEnforceBudget(void);
+int editorFormatBytes(char *buf, size_t size, long long bytes);
+void editorMemFormat(char *buf, size_t size);
+
+void editorIdleSchedule(int task, int priority);
+void editorIdleCancel(int task);
+int editorIdlePending(void);
+int editorIdleYield(void);
+int editorIdleRun(void);
+
+void abAppend(abuf *ab, const char *s, int len);
+void abFree(abuf *ab);
 
 void initColors(void);
+ssize_t editorWrite(const void *buf, size_t len);
+long long editorProfNow(void);
+void editorProfEnter(int phase);
+void editorProfLeave(void);
+void editorProfFrameBegin(void);
+void editorProfFrameEnd(void);
+long long editorHeapUsage(void);
+void editorProfTraceSpan(const char *name, long long start, long long end);
+int editorProfTraceOpen(const char *path);
+void editorProfTraceClose(void);
+void editorProfToggle(void);
+
 void setColor(int color);
 void resetColor(void);
 
+rowText *editorRowTextAlloc(size_t len);
+void editorRowTextRetain(rowText *text);
+void editorRowTextRelease(rowText *text);
+rowText *editorRowText(erow *row);
+void editorRowReserve(erow *row, size_t len);
+
+editorSnapshot *editorSnapshotCreate(void);
+editorSnapshot *editorSnapshotRetain(editorSnapshot *snap);
+void editorSnapshotRelease(editorSnapshot *snap);
+
+int editorIsAscii(const char *s, int len);
+int editorUtf8IsCont(char c);
+int editorUtf8Decode(const char *s, int len, unsigned *cp);
+int editorCharWidth(unsigned cp);
+void editorRowRender(erow *row);
+int editorRowNextChar(erow *row, int cx);
+int editorRowPrevChar(erow *row, int cx);
+int editorRowWidth(erow *row);
+int editorRowCol(erow *row, int at);
+int editorRowColStart(erow *row, int col);
+int editorRowColEnd(erow *row, int col);
 void editorUpdateRow(erow *row);
+void editorRowInit(erow *row, const char *s, size_t len);
+int editorRowEquals(erow *row, const char *s, size_t len);
+void editorSpliceRows(int at, int oldCount, snapshotRow *rows, int newCount);
 void editorInsertRow(int at, char *s, size_t len);
+void editorReplaceRows(int at, int oldCount, const char *data,
+                       const lineSpan *lines, int newCount);
+void editorRowsChanged(int at, int removed, int added);
+void editorDirtyReset(void);
 void editorFreeRow(erow *row);
+void editorRowEvict(erow *row);
 void editorDelRow(int at);
+void editorClearRows(void);
+void editorRowIndexChanged(rowIndex *ri, int at, int removed, int added);
+void editorRowIndexSync(rowIndex *ri, long long (*measure)(int at));
+long long editorRowIndexPrefix(rowIndex *ri, int rows);
+int editorRowIndexFind(rowIndex *ri, long long value, long long *rest);
+long long editorRowBytes(int at);
+long long editorRowOffset(int at);
+int editorOffsetToRow(long long offset, int *col);
+size_t editorRowsBytes(int from, int to);
+char *editorRowsRangeToString(int from, int to, size_t *buflen);
 char *editorRowsToString(int *buflen);
 void editorRowInsertChar(erow *row, int at, int c);
 void editorRowDelChar(erow *row, int at);
@@ -260,11 +927,68 @@ void editorAddToUndo(enum operationType type, int cx, int cy, const char *data,
 void editorUndo(void);
 void editorRedo(void);
 
+const char *editorMapFile(const char *filename, size_t *size);
+void editorUnmapFile(const char *data, size_t size);
+ssize_t editorNextLine(const char *data, size_t size, size_t *pos);
+void editorDetectFormat(const char *data, size_t size, fileFormat *fmt);
+void editorSetFormat(const fileFormat *fmt);
+int editorDiffRows(int oldStart, int oldEnd, const char *data,
+                   const lineSpan *lines, int numLines, reloadHunk **out);
+
 void editorOpen(char *filename);
+int editorOpenFile(char *filename);
 void editorReload(void);
+int editorPwriteAll(int fd, const char *buf, size_t len, off_t offset);
+int editorSaveInPlace(const char *journal, size_t *written,
+                      long long *offset);
+int editorWriteRows(int fd, int from, int to, off_t offset);
+int editorWriteFile(int fd);
+int editorSaveAtomic(void);
+void editorJournalReplay(const char *filename);
 void editorSave(void);
 
+void editorFollowAppend(const char *buf, size_t len);
+int editorFollowRead(void);
+void editorFollowRestart(void);
+void editorFollowUpdate(void);
+void editorFollowToggle(void);
+
+int editorConfirm(const char *prompt);
+void editorHiddenPath(const char *filename, const char *ext, char *out,
+                      size_t size);
+void editorSwapBase(swapHeader *base);
+void editorSwapTrack(int at, int removed, int added);
+swapRecord *editorSwapRecordNew(int type);
+void editorSwapRecordFree(swapRecord *rec);
+void editorSwapEnqueue(swapRecord *rec);
+void editorSwapFlush(void);
+int editorSwapStep(void);
+int editorSwapPollTimeout(void);
+void editorSwapTick(void);
+int editorSwapWriteAll(int fd, struct iovec *iov, int n);
+int editorSwapWriteRecord(int fd, swapRecord *rec);
+void editorSwapWrite(swapState *sw, swapRecord *rec);
+void *editorSwapThread(void *arg);
+void editorSwapReset(void);
+void editorSwapClose(int keep);
+void editorSwapShutdown(void);
+int editorSwapRecover(const char *path);
+void editorSwapOpen(void);
+
+const char *editorMemSearch(const char *hay, size_t n, const char *needle,
+                            size_t m);
+void editorFindCallback(char *query, int key);
 void editorFind(void);
+void editorGotoByte(void);
+
+int editorFilterWrite(int fd, int *row, size_t *rowOff, int end);
+void editorFilterAddLine(filterOutput *fo, const char *s, size_t len);
+void editorFilterCollect(filterOutput *fo, const char *buf, size_t len);
+void editorFilterAppendPartial(filterOutput *fo, const char *s, size_t len);
+void editorFilterFree(filterOutput *fo);
+void editorFilterStop(pid_t pid);
+void editorFilterRows(int start, int end, const char *cmd);
+void editorFilter(void);
 
 void editorAddTab(void);
 void editorCloseCurrentTab(void);
@@ -273,17 +997,137 @@ void editorDrawTabBar(void);
 
 void editorInitSyntax(void);
 void editorDetectLanguage(char *filename);
+void editorSyntaxAddToken(erow *row, enum tokenType type, int start,
+                          int length);
+int editorSyntaxMatchWord(char **words, int numWords, const char *s, int len);
+void editorSyntaxScan(erow *row, int inComment);
+void editorSyntaxTokenize(erow *row, int inComment);
+erow *editorRowPrepare(int at);
 void editorUpdateSyntax(erow *row);
 void editorApplySyntaxToRows(void);
+void editorSyntaxDefer(int from);
+void editorSyntaxShift(int at, int removed, int added);
+int editorSyntaxStep(void);
 int editorSyntaxToColor(int token);
 
+int editorBracketDir(erow *row, int at, int *t);
+void editorBracketPull(int node);
+void editorBracketCount(erow *row, char c);
+void editorBracketUpdate(erow *row);
+void editorBracketChanged(int at, int removed, int added);
+void editorBracketSync(void);
+int editorBracketPrefix(int rows);
+int editorBracketSearch(int node, int lo, int hi, int depth, int from, int to,
+                        int target, int last);
+int editorBracketLastBelow(erow *row, int end, int depth, int target);
+int editorBracketFirstBelow(erow *row, int from, int depth, int target);
+int editorBracketDepthAt(int row, int pos);
+int editorBracketOpenBefore(int row, int pos, int *openRow, int *openPos);
+int editorBracketCloseAfter(int row, int pos, int *closeRow, int *closePos);
+void editorBracketFinish(void);
+void editorBracketJump(void);
+
+int editorWordsChild(int node, char c, int create);
+void editorWordsAdjust(int node, int delta);
+int editorWordsNode(const char *s, int len);
+void editorWordsRelease(int *words);
+void editorWordsIndexRow(erow *row);
+void editorWordsChanged(int at, int removed, int added);
+void editorWordsBuild(void);
+void editorWordsCollect(int node, int skip, int *found, int *num);
+int editorWordsSpell(int node, char *buf);
+int editorWordsLookup(const char *prefix, int len,
+                      char words[][WORD_MAX + 1]);
+void editorComplete(void);
+
+int editorDirEntryCompare(const void *a, const void *b);
+void *editorDirScanThread(void *arg);
+dirListing *editorDirCacheGet(const char *path);
+void editorDirCacheRemove(dirListing *dl);
+void editorDirListingFree(dirListing *dl);
+
+int editorFileBrowserPath(const char *name, char *out, size_t size);
+int editorWatchAdd(const char *dir);
+void editorWatchRemove(int wd);
+void editorWatchFile(void);
+void editorRecordDiskState(void);
+int editorDiskStateChanged(void);
+void editorWatchProcessEvents(void);
+
+ignoreList *editorIgnoreLoad(int dirfd, const char *base, ignoreList *parent);
+void editorIgnoreRetain(ignoreList *list);
+void editorIgnoreRelease(ignoreList *list);
+int editorIgnoreMatch(ignoreList *list, const char *path, int isDir);
+
+void editorWalkPush(fileWalker *w, int worker, char *path, ignoreList *ignore);
+int editorWalkPop(fileWalker *w, int worker, walkJob *job);
+void editorWalkDir(fileWalker *w, int worker, walkJob *job);
+void *editorWalkThread(void *arg);
+int editorWalkStart(fileWalker *w, const char *root);
+void editorWalkJoin(fileWalker *w);
+
+void editorIndexVisit(fileWalker *w, int worker, const char *path, size_t len);
+void editorIndexFlush(fileWalker *w, int worker);
+fileIndex *editorIndexCreate(const char *root);
+void editorIndexFree(fileIndex *idx);
+unsigned long long editorFuzzyMask(const char *s, int len);
+int editorFuzzyScore(const char *path, int len, const char *query, int qlen);
+
+int editorFinderCompare(const void *a, const void *b);
+void editorFinderPush(int index, int score);
+int editorFinderAddCandidate(int index);
+int editorFinderRank(void);
+int editorFinderStep(void);
+int editorFinderPending(void);
+void editorFinderSetQuery(int narrow);
+void editorFinderSync(void);
+void editorFinderToggle(void);
+void editorFinderDraw(void);
+void editorFinderProcessKey(int key);
+
+char *editorGrepCopy(grepScan *gs, int worker, const char *s, size_t len);
+void editorGrepVisit(fileWalker *w, int worker, const char *path, size_t len);
+void editorGrepFlush(fileWalker *w, int worker);
+grepScan *editorGrepStart(const char *root, const char *query);
+void editorGrepFree(grepScan *gs);
+void editorGrepRestart(void);
+void editorGrepSync(void);
+void editorGrepToggle(void);
+void editorGrepDraw(void);
+void editorGrepProcessKey(int key);
+
 void editorFileBrowserToggle(void);
 void editorFileBrowserUpdate(void);
+void editorFileBrowserRefresh(void);
+void editorFileBrowserSync(void);
 void editorFileBrowserDraw(void);
 void editorFileBrowserProcessKey(int key);
 
+void editorScrollbackInit(termScrollback *sb, size_t cap);
+void editorScrollbackFree(termScrollback *sb);
+void editorScrollbackPushLine(termScrollback *sb, unsigned long long start);
+void editorScrollbackAppend(termScrollback *sb, const char *s, size_t len);
+int editorScrollbackGetLine(termScrollback *sb, int idx, char *out, int max);
+
+int editorEncodeUtf8(unsigned int cp, char *out);
+void editorGridInit(termGrid *g, int rows, int cols);
+void editorGridFree(termGrid *g);
+void editorGridClear(termGrid *g, int row, int from, int to);
+void editorGridScroll(terminalJob *job, int top, int bottom, int n);
+void editorGridNewline(terminalJob *job);
+void editorGridPut(terminalJob *job, unsigned int ch);
+void editorGridCsi(terminalJob *job, int final);
+void editorGridFeed(terminalJob *job, const char *s, size_t len);
+int editorGridCellEquals(const termCell *a, const termCell *b);
+void editorGridDrawRow(termGrid *g, abuf *ab, int r, int screenRow, int full,
+                       int cursor);
+
 void editorTerminalToggle(void);
 void editorTerminalExecute(const char *cmd);
+void editorTerminalCloseJob(int idx);
+int editorTerminalPollFds(struct pollfd *fds);
+int editorTerminalHandlePoll(struct pollfd *fds, int nfds);
+int editorTerminalPollTimeout(void);
 void editorTerminalDraw(void);
 void editorTerminalProcessKey(int key);
 
@@ -294,16 +1138,52 @@ void editorHelpProcessKey(int key);
 
 void editorExitOpenBuffer(void);
 
+int editorWrapWidth(void);
+int editorWrapNext(erow *row, int start);
+int editorWrapLine(erow *row, int sub);
+int editorWrapLineOf(erow *row, int rx, int *start);
+long long editorRowHeight(int at);
+void editorWrapSync(void);
+long long editorWrapCursorLine(int *col);
+long long editorWrapTop(void);
+void editorWrapSetTop(long long line);
+void editorWrapSetCursor(long long line);
+void editorWrapMoveCursor(int key);
+void editorWrapToggle(void);
+int editorNextVisibleRow(int at);
+int editorPrevVisibleRow(int at);
+int editorScreenEndRow(void);
+void editorFoldSet(int from, int to, int hidden);
+void editorFoldOpen(int at);
+void editorFoldToggle(void);
+void editorHandleSigwinch(int sig);
+void editorResize(void);
 void editorScroll(void);
+void editorDrawRowSegment(erow *row, int from, int len);
 void editorDrawRows(void);
 void editorDrawStatusBar(void);
+void editorDrawProfiler(void);
+void editorDrawMemory(void);
 void editorDrawMessageBar(void);
 void editorRefreshScreen(void);
 void editorSetStatusMessage(const char *fmt, ...);
+char *editorPrompt(const char *prompt, void (*callback)(char *, int));
 
 void editorMoveCursor(int key);
+void editorWake(void);
+int editorPollEvents(void);
 void editorProcessKeypress(void);
 
+int editorBatchUnescape(char *s);
+batchCommand *editorBatchParse(const char *path, int *numCommands);
+void editorBatchFree(batchCommand *cmds, int numCommands);
+int editorBatchReplace(const char *from, int fromLen, const char *to,
+                       int toLen);
+int editorBatchRun(batchCommand *cmds, int numCommands, int *saved);
+int editorBatchMain(int argc, char *argv[]);
+void editorBatchWorker(batchCommand *cmds, int numCommands, char **files,
+                       int numFiles, batchStats *stats);
+
 void initEditor(void);
 
 #endif